@@ -0,0 +1,792 @@
+#include "test.h"
+#include "common-convert.h"
+#include "common-stream.h"
+
+static const uint32_t formats[] = {
+	DRM_FORMAT_XRGB8888,
+	DRM_FORMAT_YUYV,
+	DRM_FORMAT_UYVY,
+	DRM_FORMAT_NV12,
+	DRM_FORMAT_RGB565,
+};
+
+static bool use_memfd;
+static int drm_fd = -1;
+static const char *memory_name = "malloc";
+/* dumb buffers mapped through their dma-buf, cpu access bracketed with syncs */
+static bool cpu_sync;
+/* bit 0 direct writes, bit 1 streaming writes */
+static unsigned write_modes = 3;
+static bool json_output;
+static const char *kernel_filter;
+static int iterations = 50;
+
+static void usage()
+{
+	printf("usage: bench [-s <width>x<height>]... [-n <iterations>] [-t <max threads>]\n"
+		"             [-k <kernel>] [-m | -c <card> [-d]] [-w direct|stream] [-j]\n"
+		"\n"
+		"  -s  resolution, can be given multiple times\n"
+		"  -k  only run kernels whose name contains <kernel>\n"
+		"  -m  memfd backed buffers instead of malloc\n"
+		"  -c  dumb buffers from the given card instead of malloc\n"
+		"  -d  also run with the dumb buffers mapped through dma-buf, with syncs\n"
+		"  -w  only direct or streaming framebuffer writes, default both\n"
+		"  -j  JSON lines output\n");
+
+	exit(1);
+}
+
+static const char *format_name(uint32_t format)
+{
+	static char name[5];
+
+	memcpy(name, &format, 4);
+
+	return name;
+}
+
+/* average bits per pixel over all planes */
+static unsigned format_bpp(uint32_t format)
+{
+	switch (format) {
+		case DRM_FORMAT_XRGB8888:
+			return 32;
+		case DRM_FORMAT_NV12:
+			return 12;
+		default:
+			return 16;
+	}
+}
+
+/*
+ * malloc or memfd backed framebuffer, strides aligned like typical dumb
+ * buffers. With memfd all planes are in one shared mapping, and fb->fd
+ * holds the memfd. With a card given, a real (usually write-combined)
+ * dumb buffer.
+ */
+static void alloc_fb(uint32_t width, uint32_t height, uint32_t format,
+	struct framebuffer *fb)
+{
+	uint32_t line_bytes[2] = { 0 };
+	size_t total = 0;
+
+	if (drm_fd >= 0) {
+		drm_create_dumb_fb3(drm_fd, width, height, format,
+			cpu_sync ? DRM_FB_DMABUF_MAP : 0, fb);
+		return;
+	}
+
+	memset(fb, 0, sizeof(*fb));
+
+	fb->fd = -1;
+	fb->width = width;
+	fb->height = height;
+	fb->format = format;
+
+	switch (format) {
+		case DRM_FORMAT_XRGB8888:
+			fb->num_planes = 1;
+			line_bytes[0] = width * 4;
+			break;
+
+		case DRM_FORMAT_YUYV:
+		case DRM_FORMAT_UYVY:
+		case DRM_FORMAT_RGB565:
+			fb->num_planes = 1;
+			line_bytes[0] = width * 2;
+			break;
+
+		case DRM_FORMAT_NV12:
+			fb->num_planes = 2;
+			line_bytes[0] = width;
+			line_bytes[1] = width;
+			break;
+
+		default:
+			ASSERT(false);
+	}
+
+	for (int i = 0; i < fb->num_planes; ++i) {
+		struct framebuffer_plane *plane = &fb->planes[i];
+		uint32_t lines = i == 0 ? height : (height + 1) / 2;
+
+		plane->stride = (line_bytes[i] + 63) & ~63;
+		plane->size = plane->stride * lines;
+
+		total += (plane->size + 4095) & ~4095;
+	}
+
+	if (use_memfd) {
+		int r;
+		uint8_t *map;
+
+		fb->fd = memfd_create("bench", MFD_CLOEXEC);
+		ASSERT(fb->fd >= 0);
+
+		r = ftruncate(fb->fd, total);
+		ASSERT(r == 0);
+
+		map = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fb->fd, 0);
+		ASSERT(map != MAP_FAILED);
+
+		for (int i = 0; i < fb->num_planes; ++i) {
+			fb->planes[i].map = map;
+			map += (fb->planes[i].size + 4095) & ~4095;
+		}
+	} else {
+		for (int i = 0; i < fb->num_planes; ++i) {
+			fb->planes[i].map = aligned_alloc(64, fb->planes[i].size);
+			ASSERT(fb->planes[i].map);
+		}
+	}
+
+	for (int i = 0; i < fb->num_planes; ++i)
+		memset(fb->planes[i].map, 0, fb->planes[i].size);
+}
+
+static void free_fb(struct framebuffer *fb)
+{
+	if (fb->fb_id) {
+		drm_destroy_dumb_fb(fb);
+	} else if (fb->fd >= 0) {
+		size_t total = 0;
+
+		for (int i = 0; i < fb->num_planes; ++i)
+			total += (fb->planes[i].size + 4095) & ~4095;
+
+		munmap(fb->planes[0].map, total);
+		close(fb->fd);
+	} else {
+		for (int i = 0; i < fb->num_planes; ++i)
+			free(fb->planes[i].map);
+	}
+
+	memset(fb, 0, sizeof(*fb));
+}
+
+static bool compare_fb(struct framebuffer *a, struct framebuffer *b)
+{
+	for (int i = 0; i < a->num_planes; ++i) {
+		const struct framebuffer_plane *pa = &a->planes[i];
+		const struct framebuffer_plane *pb = &b->planes[i];
+		uint32_t lines = pa->size / pa->stride;
+
+		for (uint32_t y = 0; y < lines; ++y) {
+			if (memcmp(pa->map + pa->stride * y, pb->map + pb->stride * y,
+				pa->stride) != 0)
+				return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Reference conversion: the original per-pixel code the converters in
+ * common-convert.c have to match byte for byte.
+ */
+
+static void ref_read_yuv(struct framebuffer *fb, int x, int y,
+	unsigned *py, unsigned *pu, unsigned *pv)
+{
+	uint32_t *pc = (uint32_t *)(fb->planes[0].map + fb->planes[0].stride * y);
+	uint32_t c = pc[x];
+
+	uint8_t r = (c >> 16) & 0xff;
+	uint8_t g = (c >> 8) & 0xff;
+	uint8_t b = c & 0xff;
+
+	*py = (uint8_t)MAKE_YUV_601_Y(r, g, b);
+	*pu = (uint8_t)MAKE_YUV_601_U(r, g, b);
+	*pv = (uint8_t)MAKE_YUV_601_V(r, g, b);
+}
+
+static void ref_rgb_to_packed_yuv(struct framebuffer *dst_fb, struct framebuffer *src_fb)
+{
+	uint8_t *dst = dst_fb->planes[0].map;
+
+	for (int y = 0; y < src_fb->height; ++y) {
+		for (int x = 0; x < src_fb->width; x += 2) {
+			unsigned y1, u1, v1, y2, u2, v2;
+
+			ref_read_yuv(src_fb, x + 0, y, &y1, &u1, &v1);
+			ref_read_yuv(src_fb, x + 1, y, &y2, &u2, &v2);
+
+			if (dst_fb->format == DRM_FORMAT_UYVY) {
+				dst[x * 2 + 0] = (u1 + u2) / 2;
+				dst[x * 2 + 1] = y1;
+				dst[x * 2 + 2] = (v1 + v2) / 2;
+				dst[x * 2 + 3] = y2;
+			} else {
+				dst[x * 2 + 0] = y1;
+				dst[x * 2 + 1] = (u1 + u2) / 2;
+				dst[x * 2 + 2] = y2;
+				dst[x * 2 + 3] = (v1 + v2) / 2;
+			}
+		}
+
+		dst += dst_fb->planes[0].stride;
+	}
+}
+
+static void ref_rgb_to_semiplanar_yuv(struct framebuffer *dst_fb, struct framebuffer *src_fb)
+{
+	uint8_t *dst_y = dst_fb->planes[0].map;
+	uint8_t *dst_uv = dst_fb->planes[1].map;
+	unsigned yy, u, v;
+
+	for (int y = 0; y < src_fb->height; ++y) {
+		for (int x = 0; x < src_fb->width; ++x) {
+			ref_read_yuv(src_fb, x, y, &yy, &u, &v);
+			dst_y[x] = yy;
+		}
+
+		dst_y += dst_fb->planes[0].stride;
+	}
+
+	for (int y = 0; y < src_fb->height; y += 2) {
+		for (int x = 0; x < src_fb->width; x += 2) {
+			unsigned su = 0, sv = 0;
+
+			for (int i = 0; i < 4; ++i) {
+				/* the last line of an odd height pairs with itself */
+				int sy = y + (i >> 1) < src_fb->height ? y + (i >> 1) : y;
+
+				ref_read_yuv(src_fb, x + (i & 1), sy, &yy, &u, &v);
+				su += u;
+				sv += v;
+			}
+
+			dst_uv[x + 0] = su / 4;
+			dst_uv[x + 1] = sv / 4;
+		}
+
+		dst_uv += dst_fb->planes[1].stride;
+	}
+}
+
+static void ref_rgb_to_rgb565(struct framebuffer *dst_fb, struct framebuffer *src_fb)
+{
+	uint8_t *dst = dst_fb->planes[0].map;
+
+	for (int y = 0; y < src_fb->height; ++y) {
+		uint32_t *src = (uint32_t *)(src_fb->planes[0].map + src_fb->planes[0].stride * y);
+
+		for (int x = 0; x < src_fb->width; ++x) {
+			unsigned r = ((src[x] >> 16) & 0xff) * 32 / 256;
+			unsigned g = ((src[x] >> 8) & 0xff) * 64 / 256;
+			unsigned b = (src[x] & 0xff) * 32 / 256;
+
+			((uint16_t *)dst)[x] = (r << 11) | (g << 5) | (b << 0);
+		}
+
+		dst += dst_fb->planes[0].stride;
+	}
+}
+
+static void ref_color_convert(struct framebuffer *dst, struct framebuffer *src)
+{
+	switch (dst->format) {
+		case DRM_FORMAT_NV12:
+			ref_rgb_to_semiplanar_yuv(dst, src);
+			break;
+
+		case DRM_FORMAT_YUYV:
+		case DRM_FORMAT_UYVY:
+			ref_rgb_to_packed_yuv(dst, src);
+			break;
+
+		case DRM_FORMAT_RGB565:
+			ref_rgb_to_rgb565(dst, src);
+			break;
+
+		default:
+			ASSERT(false);
+	}
+}
+
+static void fill_random(struct framebuffer *fb)
+{
+	drm_fb_begin_cpu_access(fb, DRM_FB_ACCESS_WRITE);
+
+	for (uint32_t y = 0; y < fb->height; ++y) {
+		uint32_t *line = (uint32_t *)(fb->planes[0].map + fb->planes[0].stride * y);
+
+		for (uint32_t x = 0; x < fb->width; ++x)
+			line[x] = ((uint32_t)rand() << 16) ^ rand();
+	}
+
+	drm_fb_end_cpu_access(fb, DRM_FB_ACCESS_WRITE);
+}
+
+static bool verify_convert(const struct convert_ops *ops, struct framebuffer *src,
+	uint32_t format, bool stream)
+{
+	struct framebuffer ref, dst;
+	bool ok;
+
+	alloc_fb(src->width, src->height, format, &ref);
+	alloc_fb(src->width, src->height, format, &dst);
+
+	if (stream)
+		dst.flags |= DRM_FB_STREAM;
+	else
+		dst.flags &= ~DRM_FB_STREAM;
+
+	drm_fb_begin_cpu_access(src, DRM_FB_ACCESS_READ);
+	drm_fb_begin_cpu_access(&ref, DRM_FB_ACCESS_READ | DRM_FB_ACCESS_WRITE);
+	drm_fb_begin_cpu_access(&dst, DRM_FB_ACCESS_READ | DRM_FB_ACCESS_WRITE);
+
+	ref_color_convert(&ref, src);
+
+	convert_set_ops(ops);
+	fb_color_convert(&dst, src);
+
+	ok = compare_fb(&ref, &dst);
+
+	drm_fb_end_cpu_access(&dst, DRM_FB_ACCESS_READ | DRM_FB_ACCESS_WRITE);
+	drm_fb_end_cpu_access(&ref, DRM_FB_ACCESS_READ | DRM_FB_ACCESS_WRITE);
+	drm_fb_end_cpu_access(src, DRM_FB_ACCESS_READ);
+
+	free_fb(&dst);
+	free_fb(&ref);
+
+	return ok;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double da = *(const double *)a, db = *(const double *)b;
+
+	return da < db ? -1 : da > db;
+}
+
+static double elapsed_ns(const struct timespec *ts1, const struct timespec *ts2)
+{
+	return (ts2->tv_sec - ts1->tv_sec) * 1e9 + (ts2->tv_nsec - ts1->tv_nsec);
+}
+
+static void print_header(void)
+{
+	if (json_output)
+		return;
+
+	printf("streaming writes: %s stores\n\n", stream_store_name());
+
+	printf("%-14s %-5s %-4s %-10s %3s %-6s %-6s %9s %9s %9s %9s %7s\n",
+		"kernel", "var", "fmt", "size", "thr", "mem", "write", "min us", "med us",
+		"p99 us", "MPix/s", "GB/s");
+}
+
+/*
+ * Time 'func' on 'fb' for each iteration, and report the spread and the
+ * throughput of the median for the given pixels and bytes per call.
+ */
+typedef void (*kernel_func)(struct framebuffer *fb, void *arg);
+
+/* the syncs are part of the cost of a cached mapping, so they are timed too */
+static void call_kernel(kernel_func func, struct framebuffer *fb, void *arg)
+{
+	if (cpu_sync)
+		drm_fb_begin_cpu_access(fb, DRM_FB_ACCESS_WRITE);
+
+	func(fb, arg);
+
+	if (cpu_sync)
+		drm_fb_end_cpu_access(fb, DRM_FB_ACCESS_WRITE);
+}
+
+static void run_kernel_mode(const char *kernel, const char *variant, struct framebuffer *fb,
+	kernel_func func, void *arg, double pixels, double bytes, bool stream)
+{
+	double ns[iterations];
+
+	uint32_t flags = fb->flags;
+
+	/* both write modes on every memory, whatever the mapping would pick */
+	if (stream)
+		fb->flags |= DRM_FB_STREAM;
+	else
+		fb->flags &= ~DRM_FB_STREAM;
+
+	/* warm up */
+	call_kernel(func, fb, arg);
+
+	for (int i = 0; i < iterations; ++i) {
+		struct timespec ts1, ts2;
+
+		get_time_now(&ts1);
+		call_kernel(func, fb, arg);
+		get_time_now(&ts2);
+
+		ns[i] = elapsed_ns(&ts1, &ts2);
+	}
+
+	fb->flags = flags;
+
+	qsort(ns, iterations, sizeof(ns[0]), cmp_double);
+
+	double min = ns[0] / 1000;
+	double med = ns[iterations / 2] / 1000;
+	double p99 = ns[(iterations * 99 - 1) / 100] / 1000;
+	double mpix = pixels / med;
+	double gbs = bytes / med / 1000;
+	int threads = drm_draw_get_num_threads();
+
+	if (json_output) {
+		printf("{\"kernel\":\"%s\",\"variant\":\"%s\",\"format\":\"%s\","
+			"\"width\":%u,\"height\":%u,\"threads\":%d,\"memory\":\"%s\","
+			"\"write\":\"%s\",\"stores\":\"%s\",\"min_us\":%.2f,\"median_us\":%.2f,"
+			"\"p99_us\":%.2f,\"mpix_s\":%.1f,\"gb_s\":%.3f}\n",
+			kernel, variant, format_name(fb->format), fb->width, fb->height,
+			threads, memory_name, stream ? "stream" : "direct",
+			stream ? stream_store_name() : "ordinary", min, med, p99, mpix, gbs);
+	} else {
+		char size[16];
+
+		snprintf(size, sizeof(size), "%ux%u", fb->width, fb->height);
+
+		printf("%-14s %-5s %-4s %-10s %3d %-6s %-6s %9.1f %9.1f %9.1f %9.1f %7.2f\n",
+			kernel, variant, format_name(fb->format), size, threads, memory_name,
+			stream ? "stream" : "direct", min, med, p99, mpix, gbs);
+	}
+
+	fflush(stdout);
+}
+
+static void run_kernel(const char *kernel, const char *variant, struct framebuffer *fb,
+	kernel_func func, void *arg, double pixels, double bytes)
+{
+	if (kernel_filter && !strstr(kernel, kernel_filter))
+		return;
+
+	if (write_modes & 1)
+		run_kernel_mode(kernel, variant, fb, func, arg, pixels, bytes, false);
+
+	if (write_modes & 2)
+		run_kernel_mode(kernel, variant, fb, func, arg, pixels, bytes, true);
+}
+
+static void kernel_pattern(struct framebuffer *fb, void *arg)
+{
+	drm_draw_test_pattern(fb, *(int *)arg);
+}
+
+static void kernel_clear(struct framebuffer *fb, void *arg)
+{
+	drm_clear_fb(fb);
+}
+
+static void kernel_convert(struct framebuffer *fb, void *arg)
+{
+	if (cpu_sync)
+		drm_fb_begin_cpu_access(arg, DRM_FB_ACCESS_READ);
+
+	fb_color_convert(fb, arg);
+
+	if (cpu_sync)
+		drm_fb_end_cpu_access(arg, DRM_FB_ACCESS_READ);
+}
+
+/* one bar move, like db does every frame */
+static const int bar_width = 40, bar_speed = 8;
+
+static void kernel_bar(struct framebuffer *fb, void *arg)
+{
+	int *xpos = arg;
+	int old_xpos = *xpos;
+
+	*xpos = (*xpos + bar_speed) % (fb->width - bar_width);
+
+	drm_draw_color_bar(fb, old_xpos, *xpos, bar_width, NULL);
+}
+
+static void bench_patterns(uint32_t width, uint32_t height, bool cached)
+{
+	double pixels = (double)width * height;
+
+	drm_pattern_cache_enable(cached);
+
+	for (int pattern = 0; pattern < 3; ++pattern) {
+		char variant[12];
+
+		snprintf(variant, sizeof(variant), "%d", pattern);
+
+		for (int f = 0; f < ARRAY_SIZE(formats); ++f) {
+			struct framebuffer fb;
+
+			alloc_fb(width, height, formats[f], &fb);
+
+			run_kernel(cached ? "pattern-cached" : "pattern", variant, &fb,
+				kernel_pattern, &pattern, pixels,
+				pixels * format_bpp(formats[f]) / 8);
+
+			free_fb(&fb);
+		}
+	}
+
+	drm_pattern_cache_flush();
+	drm_pattern_cache_enable(false);
+}
+
+static void bench_clears(uint32_t width, uint32_t height)
+{
+	double pixels = (double)width * height;
+
+	for (int f = 0; f < ARRAY_SIZE(formats); ++f) {
+		struct framebuffer fb;
+
+		alloc_fb(width, height, formats[f], &fb);
+
+		run_kernel("clear", "-", &fb, kernel_clear, NULL, pixels,
+			pixels * format_bpp(formats[f]) / 8);
+
+		free_fb(&fb);
+	}
+}
+
+static void bench_bars(uint32_t width, uint32_t height)
+{
+	/* the old bar is cleared and the new one drawn */
+	double pixels = 2.0 * bar_width * height;
+
+	for (int f = 0; f < ARRAY_SIZE(formats); ++f) {
+		struct framebuffer fb;
+		int xpos = 0;
+
+		alloc_fb(width, height, formats[f], &fb);
+
+		drm_draw_color_bar(&fb, -1, xpos, bar_width, NULL);
+
+		run_kernel("bar", "-", &fb, kernel_bar, &xpos, pixels,
+			pixels * format_bpp(formats[f]) / 8);
+
+		free_fb(&fb);
+	}
+}
+
+static void bench_converts(struct framebuffer *src, const struct convert_ops **ops,
+	int num_ops)
+{
+	double pixels = (double)src->width * src->height;
+
+	for (int f = 1; f < ARRAY_SIZE(formats); ++f) {
+		struct framebuffer dst;
+
+		alloc_fb(src->width, src->height, formats[f], &dst);
+
+		for (int i = 0; i < num_ops; ++i) {
+			convert_set_ops(ops[i]);
+
+			/* XRGB8888 read plus the destination written */
+			run_kernel("convert", ops[i]->name, &dst, kernel_convert, src, pixels,
+				pixels * (32 + format_bpp(formats[f])) / 8);
+		}
+
+		free_fb(&dst);
+	}
+
+	/* back to the fastest */
+	convert_set_ops(ops[num_ops - 1]);
+}
+
+/* the threaded paths at 2..max_threads threads */
+static void bench_threads(struct framebuffer *src, int max_threads)
+{
+	double pixels = (double)src->width * src->height;
+	int pattern = 0;
+
+	for (int t = 2; t <= max_threads; ++t) {
+		struct framebuffer fb;
+
+		drm_draw_set_num_threads(t);
+
+		alloc_fb(src->width, src->height, DRM_FORMAT_XRGB8888, &fb);
+		run_kernel("pattern", "0", &fb, kernel_pattern, &pattern, pixels, pixels * 4);
+		free_fb(&fb);
+
+		alloc_fb(src->width, src->height, DRM_FORMAT_NV12, &fb);
+		run_kernel("pattern", "0", &fb, kernel_pattern, &pattern, pixels, pixels * 1.5);
+		run_kernel("convert", convert_get_ops()->name, &fb, kernel_convert, src,
+			pixels, pixels * 5.5);
+		run_kernel("clear", "-", &fb, kernel_clear, NULL, pixels, pixels * 1.5);
+		free_fb(&fb);
+	}
+
+	drm_draw_set_num_threads(1);
+}
+
+static bool verify(struct framebuffer *src, const struct convert_ops **ops, int num_ops)
+{
+	bool ok = true;
+
+	/* against the reference on noise and on a real pattern */
+	for (int n = 0; n < 2; ++n) {
+		if (n == 0) {
+			fill_random(src);
+		} else {
+			drm_fb_begin_cpu_access(src, DRM_FB_ACCESS_WRITE);
+			drm_draw_test_pattern(src, 0);
+			drm_fb_end_cpu_access(src, DRM_FB_ACCESS_WRITE);
+		}
+
+		for (int i = 0; i < num_ops; ++i) {
+			for (int f = 1; f < ARRAY_SIZE(formats); ++f) {
+				for (int stream = 0; stream < 2; ++stream) {
+					if (verify_convert(ops[i], src, formats[f], stream))
+						continue;
+
+					fprintf(stderr, "convert %s %s %ux%u %s: mismatch with reference\n",
+						ops[i]->name, format_name(formats[f]),
+						src->width, src->height,
+						stream ? "stream" : "direct");
+					ok = false;
+				}
+			}
+		}
+	}
+
+	convert_set_ops(ops[num_ops - 1]);
+
+	return ok;
+}
+
+static bool bench_size(uint32_t width, uint32_t height, const struct convert_ops **ops,
+	int num_ops, int max_threads)
+{
+	struct framebuffer src;
+	bool ok;
+
+	alloc_fb(width, height, DRM_FORMAT_XRGB8888, &src);
+
+	/* verification runs threaded, the kernels single threaded */
+	drm_draw_set_num_threads(max_threads);
+
+	ok = verify(&src, ops, num_ops);
+
+	drm_draw_set_num_threads(1);
+
+	bench_patterns(src.width, src.height, false);
+	bench_patterns(src.width, src.height, true);
+	bench_clears(src.width, src.height);
+	bench_bars(src.width, src.height);
+
+	fill_random(&src);
+	bench_converts(&src, ops, num_ops);
+
+	bench_threads(&src, max_threads);
+
+	free_fb(&src);
+
+	return ok;
+}
+
+int main(int argc, char **argv)
+{
+	struct {
+		uint32_t width, height;
+	} sizes[16] = {
+		{ 1280, 720 },
+		{ 1920, 1080 },
+		{ 3840, 2160 },
+	};
+	int num_sizes = 3;
+	bool sizes_given = false;
+	int max_threads = drm_draw_get_num_threads();
+	int opt;
+	bool failed = false;
+	bool dmabuf_pass = false;
+
+	while ((opt = getopt(argc, argv, "s:n:t:k:mc:dw:j")) != -1) {
+		switch (opt) {
+		case 's':
+			if (!sizes_given) {
+				sizes_given = true;
+				num_sizes = 0;
+			}
+
+			if (num_sizes == ARRAY_SIZE(sizes) ||
+				sscanf(optarg, "%ux%u", &sizes[num_sizes].width,
+					&sizes[num_sizes].height) != 2)
+				usage();
+
+			if (sizes[num_sizes].width < 2 * bar_width ||
+				sizes[num_sizes].width % 2 || sizes[num_sizes].height < 1)
+				usage();
+
+			num_sizes++;
+			break;
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		case 'k':
+			kernel_filter = optarg;
+			break;
+		case 'm':
+			use_memfd = true;
+			memory_name = "memfd";
+			break;
+		case 'c':
+			drm_fd = drm_open_dev_dumb(optarg);
+			memory_name = "dumb";
+			break;
+		case 'd':
+			dmabuf_pass = true;
+			break;
+		case 'w':
+			if (strcmp(optarg, "direct") == 0)
+				write_modes = 1;
+			else if (strcmp(optarg, "stream") == 0)
+				write_modes = 2;
+			else
+				usage();
+			break;
+		case 'j':
+			json_output = true;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (iterations < 1 || max_threads < 1 || max_threads > MAX_DRAW_THREADS)
+		usage();
+
+	if (dmabuf_pass && drm_fd < 0)
+		usage();
+
+	/* dumb NV12 buffers have no room for the UV line of an odd height */
+	for (int i = 0; i < num_sizes && drm_fd >= 0; ++i) {
+		if (sizes[i].height % 2)
+			usage();
+	}
+
+	const struct convert_ops *ops[8];
+	int num_ops = convert_get_all_ops(ops, ARRAY_SIZE(ops));
+
+	print_header();
+
+	for (int i = 0; i < num_sizes; ++i) {
+		if (!bench_size(sizes[i].width, sizes[i].height, ops, num_ops, max_threads))
+			failed = true;
+
+		if (!dmabuf_pass)
+			continue;
+
+		/* the same buffers mapped cached, next to the write-combined results */
+		cpu_sync = true;
+		memory_name = "dmabuf";
+
+		if (!bench_size(sizes[i].width, sizes[i].height, ops, num_ops, max_threads))
+			failed = true;
+
+		cpu_sync = false;
+		memory_name = "dumb";
+	}
+
+	return failed ? 1 : 0;
+}
@@ -1,9 +1,9 @@
 
 #include <linux/videodev2.h>
-#include <poll.h>
 #include <sys/ioctl.h>
 
 #include "test.h"
+#include "common-event.h"
 
 #define FOURCC_STR(str)    v4l2_fourcc(str[0], str[1], str[2], str[3])
 
@@ -34,16 +34,15 @@ static struct {
 	struct cam_vid_pipe pipes[2];
 } global;
 
-static void init_drm()
+/* one card, the planes go on a crtc it already has lit up */
+static void init_drm(const char *card)
 {
-	const char *card = "/dev/dri/card0";
-
 	global.drm_fd = drm_open_dev_dumb(card);
 }
 
 static void uninit_drm()
 {
-	close(global.drm_fd);
+	drm_close_dev(global.drm_fd);
 }
 
 static void find_crtc(int fd)
@@ -79,14 +78,13 @@ static void create_bufs(struct cam_vid_pipe *pipe, int width, int height)
 	for (int n = 0; n < BUF_QUEUE_SIZE; ++n) {
 		struct framebuffer *fb = &pipe->bufs[n];
 
-		drm_create_dumb_fb2(global.drm_fd, width, height,
-			DRM_FORMAT_YUYV, fb);
+		/* filled by the camera, never touched by the cpu */
+		drm_create_dumb_fb3(global.drm_fd, width, height, DRM_FORMAT_YUYV,
+			DRM_FB_LAZY_MAP | DRM_FB_NO_CLEAR, fb);
 
 		int r = drmPrimeHandleToFD(global.drm_fd, fb->planes[0].handle,
 			DRM_CLOEXEC, &pipe->prime_fds[n]);
 		ASSERT(r == 0);
-
-		drm_draw_test_pattern(fb, 0);
 	}
 }
 
@@ -194,7 +192,15 @@ static void init_camera_video_pipe(struct cam_vid_pipe *pipe, const char *viddev
 
 	create_bufs(pipe, pipe->input_width, pipe->input_height);
 
-	pipe->plane_id = drm_reserve_plane(global.drm_fd);
+	const struct drm_plane_req req = {
+		.crtc_id = global.crtc_id,
+		.format = DRM_FORMAT_YUYV,
+		.modifier = DRM_FORMAT_MOD_LINEAR,
+		.scaling = iw != ow || ih != oh,
+	};
+
+	pipe->plane_id = drm_reserve_plane2(global.drm_fd, &req);
+	ASSERT(pipe->plane_id);
 
 	for (int i = 0; i < BUF_QUEUE_SIZE; ++i)
 		v4l2_queue_buffer(pipe, i);
@@ -206,7 +212,7 @@ static void free_camera_video_pipe(struct cam_vid_pipe *pipe)
 {
 	destroy_bufs(pipe);
 
-	drm_release_plane(pipe->plane_id);
+	drm_release_plane(global.drm_fd, pipe->plane_id);
 }
 
 static void process_pipe_init(struct cam_vid_pipe *pipe)
@@ -214,8 +220,10 @@ static void process_pipe_init(struct cam_vid_pipe *pipe)
 	pipe->b1 = pipe->b2 = pipe->b3 = -1;
 }
 
-static void process_pipe(struct cam_vid_pipe *pipe)
+static void process_pipe(int fd, void *data)
 {
+	struct cam_vid_pipe *pipe = data;
+
 	if (pipe->b3 != -1) {
 		v4l2_queue_buffer(pipe, pipe->b3);
 		pipe->b3 = -1;
@@ -225,6 +233,10 @@ static void process_pipe(struct cam_vid_pipe *pipe)
 	if (b == -1)
 		return;
 
+	/* only the latest of the frames captured meanwhile is shown */
+	for (int next; (next = v4l2_dequeue_buffer(pipe)) != -1; b = next)
+		v4l2_queue_buffer(pipe, b);
+
 	pipe->b3 = pipe->b2;
 	pipe->b2 = pipe->b1;
 	pipe->b1 = b;
@@ -246,7 +258,19 @@ static void process_pipe(struct cam_vid_pipe *pipe)
 
 int main(int argc, char **argv)
 {
-	init_drm();
+	const char *card = "/dev/dri/card0";
+	int r;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "c:")) != -1) {
+		switch (opt) {
+		case 'c':
+			card = optarg;
+			break;
+		}
+	}
+
+	init_drm(card);
 	find_crtc(global.drm_fd);
 	bool dual_camera = true;
 
@@ -260,23 +284,20 @@ int main(int argc, char **argv)
 	if (dual_camera)
 		process_pipe_init(&global.pipes[1]);
 
-	struct pollfd fds[] = {
-		{ .fd = 0, .events =  POLLIN },
-		{ .fd = global.pipes[0].cap_fd, .events =  POLLIN },
-		{ .fd = dual_camera ? global.pipes[1].cap_fd : 0, .events =  POLLIN },
-	};
+	struct event_loop *loop = event_loop_create();
+
+	r = event_loop_add(loop, global.pipes[0].cap_fd, process_pipe, &global.pipes[0]);
+	ASSERT(r == 0);
+	if (dual_camera) {
+		r = event_loop_add(loop, global.pipes[1].cap_fd, process_pipe, &global.pipes[1]);
+		ASSERT(r == 0);
+	}
 
-	while (true) {
-		int r = poll(fds, ARRAY_SIZE(fds), -1);
-		ASSERT(r > 0);
+	event_loop_quit_on_input(loop);
 
-		if (fds[0].revents != 0)
-			break;
+	event_loop_run(loop);
 
-		process_pipe(&global.pipes[0]);
-		if (dual_camera)
-			process_pipe(&global.pipes[1]);
-	}
+	event_loop_destroy(loop);
 
 	free_camera_video_pipe(&global.pipes[1]);
 	if (dual_camera)
@@ -0,0 +1,624 @@
+#include "common-drm.h"
+#include "common.h"
+#include "common-drawing.h"
+#include "common-convert.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_CONVERT_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define HAVE_CONVERT_NEON
+#include <arm_neon.h>
+#endif
+
+/*
+ * Generic C version. Also used for the tails the SIMD versions leave over.
+ * Widths are expected to be even, as required by the subsampled formats.
+ */
+
+static inline void xrgb_to_yuv_c(uint32_t c, unsigned *y, unsigned *u, unsigned *v)
+{
+	uint8_t r = c >> 16;
+	uint8_t g = c >> 8;
+	uint8_t b = c;
+
+	*y = MAKE_YUV_601_Y(r, g, b);
+	*u = MAKE_YUV_601_U(r, g, b);
+	*v = MAKE_YUV_601_V(r, g, b);
+}
+
+static inline void xrgb_to_packed_c(uint8_t *dst, const uint32_t *src, unsigned w,
+	bool uyvy)
+{
+	for (unsigned x = 0; x + 1 < w; x += 2) {
+		unsigned y0, u0, v0;
+		unsigned y1, u1, v1;
+
+		xrgb_to_yuv_c(src[x + 0], &y0, &u0, &v0);
+		xrgb_to_yuv_c(src[x + 1], &y1, &u1, &v1);
+
+		if (uyvy) {
+			dst[x * 2 + 0] = (u0 + u1) / 2;
+			dst[x * 2 + 1] = y0;
+			dst[x * 2 + 2] = (v0 + v1) / 2;
+			dst[x * 2 + 3] = y1;
+		} else {
+			dst[x * 2 + 0] = y0;
+			dst[x * 2 + 1] = (u0 + u1) / 2;
+			dst[x * 2 + 2] = y1;
+			dst[x * 2 + 3] = (v0 + v1) / 2;
+		}
+	}
+}
+
+static void xrgb_to_yuyv_c(uint8_t *dst, const uint32_t *src, unsigned w)
+{
+	xrgb_to_packed_c(dst, src, w, false);
+}
+
+static void xrgb_to_uyvy_c(uint8_t *dst, const uint32_t *src, unsigned w)
+{
+	xrgb_to_packed_c(dst, src, w, true);
+}
+
+/* dst_y1 can be NULL (with src1 == src0) for the last line of an odd height */
+static void xrgb_to_nv12_c(uint8_t *dst_y0, uint8_t *dst_y1, uint8_t *dst_uv,
+	const uint32_t *src0, const uint32_t *src1, unsigned w)
+{
+	for (unsigned x = 0; x + 1 < w; x += 2) {
+		unsigned y00, u00, v00, y01, u01, v01;
+		unsigned y10, u10, v10, y11, u11, v11;
+
+		xrgb_to_yuv_c(src0[x + 0], &y00, &u00, &v00);
+		xrgb_to_yuv_c(src0[x + 1], &y01, &u01, &v01);
+		xrgb_to_yuv_c(src1[x + 0], &y10, &u10, &v10);
+		xrgb_to_yuv_c(src1[x + 1], &y11, &u11, &v11);
+
+		dst_y0[x + 0] = y00;
+		dst_y0[x + 1] = y01;
+
+		if (dst_y1) {
+			dst_y1[x + 0] = y10;
+			dst_y1[x + 1] = y11;
+		}
+
+		dst_uv[x + 0] = (u00 + u01 + u10 + u11) / 4;
+		dst_uv[x + 1] = (v00 + v01 + v10 + v11) / 4;
+	}
+}
+
+static void xrgb_to_rgb565_c(uint16_t *dst, const uint32_t *src, unsigned w)
+{
+	for (unsigned x = 0; x < w; ++x) {
+		uint32_t c = src[x];
+
+		dst[x] = ((c >> 8) & 0xf800) | ((c >> 5) & 0x07e0) | ((c >> 3) & 0x001f);
+	}
+}
+
+static const struct convert_ops convert_ops_c = {
+	.name = "c",
+	.xrgb_to_yuyv = xrgb_to_yuyv_c,
+	.xrgb_to_uyvy = xrgb_to_uyvy_c,
+	.xrgb_to_nv12 = xrgb_to_nv12_c,
+	.xrgb_to_rgb565 = xrgb_to_rgb565_c,
+};
+
+#ifdef HAVE_CONVERT_X86
+
+/*
+ * SSE2 and AVX2 versions. Pixels stay in 32-bit lanes all the way, so the
+ * same code works on 128-bit and 256-bit registers without cross-lane
+ * fixups. The XRGB word is split into 16-bit [B, R] and [G, 0] pairs and
+ * pmaddwd does the weighted sums, giving exactly the same results as the
+ * integer formulas in MAKE_YUV_601_*.
+ */
+
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+
+/* two int16 coefficients for pmaddwd, lo * B|G + hi * R|0 */
+#define COEF16(lo, hi) ((int32_t)(((uint32_t)(uint16_t)(hi) << 16) | (uint16_t)(lo)))
+
+#define SIMD_FUNCS(V, P, S, TARGET)						\
+									\
+static inline TARGET __m##V##i dot_##S(__m##V##i br, __m##V##i g,	\
+	int cb, int cr, int cg, int offset)				\
+{									\
+	__m##V##i t;							\
+									\
+	t = P##add_epi32(P##madd_epi16(br, P##set1_epi32(COEF16(cb, cr))), \
+		P##madd_epi16(g, P##set1_epi32(COEF16(cg, 0))));	\
+	t = P##srai_epi32(P##add_epi32(t, P##set1_epi32(128)), 8);	\
+									\
+	return P##add_epi32(t, P##set1_epi32(offset));			\
+}									\
+									\
+static inline TARGET void xrgb_to_yuv_##S(__m##V##i px, __m##V##i *y,	\
+	__m##V##i *u, __m##V##i *v)					\
+{									\
+	__m##V##i br = P##and_si##V(px, P##set1_epi32(0x00ff00ff));	\
+	__m##V##i g = P##and_si##V(P##srli_epi32(px, 8), P##set1_epi32(0xff)); \
+									\
+	*y = dot_##S(br, g, 25, 66, 129, 16);				\
+	*u = dot_##S(br, g, 112, -38, -74, 128);				\
+	*v = dot_##S(br, g, -18, 112, -94, 128);				\
+}									\
+									\
+/* sum of each pixel pair, in the even 32-bit lanes */			\
+static inline TARGET __m##V##i pair_sum_##S(__m##V##i c)			\
+{									\
+	return P##add_epi32(c, P##srli_epi64(c, 32));			\
+}									\
+									\
+/* one macropixel per pixel pair, in the even 32-bit lanes */		\
+static inline TARGET __m##V##i packed_macro_##S(__m##V##i px, bool uyvy)	\
+{									\
+	__m##V##i y, u, v;						\
+									\
+	xrgb_to_yuv_##S(px, &y, &u, &v);					\
+									\
+	u = P##srli_epi32(pair_sum_##S(u), 1);				\
+	v = P##srli_epi32(pair_sum_##S(v), 1);				\
+									\
+	if (uyvy)							\
+		return P##or_si##V(P##or_si##V(u, P##slli_epi32(y, 8)),	\
+			P##or_si##V(P##slli_epi32(v, 16), P##srli_epi64(y, 8))); \
+	else								\
+		return P##or_si##V(P##or_si##V(y, P##slli_epi32(u, 8)),	\
+			P##or_si##V(P##srli_epi64(y, 16), P##slli_epi32(v, 24))); \
+}									\
+									\
+/* 16-bit values in 32-bit lanes, sign extended for packs_epi32 */	\
+static inline TARGET __m##V##i sext16_##S(__m##V##i c)			\
+{									\
+	return P##srai_epi32(P##slli_epi32(c, 16), 16);			\
+}									\
+									\
+static inline TARGET __m##V##i rgb565_##S(__m##V##i px)			\
+{									\
+	__m##V##i r = P##and_si##V(P##srli_epi32(px, 8), P##set1_epi32(0xf800)); \
+	__m##V##i g = P##and_si##V(P##srli_epi32(px, 5), P##set1_epi32(0x07e0)); \
+	__m##V##i b = P##and_si##V(P##srli_epi32(px, 3), P##set1_epi32(0x001f)); \
+									\
+	return sext16_##S(P##or_si##V(P##or_si##V(r, g), b));		\
+}
+
+SIMD_FUNCS(128, _mm_, sse2, TARGET_SSE2)
+SIMD_FUNCS(256, _mm256_, avx2, TARGET_AVX2)
+
+#define LOAD128(p) _mm_loadu_si128((const __m128i *)(p))
+#define LOAD256(p) _mm256_loadu_si256((const __m256i *)(p))
+
+/* gather the even 32-bit lanes of a and b, in order */
+static inline TARGET_SSE2 __m128i even_lanes_sse2(__m128i a, __m128i b)
+{
+	a = _mm_shuffle_epi32(a, _MM_SHUFFLE(3, 1, 2, 0));
+	b = _mm_shuffle_epi32(b, _MM_SHUFFLE(3, 1, 2, 0));
+
+	return _mm_unpacklo_epi64(a, b);
+}
+
+static inline TARGET_AVX2 __m256i even_lanes_avx2(__m256i a, __m256i b)
+{
+	a = _mm256_shuffle_epi32(a, _MM_SHUFFLE(3, 1, 2, 0));
+	b = _mm256_shuffle_epi32(b, _MM_SHUFFLE(3, 1, 2, 0));
+
+	return _mm256_permute4x64_epi64(_mm256_unpacklo_epi64(a, b),
+		_MM_SHUFFLE(3, 1, 2, 0));
+}
+
+static inline TARGET_SSE2 void xrgb_to_packed_sse2(uint8_t *dst, const uint32_t *src,
+	unsigned w, bool uyvy)
+{
+	unsigned x;
+
+	for (x = 0; x + 8 <= w; x += 8) {
+		__m128i a = packed_macro_sse2(LOAD128(src + x + 0), uyvy);
+		__m128i b = packed_macro_sse2(LOAD128(src + x + 4), uyvy);
+
+		_mm_storeu_si128((__m128i *)(dst + x * 2), even_lanes_sse2(a, b));
+	}
+
+	xrgb_to_packed_c(dst + x * 2, src + x, w - x, uyvy);
+}
+
+static TARGET_SSE2 void xrgb_to_yuyv_sse2(uint8_t *dst, const uint32_t *src, unsigned w)
+{
+	xrgb_to_packed_sse2(dst, src, w, false);
+}
+
+static TARGET_SSE2 void xrgb_to_uyvy_sse2(uint8_t *dst, const uint32_t *src, unsigned w)
+{
+	xrgb_to_packed_sse2(dst, src, w, true);
+}
+
+static TARGET_SSE2 void xrgb_to_nv12_sse2(uint8_t *dst_y0, uint8_t *dst_y1, uint8_t *dst_uv,
+	const uint32_t *src0, const uint32_t *src1, unsigned w)
+{
+	const __m128i zero = _mm_setzero_si128();
+	unsigned x;
+
+	for (x = 0; x + 8 <= w; x += 8) {
+		__m128i y0a, u0a, v0a, y0b, u0b, v0b;
+		__m128i y1a, u1a, v1a, y1b, u1b, v1b;
+
+		xrgb_to_yuv_sse2(LOAD128(src0 + x + 0), &y0a, &u0a, &v0a);
+		xrgb_to_yuv_sse2(LOAD128(src0 + x + 4), &y0b, &u0b, &v0b);
+		xrgb_to_yuv_sse2(LOAD128(src1 + x + 0), &y1a, &u1a, &v1a);
+		xrgb_to_yuv_sse2(LOAD128(src1 + x + 4), &y1b, &u1b, &v1b);
+
+		_mm_storel_epi64((__m128i *)(dst_y0 + x),
+			_mm_packus_epi16(_mm_packs_epi32(y0a, y0b), zero));
+
+		if (dst_y1)
+			_mm_storel_epi64((__m128i *)(dst_y1 + x),
+				_mm_packus_epi16(_mm_packs_epi32(y1a, y1b), zero));
+
+		__m128i ua = _mm_srli_epi32(_mm_add_epi32(pair_sum_sse2(u0a), pair_sum_sse2(u1a)), 2);
+		__m128i ub = _mm_srli_epi32(_mm_add_epi32(pair_sum_sse2(u0b), pair_sum_sse2(u1b)), 2);
+		__m128i va = _mm_srli_epi32(_mm_add_epi32(pair_sum_sse2(v0a), pair_sum_sse2(v1a)), 2);
+		__m128i vb = _mm_srli_epi32(_mm_add_epi32(pair_sum_sse2(v0b), pair_sum_sse2(v1b)), 2);
+
+		__m128i uv = even_lanes_sse2(_mm_or_si128(ua, _mm_slli_epi32(va, 8)),
+			_mm_or_si128(ub, _mm_slli_epi32(vb, 8)));
+
+		_mm_storel_epi64((__m128i *)(dst_uv + x),
+			_mm_packs_epi32(sext16_sse2(uv), zero));
+	}
+
+	xrgb_to_nv12_c(dst_y0 + x, dst_y1 ? dst_y1 + x : NULL, dst_uv + x,
+		src0 + x, src1 + x, w - x);
+}
+
+static TARGET_SSE2 void xrgb_to_rgb565_sse2(uint16_t *dst, const uint32_t *src, unsigned w)
+{
+	unsigned x;
+
+	for (x = 0; x + 8 <= w; x += 8) {
+		__m128i a = rgb565_sse2(LOAD128(src + x + 0));
+		__m128i b = rgb565_sse2(LOAD128(src + x + 4));
+
+		_mm_storeu_si128((__m128i *)(dst + x), _mm_packs_epi32(a, b));
+	}
+
+	xrgb_to_rgb565_c(dst + x, src + x, w - x);
+}
+
+static inline TARGET_AVX2 void xrgb_to_packed_avx2(uint8_t *dst, const uint32_t *src,
+	unsigned w, bool uyvy)
+{
+	unsigned x;
+
+	for (x = 0; x + 16 <= w; x += 16) {
+		__m256i a = packed_macro_avx2(LOAD256(src + x + 0), uyvy);
+		__m256i b = packed_macro_avx2(LOAD256(src + x + 8), uyvy);
+
+		_mm256_storeu_si256((__m256i *)(dst + x * 2), even_lanes_avx2(a, b));
+	}
+
+	xrgb_to_packed_c(dst + x * 2, src + x, w - x, uyvy);
+}
+
+static TARGET_AVX2 void xrgb_to_yuyv_avx2(uint8_t *dst, const uint32_t *src, unsigned w)
+{
+	xrgb_to_packed_avx2(dst, src, w, false);
+}
+
+static TARGET_AVX2 void xrgb_to_uyvy_avx2(uint8_t *dst, const uint32_t *src, unsigned w)
+{
+	xrgb_to_packed_avx2(dst, src, w, true);
+}
+
+/* pack the 16 low bytes of a[0..7], b[0..7] in order */
+static inline TARGET_AVX2 __m128i pack_bytes_avx2(__m256i a, __m256i b)
+{
+	__m256i t;
+
+	t = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+	t = _mm256_packus_epi16(t, t);
+
+	return _mm256_castsi256_si128(_mm256_permute4x64_epi64(t, _MM_SHUFFLE(2, 0, 2, 0)));
+}
+
+static TARGET_AVX2 void xrgb_to_nv12_avx2(uint8_t *dst_y0, uint8_t *dst_y1, uint8_t *dst_uv,
+	const uint32_t *src0, const uint32_t *src1, unsigned w)
+{
+	unsigned x;
+
+	for (x = 0; x + 16 <= w; x += 16) {
+		__m256i y0a, u0a, v0a, y0b, u0b, v0b;
+		__m256i y1a, u1a, v1a, y1b, u1b, v1b;
+
+		xrgb_to_yuv_avx2(LOAD256(src0 + x + 0), &y0a, &u0a, &v0a);
+		xrgb_to_yuv_avx2(LOAD256(src0 + x + 8), &y0b, &u0b, &v0b);
+		xrgb_to_yuv_avx2(LOAD256(src1 + x + 0), &y1a, &u1a, &v1a);
+		xrgb_to_yuv_avx2(LOAD256(src1 + x + 8), &y1b, &u1b, &v1b);
+
+		_mm_storeu_si128((__m128i *)(dst_y0 + x), pack_bytes_avx2(y0a, y0b));
+
+		if (dst_y1)
+			_mm_storeu_si128((__m128i *)(dst_y1 + x), pack_bytes_avx2(y1a, y1b));
+
+		__m256i ua = _mm256_srli_epi32(_mm256_add_epi32(pair_sum_avx2(u0a), pair_sum_avx2(u1a)), 2);
+		__m256i ub = _mm256_srli_epi32(_mm256_add_epi32(pair_sum_avx2(u0b), pair_sum_avx2(u1b)), 2);
+		__m256i va = _mm256_srli_epi32(_mm256_add_epi32(pair_sum_avx2(v0a), pair_sum_avx2(v1a)), 2);
+		__m256i vb = _mm256_srli_epi32(_mm256_add_epi32(pair_sum_avx2(v0b), pair_sum_avx2(v1b)), 2);
+
+		__m256i uv = even_lanes_avx2(_mm256_or_si256(ua, _mm256_slli_epi32(va, 8)),
+			_mm256_or_si256(ub, _mm256_slli_epi32(vb, 8)));
+
+		uv = sext16_avx2(uv);
+		uv = _mm256_permute4x64_epi64(_mm256_packs_epi32(uv, uv), _MM_SHUFFLE(2, 0, 2, 0));
+
+		_mm_storeu_si128((__m128i *)(dst_uv + x), _mm256_castsi256_si128(uv));
+	}
+
+	xrgb_to_nv12_c(dst_y0 + x, dst_y1 ? dst_y1 + x : NULL, dst_uv + x,
+		src0 + x, src1 + x, w - x);
+}
+
+static TARGET_AVX2 void xrgb_to_rgb565_avx2(uint16_t *dst, const uint32_t *src, unsigned w)
+{
+	unsigned x;
+
+	for (x = 0; x + 16 <= w; x += 16) {
+		__m256i a = rgb565_avx2(LOAD256(src + x + 0));
+		__m256i b = rgb565_avx2(LOAD256(src + x + 8));
+
+		_mm256_storeu_si256((__m256i *)(dst + x),
+			_mm256_permute4x64_epi64(_mm256_packs_epi32(a, b),
+				_MM_SHUFFLE(3, 1, 2, 0)));
+	}
+
+	xrgb_to_rgb565_c(dst + x, src + x, w - x);
+}
+
+static const struct convert_ops convert_ops_sse2 = {
+	.name = "sse2",
+	.xrgb_to_yuyv = xrgb_to_yuyv_sse2,
+	.xrgb_to_uyvy = xrgb_to_uyvy_sse2,
+	.xrgb_to_nv12 = xrgb_to_nv12_sse2,
+	.xrgb_to_rgb565 = xrgb_to_rgb565_sse2,
+};
+
+static const struct convert_ops convert_ops_avx2 = {
+	.name = "avx2",
+	.xrgb_to_yuyv = xrgb_to_yuyv_avx2,
+	.xrgb_to_uyvy = xrgb_to_uyvy_avx2,
+	.xrgb_to_nv12 = xrgb_to_nv12_avx2,
+	.xrgb_to_rgb565 = xrgb_to_rgb565_avx2,
+};
+
+#endif /* HAVE_CONVERT_X86 */
+
+#ifdef HAVE_CONVERT_NEON
+
+/*
+ * NEON version. vld4 splits 16 XRGB pixels into B, G, R planes, and the
+ * stores interleave the results back with vst2/vst4.
+ */
+
+static inline uint8x8_t neon_y(uint8x8_t r, uint8x8_t g, uint8x8_t b)
+{
+	uint16x8_t t;
+
+	t = vmull_u8(r, vdup_n_u8(66));
+	t = vmlal_u8(t, g, vdup_n_u8(129));
+	t = vmlal_u8(t, b, vdup_n_u8(25));
+	t = vaddq_u16(t, vdupq_n_u16(128));
+
+	return vadd_u8(vshrn_n_u16(t, 8), vdup_n_u8(16));
+}
+
+static inline int16x8_t neon_chroma(int16x8_t r, int16x8_t g, int16x8_t b,
+	int16_t cr, int16_t cg, int16_t cb)
+{
+	int16x8_t t;
+
+	t = vmulq_n_s16(r, cr);
+	t = vmlaq_n_s16(t, g, cg);
+	t = vmlaq_n_s16(t, b, cb);
+	t = vshrq_n_s16(vaddq_s16(t, vdupq_n_s16(128)), 8);
+
+	return vaddq_s16(t, vdupq_n_s16(128));
+}
+
+struct neon_yuv {
+	uint8x16_t y;
+	/* sums of the pixel pairs */
+	int16x8_t u;
+	int16x8_t v;
+};
+
+static inline struct neon_yuv neon_xrgb_to_yuv(const uint32_t *src)
+{
+	uint8x16x4_t px = vld4q_u8((const uint8_t *)src);
+	uint8x16_t b = px.val[0];
+	uint8x16_t g = px.val[1];
+	uint8x16_t r = px.val[2];
+	struct neon_yuv yuv;
+
+	yuv.y = vcombine_u8(neon_y(vget_low_u8(r), vget_low_u8(g), vget_low_u8(b)),
+		neon_y(vget_high_u8(r), vget_high_u8(g), vget_high_u8(b)));
+
+	int16x8_t r0 = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(r)));
+	int16x8_t g0 = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(g)));
+	int16x8_t b0 = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(b)));
+	int16x8_t r1 = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(r)));
+	int16x8_t g1 = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(g)));
+	int16x8_t b1 = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(b)));
+
+	int16x8x2_t u = vuzpq_s16(neon_chroma(r0, g0, b0, -38, -74, 112),
+		neon_chroma(r1, g1, b1, -38, -74, 112));
+	int16x8x2_t v = vuzpq_s16(neon_chroma(r0, g0, b0, 112, -94, -18),
+		neon_chroma(r1, g1, b1, 112, -94, -18));
+
+	yuv.u = vaddq_s16(u.val[0], u.val[1]);
+	yuv.v = vaddq_s16(v.val[0], v.val[1]);
+
+	return yuv;
+}
+
+static inline void xrgb_to_packed_neon(uint8_t *dst, const uint32_t *src,
+	unsigned w, bool uyvy)
+{
+	unsigned x;
+
+	for (x = 0; x + 16 <= w; x += 16) {
+		struct neon_yuv yuv = neon_xrgb_to_yuv(src + x);
+		uint8x8x2_t y = vuzp_u8(vget_low_u8(yuv.y), vget_high_u8(yuv.y));
+		uint8x8_t u = vmovn_u16(vreinterpretq_u16_s16(vshrq_n_s16(yuv.u, 1)));
+		uint8x8_t v = vmovn_u16(vreinterpretq_u16_s16(vshrq_n_s16(yuv.v, 1)));
+		uint8x8x4_t m;
+
+		if (uyvy) {
+			m.val[0] = u;
+			m.val[1] = y.val[0];
+			m.val[2] = v;
+			m.val[3] = y.val[1];
+		} else {
+			m.val[0] = y.val[0];
+			m.val[1] = u;
+			m.val[2] = y.val[1];
+			m.val[3] = v;
+		}
+
+		vst4_u8(dst + x * 2, m);
+	}
+
+	xrgb_to_packed_c(dst + x * 2, src + x, w - x, uyvy);
+}
+
+static void xrgb_to_yuyv_neon(uint8_t *dst, const uint32_t *src, unsigned w)
+{
+	xrgb_to_packed_neon(dst, src, w, false);
+}
+
+static void xrgb_to_uyvy_neon(uint8_t *dst, const uint32_t *src, unsigned w)
+{
+	xrgb_to_packed_neon(dst, src, w, true);
+}
+
+static void xrgb_to_nv12_neon(uint8_t *dst_y0, uint8_t *dst_y1, uint8_t *dst_uv,
+	const uint32_t *src0, const uint32_t *src1, unsigned w)
+{
+	unsigned x;
+
+	for (x = 0; x + 16 <= w; x += 16) {
+		struct neon_yuv yuv0 = neon_xrgb_to_yuv(src0 + x);
+		struct neon_yuv yuv1 = neon_xrgb_to_yuv(src1 + x);
+		uint8x8x2_t uv;
+
+		vst1q_u8(dst_y0 + x, yuv0.y);
+
+		if (dst_y1)
+			vst1q_u8(dst_y1 + x, yuv1.y);
+
+		uv.val[0] = vmovn_u16(vreinterpretq_u16_s16(
+			vshrq_n_s16(vaddq_s16(yuv0.u, yuv1.u), 2)));
+		uv.val[1] = vmovn_u16(vreinterpretq_u16_s16(
+			vshrq_n_s16(vaddq_s16(yuv0.v, yuv1.v), 2)));
+
+		vst2_u8(dst_uv + x, uv);
+	}
+
+	xrgb_to_nv12_c(dst_y0 + x, dst_y1 ? dst_y1 + x : NULL, dst_uv + x,
+		src0 + x, src1 + x, w - x);
+}
+
+static void xrgb_to_rgb565_neon(uint16_t *dst, const uint32_t *src, unsigned w)
+{
+	unsigned x;
+
+	for (x = 0; x + 16 <= w; x += 16) {
+		uint8x16x4_t px = vld4q_u8((const uint8_t *)(src + x));
+		uint8x16_t b = px.val[0];
+		uint8x16_t g = px.val[1];
+		uint8x16_t r = px.val[2];
+		uint16x8_t lo, hi;
+
+		lo = vshll_n_u8(vget_low_u8(r), 8);
+		lo = vsriq_n_u16(lo, vshll_n_u8(vget_low_u8(g), 8), 5);
+		lo = vsriq_n_u16(lo, vshll_n_u8(vget_low_u8(b), 8), 11);
+
+		hi = vshll_n_u8(vget_high_u8(r), 8);
+		hi = vsriq_n_u16(hi, vshll_n_u8(vget_high_u8(g), 8), 5);
+		hi = vsriq_n_u16(hi, vshll_n_u8(vget_high_u8(b), 8), 11);
+
+		vst1q_u16(dst + x + 0, lo);
+		vst1q_u16(dst + x + 8, hi);
+	}
+
+	xrgb_to_rgb565_c(dst + x, src + x, w - x);
+}
+
+static const struct convert_ops convert_ops_neon = {
+	.name = "neon",
+	.xrgb_to_yuyv = xrgb_to_yuyv_neon,
+	.xrgb_to_uyvy = xrgb_to_uyvy_neon,
+	.xrgb_to_nv12 = xrgb_to_nv12_neon,
+	.xrgb_to_rgb565 = xrgb_to_rgb565_neon,
+};
+
+#endif /* HAVE_CONVERT_NEON */
+
+static const struct convert_ops *const convert_ops_array[] = {
+	&convert_ops_c,
+#ifdef HAVE_CONVERT_X86
+	&convert_ops_sse2,
+	&convert_ops_avx2,
+#endif
+#ifdef HAVE_CONVERT_NEON
+	&convert_ops_neon,
+#endif
+};
+
+static const struct convert_ops *current_ops;
+
+static bool convert_ops_supported(const struct convert_ops *ops)
+{
+#ifdef HAVE_CONVERT_X86
+	__builtin_cpu_init();
+
+	if (ops == &convert_ops_sse2)
+		return __builtin_cpu_supports("sse2");
+	if (ops == &convert_ops_avx2)
+		return __builtin_cpu_supports("avx2");
+#endif
+
+	return true;
+}
+
+int convert_get_all_ops(const struct convert_ops **ops, int max_ops)
+{
+	int num_ops = 0;
+
+	for (int i = 0; i < ARRAY_SIZE(convert_ops_array) && num_ops < max_ops; ++i) {
+		if (convert_ops_supported(convert_ops_array[i]))
+			ops[num_ops++] = convert_ops_array[i];
+	}
+
+	return num_ops;
+}
+
+const struct convert_ops *convert_get_ops(void)
+{
+	const struct convert_ops *ops[ARRAY_SIZE(convert_ops_array)];
+
+	if (likely(current_ops))
+		return current_ops;
+
+	int num_ops = convert_get_all_ops(ops, ARRAY_SIZE(ops));
+
+	current_ops = ops[num_ops - 1];
+
+	return current_ops;
+}
+
+void convert_set_ops(const struct convert_ops *ops)
+{
+	current_ops = ops;
+}
@@ -0,0 +1,29 @@
+#ifndef _COMMON_CONVERT_H_
+#define _COMMON_CONVERT_H_
+
+#include <stdint.h>
+
+/*
+ * Line converters from XRGB8888. Each call converts one source line (two
+ * for NV12, which also produces one line of interleaved UV). Chroma is
+ * the truncated average of the per-pixel BT.601 values, and all
+ * implementations produce identical output.
+ */
+struct convert_ops {
+	const char *name;
+
+	void (*xrgb_to_yuyv)(uint8_t *dst, const uint32_t *src, unsigned w);
+	void (*xrgb_to_uyvy)(uint8_t *dst, const uint32_t *src, unsigned w);
+	void (*xrgb_to_nv12)(uint8_t *dst_y0, uint8_t *dst_y1, uint8_t *dst_uv,
+		const uint32_t *src0, const uint32_t *src1, unsigned w);
+	void (*xrgb_to_rgb565)(uint16_t *dst, const uint32_t *src, unsigned w);
+};
+
+/* best implementation for this cpu */
+const struct convert_ops *convert_get_ops(void);
+/* all implementations usable on this cpu, slowest first */
+int convert_get_all_ops(const struct convert_ops **ops, int max_ops);
+/* override the implementation returned by convert_get_ops() */
+void convert_set_ops(const struct convert_ops *ops);
+
+#endif
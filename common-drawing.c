@@ -1,6 +1,11 @@
 #include "common-drm.h"
 #include "common.h"
 #include "common-drawing.h"
+#include "common-convert.h"
+#include "common-stream.h"
+
+#include <pthread.h>
+#include <signal.h>
 
 void draw_pixel(struct framebuffer *buf, int x, int y, uint32_t color)
 {
@@ -9,64 +14,105 @@ void draw_pixel(struct framebuffer *buf, int x, int y, uint32_t color)
 	*p = color;
 }
 
-struct rgb
+/* 32-bit fill using 16-byte stores once aligned */
+typedef uint32_t u32x4 __attribute__((vector_size(16)));
+
+static void fill32(uint32_t *p, uint32_t color, unsigned n)
 {
-	uint8_t r;
-	uint8_t g;
-	uint8_t b;
-	uint8_t __unused1;
+	const u32x4 c4 = { color, color, color, color };
+
+	for (; n > 0 && ((uintptr_t)p & 15); --n)
+		*p++ = color;
+
+	for (; n >= 8; n -= 8, p += 8) {
+		((u32x4 *)p)[0] = c4;
+		((u32x4 *)p)[1] = c4;
+	}
+
+	for (; n > 0; --n)
+		*p++ = color;
+}
+
+/*
+ * Test patterns are rasterized a line at a time, as a list of spans of
+ * constant color. XRGB8888 framebuffers get the spans filled in place,
+ * other formats get them filled into a small on-stack line buffer which is
+ * converted from there straight into the planes. A line identical to the
+ * previous one is copied from the previous line of the framebuffer.
+ *
+ * The result is byte for byte the same as drawing into an XRGB8888 buffer
+ * and converting it with fb_color_convert(), i.e. the rounding tolerance
+ * is zero.
+ */
+
+#define MAX_SPANS 32
+
+struct span {
+	unsigned x0, x1;
+	uint32_t color;
 };
 
-struct yuv
-{
-	uint8_t y;
-	uint8_t u;
-	uint8_t v;
-	uint8_t __unused2;
+struct span_line {
+	int num_spans;
+	struct span spans[MAX_SPANS];
 };
 
-static struct yuv rgb_to_yuv_pixel(struct rgb rgb)
+typedef void (*pattern_spans_func)(unsigned w, unsigned h, unsigned y, struct span_line *sl);
+
+static void add_span(struct span_line *sl, unsigned x0, unsigned x1, uint32_t color)
 {
-	unsigned r = rgb.r;
-	unsigned g = rgb.g;
-	unsigned b = rgb.b;
+	if (x0 >= x1)
+		return;
 
-	struct yuv yuv = {
-		.y = MAKE_YUV_601_Y(r, g, b),
-		.u = MAKE_YUV_601_U(r, g, b),
-		.v = MAKE_YUV_601_V(r, g, b),
-	};
+	if (sl->num_spans > 0) {
+		struct span *last = &sl->spans[sl->num_spans - 1];
+
+		if (last->color == color && last->x1 == x0) {
+			last->x1 = x1;
+			return;
+		}
+	}
+
+	ASSERT(sl->num_spans < MAX_SPANS);
 
-	return yuv;
+	sl->spans[sl->num_spans++] = (struct span){ x0, x1, color };
 }
 
-static struct rgb read_rgb(struct framebuffer *fb, int x, int y)
+/*
+ * Spans for [x0, x1) of a band starting at bx0, where pixel x gets
+ * colors[(x - bx0) * n / d]. The band edges are solved once instead of
+ * dividing per pixel.
+ */
+static void add_band_spans(struct span_line *sl, unsigned x0, unsigned x1,
+	unsigned bx0, unsigned n, unsigned d, const uint32_t *colors)
 {
-	uint32_t *pc = (uint32_t *)(fb->planes[0].map + fb->planes[0].stride * y);
+	if (x0 >= x1)
+		return;
 
-	uint32_t c = pc[x];
+	if (d == 0) {
+		add_span(sl, x0, x1, colors[0]);
+		return;
+	}
 
-	struct rgb rgb = {
-		.r = (c >> 16) & 0xff,
-		.g = (c >> 8) & 0xff,
-		.b = c & 0xff,
-	};
+	unsigned k = (x0 - bx0) * n / d;
 
-	return rgb;
-}
+	while (x0 < x1) {
+		/* first x with index k + 1 */
+		unsigned end = bx0 + ((k + 1) * d + n - 1) / n;
 
-static struct yuv read_rgb_as_yuv(struct framebuffer *fb, int x, int y)
-{
-	struct rgb rgb = read_rgb(fb, x, y);
-	return rgb_to_yuv_pixel(rgb);
+		if (end > x1)
+			end = x1;
+
+		add_span(sl, x0, end, colors[k]);
+
+		x0 = end;
+		k++;
+	}
 }
 
-static void drm_draw_test_pattern_default(struct framebuffer *fb)
+/* per pixel version of the default pattern, only used for tiny sizes */
+static uint32_t default_pattern_pixel(unsigned w, unsigned h, unsigned x, unsigned y)
 {
-	unsigned x, y;
-	unsigned w = fb->width;
-	unsigned h = fb->height;
-
 	const int mw = 20;
 
 	const int xm1 = mw;
@@ -74,82 +120,159 @@ static void drm_draw_test_pattern_default(struct framebuffer *fb)
 	const int ym1 = mw;
 	const int ym2 = h - mw - 1;
 
-	for (y = 0; y < h; y++) {
-		for (x = 0; x < w; x++) {
-			// white margin lines
-			if (x == xm1 || x == xm2 || y == ym1 || y == ym2)
-				draw_pixel(fb, x, y, MAKE_RGB(255, 255, 255));
-			// white box outlines to corners
-			else if ((x == 0 || x == w - 1) && (y < ym1 || y > ym2))
-				draw_pixel(fb, x, y, MAKE_RGB(255, 255, 255));
-			// white box outlines to corners
-			else if ((y == 0 || y == h - 1) && (x < xm1 || x > xm2))
-				draw_pixel(fb, x, y, MAKE_RGB(255, 255, 255));
-			// blue bar on the left
-			else if (x < xm1 && (y > ym1 && y < ym2))
-				draw_pixel(fb, x, y, MAKE_RGB(0, 0, 255));
-			// blue bar on the top
-			else if (y < ym1 && (x > xm1 && x < xm2))
-				draw_pixel(fb, x, y, MAKE_RGB(0, 0, 255));
-			// red bar on the right
-			else if (x > xm2 && (y > ym1 && y < ym2))
-				draw_pixel(fb, x, y, MAKE_RGB(255, 0, 0));
-			// red bar on the bottom
-			else if (y > ym2 && (x > xm1 && x < xm2))
-				draw_pixel(fb, x, y, MAKE_RGB(255, 0, 0));
-			// inside the margins
-			else if (x > xm1 && x < xm2 && y > ym1 && y < ym2) {
-				// diagonal line
-				if (x == y || w - x == h - y)
-					draw_pixel(fb, x, y, MAKE_RGB(255, 255, 255));
-				// diagonal line
-				else if (w - x == y || x == h - y)
-					draw_pixel(fb, x, y, MAKE_RGB(255, 255, 255));
-				else {
-					int t = (x - xm1 - 1) * 3 / (xm2 - xm1 - 1);
-					unsigned r = 0, g = 0, b = 0;
-
-					unsigned c = (y - ym1 - 1) % 256;
-
-					switch (t) {
-					case 0:
-						r = c;
-						break;
-					case 1:
-						g = c;
-						break;
-					case 2:
-						b = c;
-						break;
-					}
-
-					draw_pixel(fb, x, y, MAKE_RGB(r, g, b));
-				}
-			// black corners
-			} else {
-				draw_pixel(fb, x, y, 0);
+	// white margin lines
+	if (x == xm1 || x == xm2 || y == ym1 || y == ym2)
+		return MAKE_RGB(255, 255, 255);
+	// white box outlines to corners
+	else if ((x == 0 || x == w - 1) && (y < ym1 || y > ym2))
+		return MAKE_RGB(255, 255, 255);
+	// white box outlines to corners
+	else if ((y == 0 || y == h - 1) && (x < xm1 || x > xm2))
+		return MAKE_RGB(255, 255, 255);
+	// blue bar on the left
+	else if (x < xm1 && (y > ym1 && y < ym2))
+		return MAKE_RGB(0, 0, 255);
+	// blue bar on the top
+	else if (y < ym1 && (x > xm1 && x < xm2))
+		return MAKE_RGB(0, 0, 255);
+	// red bar on the right
+	else if (x > xm2 && (y > ym1 && y < ym2))
+		return MAKE_RGB(255, 0, 0);
+	// red bar on the bottom
+	else if (y > ym2 && (x > xm1 && x < xm2))
+		return MAKE_RGB(255, 0, 0);
+	// inside the margins
+	else if (x > xm1 && x < xm2 && y > ym1 && y < ym2) {
+		// diagonal line
+		if (x == y || w - x == h - y)
+			return MAKE_RGB(255, 255, 255);
+		// diagonal line
+		else if (w - x == y || x == h - y)
+			return MAKE_RGB(255, 255, 255);
+		else {
+			int t = (x - xm1 - 1) * 3 / (xm2 - xm1 - 1);
+			unsigned r = 0, g = 0, b = 0;
+
+			unsigned c = (y - ym1 - 1) % 256;
+
+			switch (t) {
+			case 0:
+				r = c;
+				break;
+			case 1:
+				g = c;
+				break;
+			case 2:
+				b = c;
+				break;
 			}
+
+			return MAKE_RGB(r, g, b);
 		}
 	}
+
+	// black corners
+	return 0;
 }
 
-static void drm_draw_test_pattern_edges(struct framebuffer *fb)
+static void spans_default(unsigned w, unsigned h, unsigned y, struct span_line *sl)
 {
-	unsigned x, y;
-	unsigned w = fb->width;
-	unsigned h = fb->height;
+	const uint32_t white = MAKE_RGB(255, 255, 255);
+	const uint32_t blue = MAKE_RGB(0, 0, 255);
+	const uint32_t red = MAKE_RGB(255, 0, 0);
 
-	for (y = 0; y < h; y++) {
-		for (x = 0; x < w; x++) {
-			if (x == 0 || y == 0 || x == w - 1 || y == h - 1)
-				draw_pixel(fb, x, y, MAKE_RGB(255, 255, 255));
-			else
-				draw_pixel(fb, x, y, 0);
+	const unsigned mw = 20;
+
+	const unsigned xm1 = mw;
+	const unsigned xm2 = w - mw - 1;
+	const unsigned ym1 = mw;
+	const unsigned ym2 = h - mw - 1;
+
+	/* the margins overlap, fall back to run-length encoding the pixels */
+	if (w < 2 * mw + 3 || h < 2 * mw + 3) {
+		for (unsigned x = 0; x < w; ++x)
+			add_span(sl, x, x + 1, default_pattern_pixel(w, h, x, y));
+		return;
+	}
+
+	// white margin lines
+	if (y == ym1 || y == ym2) {
+		add_span(sl, 0, w, white);
+		return;
+	}
+
+	// blue bar on the top, red bar on the bottom, box outlines to corners
+	if (y < ym1 || y > ym2) {
+		uint32_t edge = (y == 0 || y == h - 1) ? white : 0;
+
+		add_span(sl, 0, 1, white);
+		add_span(sl, 1, xm1, edge);
+		add_span(sl, xm1, xm1 + 1, white);
+		add_span(sl, xm1 + 1, xm2, y < ym1 ? blue : red);
+		add_span(sl, xm2, xm2 + 1, white);
+		add_span(sl, xm2 + 1, w - 1, edge);
+		add_span(sl, w - 1, w, white);
+		return;
+	}
+
+	// inside the margins: r/g/b gradient thirds with the diagonals on top
+	unsigned c = (y - ym1 - 1) % 256;
+
+	const uint32_t thirds[] = {
+		MAKE_RGB(c, 0, 0),
+		MAKE_RGB(0, c, 0),
+		MAKE_RGB(0, 0, c),
+	};
+
+	/* unsigned wrap-around puts the non-existing ones out of range */
+	unsigned diag[] = { y, w - h + y, w - y, h - y };
+
+	for (int i = 1; i < ARRAY_SIZE(diag); ++i) {
+		for (int j = i; j > 0 && diag[j - 1] > diag[j]; --j) {
+			unsigned t = diag[j];
+			diag[j] = diag[j - 1];
+			diag[j - 1] = t;
 		}
 	}
+
+	// blue bar on the left
+	add_span(sl, 0, xm1, blue);
+	add_span(sl, xm1, xm1 + 1, white);
+
+	unsigned x = xm1 + 1;
+
+	for (int i = 0; i < ARRAY_SIZE(diag); ++i) {
+		unsigned d = diag[i];
+
+		if (d < x || d >= xm2)
+			continue;
+
+		add_band_spans(sl, x, d, xm1 + 1, 3, xm2 - xm1 - 1, thirds);
+		add_span(sl, d, d + 1, white);
+
+		x = d + 1;
+	}
+
+	add_band_spans(sl, x, xm2, xm1 + 1, 3, xm2 - xm1 - 1, thirds);
+
+	// red bar on the right
+	add_span(sl, xm2, xm2 + 1, white);
+	add_span(sl, xm2 + 1, w, red);
 }
 
-static void fill_smpte_rgb32(struct framebuffer *fb)
+static void spans_edges(unsigned w, unsigned h, unsigned y, struct span_line *sl)
+{
+	if (y == 0 || y == h - 1) {
+		add_span(sl, 0, w, MAKE_RGB(255, 255, 255));
+		return;
+	}
+
+	add_span(sl, 0, 1, MAKE_RGB(255, 255, 255));
+	add_span(sl, 1, w - 1, 0);
+	add_span(sl, w - 1, w, MAKE_RGB(255, 255, 255));
+}
+
+static void spans_smpte(unsigned width, unsigned height, unsigned y, struct span_line *sl)
 {
 	const uint32_t colors_top[] = {
 		MAKE_RGB(192, 192, 192),/* grey */
@@ -182,141 +305,474 @@ static void fill_smpte_rgb32(struct framebuffer *fb)
 		MAKE_RGB(19, 19, 19),	/* black */
 	};
 
-	unsigned width = fb->width;
-	unsigned height = fb->height;
+	if (y < height * 6 / 9) {
+		add_band_spans(sl, 0, width, 0, 7, width, colors_top);
+	} else if (y < height * 7 / 9) {
+		add_band_spans(sl, 0, width, 0, 7, width, colors_middle);
+	} else {
+		unsigned x5 = width * 5 / 7;
+		unsigned x6 = width * 6 / 7;
+
+		add_band_spans(sl, 0, x5, 0, 4, x5, colors_bottom);
+		add_band_spans(sl, x5, x6, x5, 3, width / 7, colors_bottom + 4);
+		add_span(sl, x6, width, colors_bottom[7]);
+	}
+}
+
+static pattern_spans_func get_pattern_spans_func(int pattern)
+{
+	switch (pattern) {
+	case 0:
+	default:
+		return spans_default;
+	case 1:
+		return spans_smpte;
+	case 2:
+		return spans_edges;
+	}
+}
 
-	unsigned int x;
-	unsigned int y;
+static void fill_spans(uint32_t *line, const struct span_line *sl)
+{
+	for (int i = 0; i < sl->num_spans; ++i) {
+		const struct span *sp = &sl->spans[i];
 
-	for (y = 0; y < height * 6 / 9; ++y) {
-		for (x = 0; x < width; ++x)
-			draw_pixel(fb, x, y, colors_top[x * 7 / width]);
+		fill32(line + sp->x0, sp->color, sp->x1 - sp->x0);
 	}
+}
+
+static bool pattern_line_same_as_prev(pattern_spans_func get_spans,
+	unsigned w, unsigned h, unsigned y)
+{
+	struct span_line prev = { 0 }, cur = { 0 };
+
+	if (y == 0)
+		return false;
+
+	get_spans(w, h, y - 1, &prev);
+	get_spans(w, h, y, &cur);
+
+	return prev.num_spans == cur.num_spans &&
+		memcmp(prev.spans, cur.spans, sizeof(cur.spans[0]) * cur.num_spans) == 0;
+}
+
+/*
+ * Source of XRGB8888 lines for convert_lines(). get_line returns either a
+ * line that already exists somewhere, or 'buf' after filling it.
+ * same_as_prev, if set, tells that line y is identical to line y - 1.
+ */
+struct line_source {
+	const uint32_t *(*get_line)(const struct line_source *src, unsigned y, uint32_t *buf);
+	bool (*same_as_prev)(const struct line_source *src, unsigned y);
+
+	struct framebuffer *fb;
+	pattern_spans_func get_spans;
+};
+
+static const uint32_t *get_fb_line(const struct line_source *src, unsigned y, uint32_t *buf)
+{
+	return (uint32_t *)(src->fb->planes[0].map + src->fb->planes[0].stride * y);
+}
+
+static const uint32_t *get_pattern_line(const struct line_source *src, unsigned y, uint32_t *buf)
+{
+	struct span_line sl = { 0 };
+
+	src->get_spans(src->fb->width, src->fb->height, y, &sl);
+	fill_spans(buf, &sl);
+
+	return buf;
+}
+
+static bool pattern_same_as_prev(const struct line_source *src, unsigned y)
+{
+	return pattern_line_same_as_prev(src->get_spans, src->fb->width, src->fb->height, y);
+}
 
-	for (; y < height * 7 / 9; ++y) {
-		for (x = 0; x < width; ++x)
-			draw_pixel(fb, x, y, colors_middle[x * 7 / width]);
+static inline bool line_same_as_prev(const struct line_source *src, unsigned y)
+{
+	return src->same_as_prev && src->same_as_prev(src, y);
+}
+
+/*
+ * Drawing worker pool. A job is split into horizontal bands of rows, the
+ * calling thread draws the first band and the workers the rest. Band
+ * starts are multiples of 'align' so that NV12 bands own whole UV rows.
+ */
+
+#define MIN_BAND_ROWS 16
+
+typedef void (*band_func)(void *arg, unsigned y0, unsigned y1);
+
+static struct {
+	pthread_mutex_t job_lock;	/* held while a job is running */
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+
+	int num_threads;		/* including the calling thread, 0 = unset */
+	int num_workers;
+	pthread_t workers[MAX_DRAW_THREADS];
+
+	unsigned generation;
+	int pending;
+
+	band_func func;
+	void *arg;
+	unsigned num_rows;
+	unsigned align;
+	int num_bands;
+} pool = {
+	.job_lock = PTHREAD_MUTEX_INITIALIZER,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work_cond = PTHREAD_COND_INITIALIZER,
+	.done_cond = PTHREAD_COND_INITIALIZER,
+};
+
+static unsigned band_start(int band)
+{
+	if (band == pool.num_bands)
+		return pool.num_rows;
+
+	return (uint64_t)pool.num_rows * band / pool.num_bands / pool.align * pool.align;
+}
+
+static void run_band(int band)
+{
+	unsigned y0 = band_start(band);
+	unsigned y1 = band_start(band + 1);
+
+	if (y0 < y1)
+		pool.func(pool.arg, y0, y1);
+}
+
+static void *draw_worker(void *data)
+{
+	int idx = (int)(intptr_t)data;
+	unsigned generation = 0;
+
+	pthread_mutex_lock(&pool.lock);
+
+	while (true) {
+		while (pool.generation == generation)
+			pthread_cond_wait(&pool.work_cond, &pool.lock);
+
+		generation = pool.generation;
+
+		pthread_mutex_unlock(&pool.lock);
+
+		if (idx < pool.num_bands)
+			run_band(idx);
+
+		pthread_mutex_lock(&pool.lock);
+
+		if (--pool.pending == 0)
+			pthread_cond_signal(&pool.done_cond);
 	}
 
-	for (; y < height; ++y) {
-		for (x = 0; x < width * 5 / 7; ++x)
-			draw_pixel(fb, x, y,
-				colors_bottom[x * 4 / (width * 5 / 7)]);
-		for (; x < width * 6 / 7; ++x)
-			draw_pixel(fb, x, y,
-				colors_bottom[(x - width * 5 / 7) * 3 / (width / 7) + 4]);
-		for (; x < width; ++x)
-			draw_pixel(fb, x, y, colors_bottom[7]);
+	return NULL;
+}
+
+void drm_draw_set_num_threads(int num_threads)
+{
+	if (num_threads < 1)
+		num_threads = 1;
+	if (num_threads > MAX_DRAW_THREADS)
+		num_threads = MAX_DRAW_THREADS;
+
+	pthread_mutex_lock(&pool.job_lock);
+	pool.num_threads = num_threads;
+	pthread_mutex_unlock(&pool.job_lock);
+}
+
+int drm_draw_get_num_threads(void)
+{
+	int num_threads;
+
+	pthread_mutex_lock(&pool.job_lock);
+
+	if (pool.num_threads == 0) {
+		const char *env = getenv("DRM_DRAW_THREADS");
+
+		num_threads = env ? atoi(env) : sysconf(_SC_NPROCESSORS_ONLN);
+
+		if (num_threads < 1)
+			num_threads = 1;
+		if (num_threads > MAX_DRAW_THREADS)
+			num_threads = MAX_DRAW_THREADS;
+
+		pool.num_threads = num_threads;
 	}
+
+	num_threads = pool.num_threads;
+
+	pthread_mutex_unlock(&pool.job_lock);
+
+	return num_threads;
 }
 
-static void fb_rgb_to_packed_yuv(struct framebuffer *dst_fb, struct framebuffer *src_fb)
+static void run_bands(band_func func, void *arg, unsigned num_rows, unsigned align)
 {
-	unsigned w = src_fb->width;
-	unsigned h = src_fb->height;
+	int num_threads = drm_draw_get_num_threads();
+	int num_bands = num_rows / MIN_BAND_ROWS;
 
-	uint8_t *dst = dst_fb->planes[0].map;
+	if (num_bands > num_threads)
+		num_bands = num_threads;
 
-	for (int y = 0; y < h; ++y) {
-		for (int x = 0; x < w; x += 2) {
-			struct yuv yuv1 = read_rgb_as_yuv(src_fb, x + 0, y);
-			struct yuv yuv2 = read_rgb_as_yuv(src_fb, x + 1, y);
+	/* single band, or the pool is busy with another thread's job */
+	if (num_bands <= 1 || pthread_mutex_trylock(&pool.job_lock) != 0) {
+		func(arg, 0, num_rows);
+		return;
+	}
 
-			switch (dst_fb->format) {
-				case DRM_FORMAT_UYVY:
-					dst[x * 2 + 0] = (yuv1.u + yuv2.u) / 2;
-					dst[x * 2 + 1] = yuv1.y;
-					dst[x * 2 + 2] = (yuv1.v + yuv2.v) / 2;
-					dst[x * 2 + 3] = yuv2.y;
-					break;
-				case DRM_FORMAT_YUYV:
-					dst[x * 2 + 0] = yuv1.y;
-					dst[x * 2 + 1] = (yuv1.u + yuv2.u) / 2;
-					dst[x * 2 + 2] = yuv2.y;
-					dst[x * 2 + 3] = (yuv1.v + yuv2.v) / 2;
-					break;
+	if (pool.num_workers < num_bands - 1) {
+		/* signals are for the caller's thread, the workers start with them blocked */
+		sigset_t all, old;
 
-				default:
-					ASSERT(false);
-			}
+		sigfillset(&all);
+		pthread_sigmask(SIG_SETMASK, &all, &old);
+
+		while (pool.num_workers < num_bands - 1) {
+			int r = pthread_create(&pool.workers[pool.num_workers], NULL,
+				draw_worker, (void *)(intptr_t)(pool.num_workers + 1));
+			ASSERT(r == 0);
+			pool.num_workers++;
 		}
 
-		dst += dst_fb->planes[0].stride;
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
 	}
+
+	pthread_mutex_lock(&pool.lock);
+
+	pool.func = func;
+	pool.arg = arg;
+	pool.num_rows = num_rows;
+	pool.align = align;
+	pool.num_bands = num_bands;
+	pool.pending = pool.num_workers;
+	pool.generation++;
+
+	pthread_cond_broadcast(&pool.work_cond);
+	pthread_mutex_unlock(&pool.lock);
+
+	run_band(0);
+
+	pthread_mutex_lock(&pool.lock);
+	while (pool.pending > 0)
+		pthread_cond_wait(&pool.done_cond, &pool.lock);
+	pthread_mutex_unlock(&pool.lock);
+
+	pthread_mutex_unlock(&pool.job_lock);
 }
 
-static void fb_rgb_to_semiplanar_yuv(struct framebuffer *dst_fb, struct framebuffer *src_fb)
+/*
+ * Streaming writes, for buffers with DRM_FB_STREAM: lines are composed in
+ * a staging line on the stack and written out with stream_copy(), and
+ * repeated lines are written again from the staging line instead of being
+ * copied from the framebuffer. Other buffers, like malloc memory, are
+ * written in place, which is faster for cached memory but reads back from
+ * write-combined buffers.
+ */
+
+static bool fb_streaming(const struct framebuffer *fb)
 {
-	unsigned w = src_fb->width;
-	unsigned h = src_fb->height;
+	return fb->flags & DRM_FB_STREAM;
+}
+
+/*
+ * The converters below work on rows [y0, y1). A line is only copied from
+ * the previous one if that belongs to the same band, as other bands may
+ * still be in progress.
+ */
+
+static void convert_packed_yuv(struct framebuffer *dst_fb, const struct line_source *src,
+	unsigned y0, unsigned y1)
+{
+	const struct convert_ops *ops = convert_get_ops();
+	unsigned w = dst_fb->width;
+	uint32_t buf[w];
 
-	uint8_t *dst_y = dst_fb->planes[0].map;
-	uint8_t *dst_uv = dst_fb->planes[1].map;
+	void (*convert_line)(uint8_t *dst, const uint32_t *src, unsigned w);
 
-	for (int y = 0; y < h; ++y) {
-		for (int x = 0; x < w; ++x) {
-			struct yuv yuv = read_rgb_as_yuv(src_fb, x, y);
-			dst_y[x] = yuv.y;
+	switch (dst_fb->format) {
+		case DRM_FORMAT_UYVY:
+			convert_line = ops->xrgb_to_uyvy;
+			break;
+		case DRM_FORMAT_YUYV:
+			convert_line = ops->xrgb_to_yuyv;
+			break;
+
+		default:
+			ASSERT(false);
+	}
+
+	const uint32_t stride = dst_fb->planes[0].stride;
+	uint8_t *dst = dst_fb->planes[0].map + stride * y0;
+	bool stream = fb_streaming(dst_fb);
+	uint8_t line[w * 2];
+
+	for (unsigned y = y0; y < y1; ++y) {
+		bool same = y > y0 && line_same_as_prev(src, y);
+
+		if (stream) {
+			/* a repeated line is still in the staging line */
+			if (!same)
+				convert_line(line, src->get_line(src, y, buf), w);
+			stream_copy(dst, line, w * 2);
+		} else if (same) {
+			memcpy(dst, dst - stride, w * 2);
+		} else {
+			convert_line(dst, src->get_line(src, y, buf), w);
 		}
 
-		dst_y += dst_fb->planes[0].stride;
+		dst += stride;
 	}
 
-	for (int y = 0; y < h; y += 2) {
-		for (int x = 0; x < w; x += 2) {
-			struct yuv yuv00 = read_rgb_as_yuv(src_fb, x + 0, y + 0);
-			struct yuv yuv01 = read_rgb_as_yuv(src_fb, x + 1, y + 0);
-			struct yuv yuv10 = read_rgb_as_yuv(src_fb, x + 0, y + 1);
-			struct yuv yuv11 = read_rgb_as_yuv(src_fb, x + 1, y + 1);
+	if (stream)
+		stream_flush();
+}
 
-			unsigned u = (yuv00.u + yuv01.u + yuv10.u + yuv11.u) / 4;
-			unsigned v = (yuv00.v + yuv01.v + yuv10.v + yuv11.v) / 4;
+static void convert_semiplanar_yuv(struct framebuffer *dst_fb, const struct line_source *src,
+	unsigned y0, unsigned y1)
+{
+	const struct convert_ops *ops = convert_get_ops();
+	unsigned w = dst_fb->width;
+	unsigned h = dst_fb->height;
+	uint32_t buf0[w], buf1[w];
+
+	const uint32_t dst_y_stride = dst_fb->planes[0].stride;
+	const uint32_t dst_uv_stride = dst_fb->planes[1].stride;
+
+	uint8_t *dst_y = dst_fb->planes[0].map + dst_y_stride * y0;
+	uint8_t *dst_uv = dst_fb->planes[1].map + dst_uv_stride * (y0 / 2);
+
+	bool stream = fb_streaming(dst_fb);
+	uint8_t line_y0[w], line_y1[w], line_uv[w];
+
+	/* Y for two lines and their shared UV line in one pass */
+	for (unsigned y = y0; y < y1; y += 2) {
+		bool last = y + 1 == h;
+		bool same = !last && y >= y0 + 2 && line_same_as_prev(src, y - 1) &&
+			line_same_as_prev(src, y) && line_same_as_prev(src, y + 1);
+
+		if (same && !stream) {
+			memcpy(dst_y, dst_y - dst_y_stride * 2, w);
+			memcpy(dst_y + dst_y_stride, dst_y - dst_y_stride, w);
+			memcpy(dst_uv, dst_uv - dst_uv_stride, w);
+		} else if (!same) {
+			const uint32_t *src0 = src->get_line(src, y, buf0);
+			const uint32_t *src1 = last ? src0 : src->get_line(src, y + 1, buf1);
+
+			if (stream)
+				ops->xrgb_to_nv12(line_y0, last ? NULL : line_y1, line_uv,
+					src0, src1, w);
+			else
+				ops->xrgb_to_nv12(dst_y, last ? NULL : dst_y + dst_y_stride,
+					dst_uv, src0, src1, w);
+		}
 
-			dst_uv[x + 0] = u;
-			dst_uv[x + 1] = v;
+		if (stream) {
+			stream_copy(dst_y, line_y0, w);
+			if (!last)
+				stream_copy(dst_y + dst_y_stride, line_y1, w);
+			stream_copy(dst_uv, line_uv, w);
 		}
 
-		dst_uv += dst_fb->planes[1].stride;
+		dst_y += dst_y_stride * 2;
+		dst_uv += dst_uv_stride;
 	}
+
+	if (stream)
+		stream_flush();
 }
 
-static void fb_rgb_to_rgb565(struct framebuffer *dst_fb, struct framebuffer *src_fb)
+static void convert_rgb565(struct framebuffer *dst_fb, const struct line_source *src,
+	unsigned y0, unsigned y1)
 {
-	unsigned w = src_fb->width;
-	unsigned h = src_fb->height;
-
-	uint8_t *dst = dst_fb->planes[0].map;
+	const struct convert_ops *ops = convert_get_ops();
+	unsigned w = dst_fb->width;
+	uint32_t buf[w];
+
+	const uint32_t stride = dst_fb->planes[0].stride;
+	uint8_t *dst = dst_fb->planes[0].map + stride * y0;
+
+	bool stream = fb_streaming(dst_fb);
+	uint16_t line[w];
+
+	for (unsigned y = y0; y < y1; ++y) {
+		bool same = y > y0 && line_same_as_prev(src, y);
+
+		if (stream) {
+			if (!same)
+				ops->xrgb_to_rgb565(line, src->get_line(src, y, buf), w);
+			stream_copy(dst, line, w * 2);
+		} else if (same) {
+			memcpy(dst, dst - stride, w * 2);
+		} else {
+			ops->xrgb_to_rgb565((uint16_t *)dst, src->get_line(src, y, buf), w);
+		}
 
-	for (int y = 0; y < h; ++y) {
-		for (int x = 0; x < w; ++x) {
-			struct rgb rgb = read_rgb(src_fb, x, y);
+		dst += stride;
+	}
 
-			unsigned r = rgb.r * 32 / 256;
-			unsigned g = rgb.g * 64 / 256;
-			unsigned b = rgb.b * 32 / 256;
+	if (stream)
+		stream_flush();
+}
 
-			((uint16_t *)dst)[x] = (r << 11) | (g << 5) | (b << 0);
+static void draw_pattern_xrgb(struct framebuffer *fb, const struct line_source *src,
+	unsigned y0, unsigned y1)
+{
+	const uint32_t stride = fb->planes[0].stride;
+	uint8_t *line = fb->planes[0].map + stride * y0;
+	bool stream = fb_streaming(fb);
+	uint32_t buf[fb->width];
+
+	for (unsigned y = y0; y < y1; ++y) {
+		bool same = y > y0 && line_same_as_prev(src, y);
+
+		if (stream) {
+			if (!same)
+				src->get_line(src, y, buf);
+			stream_copy(line, buf, fb->width * 4);
+		} else if (same) {
+			memcpy(line, line - stride, fb->width * 4);
+		} else {
+			src->get_line(src, y, (uint32_t *)line);
 		}
 
-		dst += dst_fb->planes[0].stride;
+		line += stride;
 	}
+
+	if (stream)
+		stream_flush();
 }
 
-static void fb_color_convert(struct framebuffer *dst, struct framebuffer *src)
+struct convert_job {
+	struct framebuffer *dst;
+	const struct line_source *src;
+};
+
+static void convert_band(void *arg, unsigned y0, unsigned y1)
 {
-	switch (dst->format) {
+	const struct convert_job *job = arg;
+
+	switch (job->dst->format) {
+		case DRM_FORMAT_XRGB8888:
+			draw_pattern_xrgb(job->dst, job->src, y0, y1);
+			break;
+
 		case DRM_FORMAT_NV12:
 		case DRM_FORMAT_NV21:
-			fb_rgb_to_semiplanar_yuv(dst, src);
+			convert_semiplanar_yuv(job->dst, job->src, y0, y1);
 			break;
 
 		case DRM_FORMAT_YUYV:
 		case DRM_FORMAT_UYVY:
-			fb_rgb_to_packed_yuv(dst, src);
+			convert_packed_yuv(job->dst, job->src, y0, y1);
 			break;
 
 		case DRM_FORMAT_RGB565:
-			fb_rgb_to_rgb565(dst, src);
+			convert_rgb565(job->dst, job->src, y0, y1);
 			break;
 
 		default:
@@ -324,90 +780,782 @@ static void fb_color_convert(struct framebuffer *dst, struct framebuffer *src)
 	}
 }
 
-static void draw_rgb_test_pattern(struct framebuffer *fb, int pattern)
+static void convert_lines(struct framebuffer *dst, const struct line_source *src)
 {
-	switch (pattern) {
-	case 0:
-	default:
-		drm_draw_test_pattern_default(fb);
-		break;
-	case 1:
-		fill_smpte_rgb32(fb);
-		break;
-	case 2:
-		drm_draw_test_pattern_edges(fb);
-		break;
+	struct convert_job job = {
+		.dst = dst,
+		.src = src,
+	};
+
+	/* pick the implementation before the workers race to do it */
+	convert_get_ops();
+
+	run_bands(convert_band, &job, dst->height, dst->num_planes > 1 ? 2 : 1);
+}
+
+void fb_color_convert(struct framebuffer *dst, struct framebuffer *src)
+{
+	const struct line_source line_src = {
+		.get_line = get_fb_line,
+		.fb = src,
+	};
+
+	ASSERT(dst->format != DRM_FORMAT_XRGB8888);
+
+	drm_fb_map(dst);
+	drm_fb_map(src);
+
+	convert_lines(dst, &line_src);
+}
+
+static void render_test_pattern(struct framebuffer *fb, int pattern)
+{
+	/* XRGB lines are rendered in place, others via a line buffer */
+	const struct line_source line_src = {
+		.get_line = get_pattern_line,
+		.same_as_prev = pattern_same_as_prev,
+		.fb = fb,
+		.get_spans = get_pattern_spans_func(pattern),
+	};
+
+	convert_lines(fb, &line_src);
+}
+
+/*
+ * Rendered pattern cache. Each entry holds the pattern planes without
+ * stride padding, and drm_draw_test_pattern() copies them into the
+ * destination line by line. With a cache directory set the entries are
+ * also stored as files there and mmapped on later runs. The cache is
+ * bounded by bytes, a single 4K XRGB pattern is already 33 MB, and is
+ * freed at exit.
+ */
+
+#define PATTERN_CACHE_DEFAULT_MB 64
+/* bump when the rendered output changes, to invalidate old files */
+#define PATTERN_FILE_VERSION 1
+
+struct pattern_file_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t width;
+	uint32_t height;
+	uint32_t format;
+	int32_t pattern;
+	uint32_t num_planes;
+	uint32_t line_bytes[4];
+	uint32_t lines[4];
+};
+
+struct pattern_cache_entry {
+	struct pattern_cache_entry *next;
+	int refcount;
+
+	uint32_t width;
+	uint32_t height;
+	uint32_t format;
+	int pattern;
+
+	int num_planes;
+	uint32_t line_bytes[4];
+	uint32_t lines[4];
+	uint8_t *planes[4];
+
+	void *data;
+	size_t data_size;
+	bool mapped;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	bool disabled;
+	char *dir;
+	struct pattern_cache_entry *entries;	/* most recently used first */
+	size_t max_bytes;
+} pattern_cache = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.max_bytes = (size_t)PATTERN_CACHE_DEFAULT_MB << 20,
+};
+
+static const char pattern_file_magic[8] = "DRMPAT\0";
+
+static void pattern_cache_init(void)
+{
+	static bool initialized;
+
+	/* called with the lock held */
+	if (initialized)
+		return;
+
+	initialized = true;
+
+	atexit(drm_pattern_cache_flush);
+
+	/* $DRM_PATTERN_CACHE is the cache size in MB, 0 disables it */
+	const char *env = getenv("DRM_PATTERN_CACHE");
+	if (env) {
+		unsigned long mb = strtoul(env, NULL, 0);
+
+		if (mb == 0)
+			pattern_cache.disabled = true;
+		else
+			pattern_cache.max_bytes = (size_t)mb << 20;
 	}
+
+	env = getenv("DRM_PATTERN_CACHE_DIR");
+	if (env && !pattern_cache.dir)
+		pattern_cache.dir = strdup(env);
+}
+
+void drm_pattern_cache_enable(bool enable)
+{
+	pthread_mutex_lock(&pattern_cache.lock);
+	pattern_cache_init();
+	pattern_cache.disabled = !enable;
+	pthread_mutex_unlock(&pattern_cache.lock);
+}
+
+void drm_pattern_cache_set_dir(const char *dir)
+{
+	pthread_mutex_lock(&pattern_cache.lock);
+	pattern_cache_init();
+	free(pattern_cache.dir);
+	pattern_cache.dir = dir ? strdup(dir) : NULL;
+	pthread_mutex_unlock(&pattern_cache.lock);
+}
+
+/* bytes per line and number of lines the renderer writes for each plane */
+static int pattern_layout(uint32_t format, uint32_t width, uint32_t height,
+	uint32_t line_bytes[4], uint32_t lines[4])
+{
+	switch (format) {
+		case DRM_FORMAT_XRGB8888:
+			line_bytes[0] = width * 4;
+			lines[0] = height;
+			return 1;
+
+		case DRM_FORMAT_YUYV:
+		case DRM_FORMAT_UYVY:
+		case DRM_FORMAT_RGB565:
+			line_bytes[0] = width * 2;
+			lines[0] = height;
+			return 1;
+
+		case DRM_FORMAT_NV12:
+		case DRM_FORMAT_NV21:
+			line_bytes[0] = width;
+			lines[0] = height;
+			line_bytes[1] = width;
+			lines[1] = (height + 1) / 2;
+			return 2;
+
+		default:
+			ASSERT(false);
+	}
+}
+
+static void free_pattern_entry(struct pattern_cache_entry *e)
+{
+	if (e->mapped)
+		munmap(e->data, e->data_size);
+	else
+		free(e->data);
+
+	free(e);
+}
+
+static struct pattern_cache_entry *alloc_pattern_entry(uint32_t width, uint32_t height,
+	uint32_t format, int pattern)
+{
+	struct pattern_cache_entry *e = calloc(1, sizeof(*e));
+	ASSERT(e);
+
+	e->width = width;
+	e->height = height;
+	e->format = format;
+	e->pattern = pattern;
+	e->refcount = 1;
+	e->num_planes = pattern_layout(format, width, height, e->line_bytes, e->lines);
+
+	return e;
+}
+
+/* point the planes at the data following the (optional) file header */
+static void setup_pattern_planes(struct pattern_cache_entry *e, size_t offset)
+{
+	for (int i = 0; i < e->num_planes; ++i) {
+		e->planes[i] = (uint8_t *)e->data + offset;
+		offset += (size_t)e->line_bytes[i] * e->lines[i];
+	}
+}
+
+static size_t pattern_data_size(const struct pattern_cache_entry *e)
+{
+	size_t size = 0;
+
+	for (int i = 0; i < e->num_planes; ++i)
+		size += (size_t)e->line_bytes[i] * e->lines[i];
+
+	return size;
+}
+
+static char *pattern_file_path(const char *dir, const struct pattern_cache_entry *e)
+{
+	char *path;
+	int r;
+
+	r = asprintf(&path, "%s/pattern-%ux%u-%.4s-%d.bin", dir, e->width, e->height,
+		(const char *)&e->format, e->pattern);
+	ASSERT(r > 0);
+
+	return path;
+}
+
+static bool load_pattern_file(const char *dir, struct pattern_cache_entry *e)
+{
+	struct pattern_file_header *hdr;
+	char *path = pattern_file_path(dir, e);
+	size_t size = sizeof(*hdr) + pattern_data_size(e);
+	bool ok = false;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	free(path);
+
+	if (fd < 0)
+		return false;
+
+	if (lseek(fd, 0, SEEK_END) != size)
+		goto out;
+
+	hdr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED)
+		goto out;
+
+	ok = memcmp(hdr->magic, pattern_file_magic, sizeof(hdr->magic)) == 0 &&
+		hdr->version == PATTERN_FILE_VERSION &&
+		hdr->width == e->width && hdr->height == e->height &&
+		hdr->format == e->format && hdr->pattern == e->pattern &&
+		hdr->num_planes == e->num_planes &&
+		memcmp(hdr->line_bytes, e->line_bytes, sizeof(e->line_bytes)) == 0 &&
+		memcmp(hdr->lines, e->lines, sizeof(e->lines)) == 0;
+
+	if (!ok) {
+		munmap(hdr, size);
+		goto out;
+	}
+
+	e->data = hdr;
+	e->data_size = size;
+	e->mapped = true;
+	setup_pattern_planes(e, sizeof(*hdr));
+
+out:
+	close(fd);
+	return ok;
+}
+
+/* write to a temp file and rename, so readers never see a partial file */
+static void store_pattern_file(const char *dir, const struct pattern_cache_entry *e)
+{
+	struct pattern_file_header hdr = {
+		.version = PATTERN_FILE_VERSION,
+		.width = e->width,
+		.height = e->height,
+		.format = e->format,
+		.pattern = e->pattern,
+		.num_planes = e->num_planes,
+	};
+	char *path = pattern_file_path(dir, e);
+	char *tmp_path;
+	bool ok;
+	int fd, r;
+
+	memcpy(hdr.magic, pattern_file_magic, sizeof(hdr.magic));
+	memcpy(hdr.line_bytes, e->line_bytes, sizeof(hdr.line_bytes));
+	memcpy(hdr.lines, e->lines, sizeof(hdr.lines));
+
+	r = asprintf(&tmp_path, "%s.%d", path, getpid());
+	ASSERT(r > 0);
+
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		goto out;
+
+	ok = write(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+		write(fd, e->data, e->data_size) == e->data_size;
+
+	close(fd);
+
+	if (!ok || rename(tmp_path, path) != 0)
+		unlink(tmp_path);
+
+out:
+	free(tmp_path);
+	free(path);
+}
+
+static void render_pattern_entry(struct pattern_cache_entry *e)
+{
+	struct framebuffer fb = {
+		.fd = -1,
+		.width = e->width,
+		.height = e->height,
+		.format = e->format,
+		.num_planes = e->num_planes,
+	};
+
+	e->data_size = pattern_data_size(e);
+	e->data = aligned_alloc(64, (e->data_size + 63) & ~(size_t)63);
+	ASSERT(e->data);
+
+	setup_pattern_planes(e, 0);
+
+	for (int i = 0; i < e->num_planes; ++i) {
+		fb.planes[i].map = e->planes[i];
+		fb.planes[i].stride = e->line_bytes[i];
+		fb.planes[i].size = e->line_bytes[i] * e->lines[i];
+	}
+
+	render_test_pattern(&fb, e->pattern);
+}
+
+static struct pattern_cache_entry *find_pattern_entry(uint32_t width, uint32_t height,
+	uint32_t format, int pattern)
+{
+	struct pattern_cache_entry **pp;
+
+	for (pp = &pattern_cache.entries; *pp; pp = &(*pp)->next) {
+		struct pattern_cache_entry *e = *pp;
+
+		if (e->width != width || e->height != height ||
+			e->format != format || e->pattern != pattern)
+			continue;
+
+		/* move to front */
+		*pp = e->next;
+		e->next = pattern_cache.entries;
+		pattern_cache.entries = e;
+
+		e->refcount++;
+
+		return e;
+	}
+
+	return NULL;
+}
+
+static void put_pattern_entry(struct pattern_cache_entry *e)
+{
+	pthread_mutex_lock(&pattern_cache.lock);
+	bool last = --e->refcount == 0;
+	pthread_mutex_unlock(&pattern_cache.lock);
+
+	if (last)
+		free_pattern_entry(e);
+}
+
+/* called with the lock held, drops the least recently used entries */
+static void trim_pattern_cache(size_t max_bytes)
+{
+	struct pattern_cache_entry **pp = &pattern_cache.entries;
+	size_t bytes = 0;
+
+	while (*pp) {
+		struct pattern_cache_entry *e = *pp;
+
+		if (bytes + e->data_size <= max_bytes) {
+			bytes += e->data_size;
+			pp = &e->next;
+			continue;
+		}
+
+		*pp = e->next;
+
+		/* entries still being copied from are freed by their user */
+		if (--e->refcount == 0)
+			free_pattern_entry(e);
+	}
+}
+
+void drm_pattern_cache_flush(void)
+{
+	pthread_mutex_lock(&pattern_cache.lock);
+	trim_pattern_cache(0);
+	pthread_mutex_unlock(&pattern_cache.lock);
+}
+
+static struct pattern_cache_entry *get_pattern_entry(uint32_t width, uint32_t height,
+	uint32_t format, int pattern)
+{
+	struct pattern_cache_entry *e, *old;
+	char *dir;
+
+	pthread_mutex_lock(&pattern_cache.lock);
+
+	pattern_cache_init();
+
+	if (pattern_cache.disabled) {
+		pthread_mutex_unlock(&pattern_cache.lock);
+		return NULL;
+	}
+
+	e = find_pattern_entry(width, height, format, pattern);
+	dir = pattern_cache.dir ? strdup(pattern_cache.dir) : NULL;
+
+	pthread_mutex_unlock(&pattern_cache.lock);
+
+	if (e) {
+		free(dir);
+		return e;
+	}
+
+	/* render (or load) outside the lock, another thread may race us */
+	e = alloc_pattern_entry(width, height, format, pattern);
+
+	if (!dir || !load_pattern_file(dir, e)) {
+		render_pattern_entry(e);
+
+		if (dir)
+			store_pattern_file(dir, e);
+	}
+
+	free(dir);
+
+	pthread_mutex_lock(&pattern_cache.lock);
+
+	old = find_pattern_entry(width, height, format, pattern);
+
+	if (!old) {
+		/* one reference for the cache, one for the caller */
+		e->refcount++;
+		e->next = pattern_cache.entries;
+		pattern_cache.entries = e;
+
+		trim_pattern_cache(pattern_cache.max_bytes);
+	}
+
+	pthread_mutex_unlock(&pattern_cache.lock);
+
+	if (old) {
+		free_pattern_entry(e);
+		e = old;
+	}
+
+	return e;
+}
+
+struct copy_job {
+	struct framebuffer *dst;
+	const struct pattern_cache_entry *src;
+};
+
+static void copy_pattern_band(void *arg, unsigned y0, unsigned y1)
+{
+	const struct copy_job *job = arg;
+	const struct pattern_cache_entry *e = job->src;
+	struct framebuffer *fb = job->dst;
+	bool stream = fb_streaming(fb);
+
+	for (int i = 0; i < e->num_planes; ++i) {
+		const struct framebuffer_plane *plane = &fb->planes[i];
+		uint32_t lines = e->lines[i];
+		uint32_t start = (uint64_t)y0 * lines / fb->height;
+		uint32_t end = y1 == fb->height ? lines : (uint64_t)y1 * lines / fb->height;
+
+		if (end > plane->size / plane->stride)
+			end = plane->size / plane->stride;
+
+		const uint8_t *src = e->planes[i] + (size_t)e->line_bytes[i] * start;
+		uint8_t *dst = plane->map + (size_t)plane->stride * start;
+
+		for (uint32_t y = start; y < end; ++y) {
+			if (stream)
+				stream_copy(dst, src, e->line_bytes[i]);
+			else
+				memcpy(dst, src, e->line_bytes[i]);
+
+			src += e->line_bytes[i];
+			dst += plane->stride;
+		}
+	}
+
+	if (stream)
+		stream_flush();
 }
 
 void drm_draw_test_pattern(struct framebuffer *fb, int pattern)
 {
-	if (fb->format == DRM_FORMAT_XRGB8888) {
-		draw_rgb_test_pattern(fb, pattern);
+	struct pattern_cache_entry *e;
+
+	drm_fb_map(fb);
+
+	e = get_pattern_entry(fb->width, fb->height, fb->format, pattern);
+
+	if (!e) {
+		render_test_pattern(fb, pattern);
 		return;
 	}
 
-	/* draw and convert */
+	struct copy_job job = {
+		.dst = fb,
+		.src = e,
+	};
 
-	struct framebuffer *orig_fb = fb;
+	run_bands(copy_pattern_band, &job, fb->height, fb->num_planes > 1 ? 2 : 1);
 
-	struct framebuffer new_fb = {
-		.width = fb->width,
-		.height = fb->height,
-		.format = DRM_FORMAT_XRGB8888,
-		.num_planes = 1,
-		.planes[0] = {
-			.stride = fb->width * 4,
-			.size = fb->width * 4 * fb->height,
-		},
-	};
+	put_pattern_entry(e);
+}
 
-	fb = &new_fb;
-	size_t size = fb->planes[0].stride * fb->height;
-	fb->planes[0].map = malloc(size);
+static void fill_black(uint8_t *p, size_t size, uint32_t pattern, bool stream)
+{
+	if (stream)
+		stream_fill32(p, pattern, size);
+	else if ((pattern & 0xffff) == pattern >> 16 && (pattern & 0xff) == ((pattern >> 8) & 0xff))
+		memset(p, pattern & 0xff, size);
+	else
+		fill32((uint32_t *)p, pattern, size / 4);
+}
 
-	draw_rgb_test_pattern(fb, pattern);
+static void clear_band(void *arg, unsigned y0, unsigned y1)
+{
+	struct framebuffer *fb = arg;
 
-	fb_color_convert(orig_fb, fb);
+	for (int i = 0; i < fb->num_planes; ++i) {
+		struct framebuffer_plane *plane = &fb->planes[i];
+		uint32_t lines = plane->size / plane->stride;
+		uint32_t start = (uint64_t)y0 * lines / fb->height;
+		uint32_t end = (uint64_t)y1 * lines / fb->height;
+
+		/* the last band also gets any bytes past the last full line */
+		size_t size = y1 == fb->height ? plane->size - start * plane->stride :
+			(end - start) * plane->stride;
+
+		fill_black(plane->map + start * plane->stride, size,
+			drm_format_black(fb->format, i), fb_streaming(fb));
+	}
 
-	free(fb->planes[0].map);
+	if (fb_streaming(fb))
+		stream_flush();
 }
 
 void drm_clear_fb(struct framebuffer *fb)
 {
-	for (int i = 0; i < fb->num_planes; ++i)
-		memset(fb->planes[i].map, 0, fb->planes[i].size);
+	drm_fb_map(fb);
+
+	run_bands(clear_band, fb, fb->height, fb->num_planes > 1 ? 2 : 1);
 }
 
-static void drm_draw_color_bar_rgb888(struct framebuffer *buf, int old_xpos, int xpos, int width)
+/* pixels per sample horizontally and vertically, and bytes per sample */
+static void plane_geometry(uint32_t format, int plane, unsigned *xsub, unsigned *ysub,
+	unsigned *cpp)
 {
-	const unsigned int colors32[] = {
-		0xffffff,
-		0xff0000,
-		0xffffff,
-		0x00ff00,
-		0xffffff,
-		0x0000ff,
-		0xffffff,
-		0xaaaaaa,
-		0xffffff,
-		0x777777,
-		0xffffff,
-		0x333333,
-		0xffffff,
-	};
+	*xsub = 1;
+	*ysub = 1;
+
+	switch (format) {
+		case DRM_FORMAT_XRGB8888:
+			*cpp = 4;
+			break;
 
+		case DRM_FORMAT_RGB565:
+			*cpp = 2;
+			break;
+
+		case DRM_FORMAT_YUYV:
+		case DRM_FORMAT_UYVY:
+			/* one macropixel */
+			*xsub = 2;
+			*cpp = 4;
+			break;
+
+		case DRM_FORMAT_NV12:
+		case DRM_FORMAT_NV21:
+			if (plane == 0) {
+				*cpp = 1;
+			} else {
+				*xsub = 2;
+				*ysub = 2;
+				*cpp = 2;
+			}
+			break;
+
+		default:
+			ASSERT(false);
+	}
+}
+
+void drm_clear_rect(struct framebuffer *fb, const struct drm_mode_rect *rect)
+{
+	int x1 = rect->x1 > 0 ? rect->x1 : 0;
+	int y1 = rect->y1 > 0 ? rect->y1 : 0;
+	int x2 = rect->x2 < (int)fb->width ? rect->x2 : (int)fb->width;
+	int y2 = rect->y2 < (int)fb->height ? rect->y2 : (int)fb->height;
+
+	if (x1 >= x2 || y1 >= y2)
+		return;
+
+	drm_fb_map(fb);
+
+	for (int i = 0; i < fb->num_planes; ++i) {
+		struct framebuffer_plane *plane = &fb->planes[i];
+		unsigned xsub, ysub, cpp;
+
+		plane_geometry(fb->format, i, &xsub, &ysub, &cpp);
+
+		/* samples partially covered by the rect are cleared too */
+		unsigned sx1 = x1 / xsub, sx2 = (x2 + xsub - 1) / xsub;
+		unsigned sy1 = y1 / ysub, sy2 = (y2 + ysub - 1) / ysub;
+
+		uint8_t *line = plane->map + plane->stride * sy1 + sx1 * cpp;
+		uint32_t black = drm_format_black(fb->format, i);
+
+		for (unsigned y = sy1; y < sy2; ++y) {
+			fill_black(line, (sx2 - sx1) * cpp, black, fb_streaming(fb));
+			line += plane->stride;
+		}
+	}
+
+	if (fb_streaming(fb))
+		stream_flush();
+}
+
+/*
+ * Damage history for buffer age based redraw. Every frame adds the area
+ * it changed, and a buffer last drawn in frame N needs the union of the
+ * damage of frames N + 1 up to the current one.
+ */
+
+static bool rect_contains(const struct drm_mode_rect *a, const struct drm_mode_rect *b)
+{
+	return a->x1 <= b->x1 && a->x2 >= b->x2 && a->y1 <= b->y1 && a->y2 >= b->y2;
+}
+
+/* the union of the two is a rect */
+static bool rects_mergeable(const struct drm_mode_rect *a, const struct drm_mode_rect *b)
+{
+	if (rect_contains(a, b) || rect_contains(b, a))
+		return true;
+
+	if (a->y1 == b->y1 && a->y2 == b->y2)
+		return a->x1 <= b->x2 && b->x1 <= a->x2;
+
+	if (a->x1 == b->x1 && a->x2 == b->x2)
+		return a->y1 <= b->y2 && b->y1 <= a->y2;
+
+	return false;
+}
+
+int damage_add_rect(struct drm_mode_rect *rects, int num_rects, int max_rects,
+	struct drm_mode_rect r)
+{
+	for (int i = 0; i < num_rects; ++i) {
+		if (!rects_mergeable(&rects[i], &r))
+			continue;
+
+		if (rects[i].x1 < r.x1)
+			r.x1 = rects[i].x1;
+		if (rects[i].y1 < r.y1)
+			r.y1 = rects[i].y1;
+		if (rects[i].x2 > r.x2)
+			r.x2 = rects[i].x2;
+		if (rects[i].y2 > r.y2)
+			r.y2 = rects[i].y2;
+
+		/* the grown rect may now line up with others */
+		rects[i] = rects[--num_rects];
+
+		return damage_add_rect(rects, num_rects, max_rects, r);
+	}
+
+	if (num_rects == max_rects)
+		return -1;
+
+	rects[num_rects++] = r;
+
+	return num_rects;
+}
+
+uint64_t damage_history_add(struct damage_history *hist, const struct drm_mode_rect *rects,
+	int num_rects)
+{
+	uint64_t frame = ++hist->frame;
+	int idx = frame % DAMAGE_HISTORY_FRAMES;
+	int n = 0;
+
+	for (int i = 0; i < num_rects && n >= 0; ++i)
+		n = damage_add_rect(hist->rects[idx], n, DAMAGE_MAX_RECTS, rects[i]);
+
+	hist->num_rects[idx] = n;
+
+	return frame;
+}
+
+int damage_history_get(const struct damage_history *hist, uint64_t frame,
+	struct drm_mode_rect *rects, int max_rects)
+{
+	int n = 0;
+
+	/* never drawn, or too old */
+	if (frame == 0 || frame > hist->frame ||
+		hist->frame - frame >= DAMAGE_HISTORY_FRAMES)
+		return -1;
+
+	for (uint64_t f = frame + 1; f <= hist->frame; ++f) {
+		int idx = f % DAMAGE_HISTORY_FRAMES;
+
+		if (hist->num_rects[idx] < 0)
+			return -1;
+
+		for (int i = 0; i < hist->num_rects[idx]; ++i) {
+			n = damage_add_rect(rects, n, max_rects, hist->rects[idx][i]);
+			if (n < 0)
+				return -1;
+		}
+	}
+
+	return n;
+}
+
+static const uint32_t bar_colors[] = {
+	0xffffff,
+	0xff0000,
+	0xffffff,
+	0x00ff00,
+	0xffffff,
+	0x0000ff,
+	0xffffff,
+	0xaaaaaa,
+	0xffffff,
+	0x777777,
+	0xffffff,
+	0x333333,
+	0xffffff,
+};
+
+/* 16-bit fill, 32-bit wide once aligned */
+static void fill16(uint16_t *p, uint16_t v, unsigned n)
+{
+	if (n > 0 && ((uintptr_t)p & 2)) {
+		*p++ = v;
+		n--;
+	}
+
+	fill32((uint32_t *)p, v | ((uint32_t)v << 16), n / 2);
+
+	if (n & 1)
+		p[n - 1] = v;
+}
+
+static void drm_draw_color_bar_rgb888(struct framebuffer *buf, int old_xpos, int xpos, int width)
+{
 	for (unsigned y = 0; y < buf->height; ++y) {
-		unsigned int bcol = colors32[y * ARRAY_SIZE(colors32) / buf->height];
+		unsigned int bcol = bar_colors[y * ARRAY_SIZE(bar_colors) / buf->height];
 		uint32_t *line = (uint32_t*)(buf->planes[0].map + buf->planes[0].stride * y);
 
-		if (old_xpos >= 0) {
-			for (unsigned x = old_xpos; x < old_xpos + width; ++x)
-				line[x] = 0;
-		}
+		if (old_xpos >= 0)
+			fill32(line + old_xpos, 0, width);
 
-		for (unsigned x = xpos; x < xpos + width; ++x)
-			line[x] = bcol;
+		fill32(line + xpos, bcol, width);
 	}
 }
 
@@ -425,57 +1573,172 @@ static void drm_draw_color_bar_rgb565(struct framebuffer *buf, int old_xpos, int
 		unsigned int bcol = colors[y * ARRAY_SIZE(colors) / buf->height];
 		uint16_t *line = (uint16_t*)(buf->planes[0].map + buf->planes[0].stride * y);
 
-		if (old_xpos >= 0) {
-			for (unsigned x = old_xpos; x < old_xpos + width; ++x)
-				line[x] = 0;
-		}
+		if (old_xpos >= 0)
+			fill16(line + old_xpos, 0, width);
+
+		fill16(line + xpos, bcol, width);
+	}
+}
+
+/*
+ * The YUV kernels draw the same bars as XRGB8888. Bars are widened to
+ * whole macropixels (even x) so the chroma stays in sync with the luma,
+ * and cleared areas are black.
+ */
+
+#define YUV_BLACK 0x000000
+
+static void bar_yuv(uint32_t color, uint8_t *y, uint8_t *u, uint8_t *v)
+{
+	uint8_t r = (color >> 16) & 0xff;
+	uint8_t g = (color >> 8) & 0xff;
+	uint8_t b = color & 0xff;
+
+	*y = MAKE_YUV_601_Y(r, g, b);
+	*u = MAKE_YUV_601_U(r, g, b);
+	*v = MAKE_YUV_601_V(r, g, b);
+}
+
+/* a YUYV or UYVY macropixel as stored in memory */
+static uint32_t bar_macropixel(uint32_t format, uint32_t color)
+{
+	uint8_t y, u, v;
+
+	bar_yuv(color, &y, &u, &v);
+
+	if (format == DRM_FORMAT_UYVY)
+		return u | (y << 8) | (v << 16) | ((uint32_t)y << 24);
+	else
+		return y | (u << 8) | (y << 16) | ((uint32_t)v << 24);
+}
+
+static void drm_draw_color_bar_packed_yuv(struct framebuffer *buf, int old_xpos, int xpos, int width)
+{
+	uint32_t colors[ARRAY_SIZE(bar_colors)];
+	uint32_t black = bar_macropixel(buf->format, YUV_BLACK);
 
-		for (unsigned x = xpos; x < xpos + width; ++x)
-			line[x] = bcol;
+	for (unsigned i = 0; i < ARRAY_SIZE(bar_colors); ++i)
+		colors[i] = bar_macropixel(buf->format, bar_colors[i]);
+
+	unsigned old_x0 = old_xpos / 2, old_n = (old_xpos + width + 1) / 2 - old_x0;
+	unsigned x0 = xpos / 2, n = (xpos + width + 1) / 2 - x0;
+
+	for (unsigned y = 0; y < buf->height; ++y) {
+		uint32_t bcol = colors[y * ARRAY_SIZE(bar_colors) / buf->height];
+		uint32_t *line = (uint32_t*)(buf->planes[0].map + buf->planes[0].stride * y);
+
+		if (old_xpos >= 0)
+			fill32(line + old_x0, black, old_n);
+
+		fill32(line + x0, bcol, n);
 	}
 }
 
 static void drm_draw_color_bar_semiplanar_yuv(struct framebuffer *buf, int old_xpos, int xpos, int width)
 {
-	const uint8_t colors[] = {
-		0xff,
-		0x00,
-		0xff,
-		0x20,
-		0xff,
-		0x40,
-		0xff,
-		0x80,
-		0xff,
-	};
+	uint8_t luma[ARRAY_SIZE(bar_colors)];
+	uint16_t chroma[ARRAY_SIZE(bar_colors)];
+	uint8_t black_y, black_u, black_v;
+	uint16_t black_uv;
+	bool nv21 = buf->format == DRM_FORMAT_NV21;
+
+	for (unsigned i = 0; i < ARRAY_SIZE(bar_colors); ++i) {
+		uint8_t u, v;
+
+		bar_yuv(bar_colors[i], &luma[i], &u, &v);
+		chroma[i] = nv21 ? v | (u << 8) : u | (v << 8);
+	}
+
+	bar_yuv(YUV_BLACK, &black_y, &black_u, &black_v);
+	black_uv = nv21 ? black_v | (black_u << 8) : black_u | (black_v << 8);
+
+	unsigned old_x0 = old_xpos & ~1, old_x1 = (old_xpos + width + 1) & ~1;
+	unsigned x0 = xpos & ~1, x1 = (xpos + width + 1) & ~1;
 
 	for (unsigned y = 0; y < buf->height; ++y) {
-		unsigned int bcol = colors[y * ARRAY_SIZE(colors) / buf->height];
-		uint8_t *line = (uint8_t*)(buf->planes[0].map + buf->planes[0].stride * y);
+		uint8_t bcol = luma[y * ARRAY_SIZE(bar_colors) / buf->height];
+		uint8_t *line = buf->planes[0].map + buf->planes[0].stride * y;
 
-		if (old_xpos >= 0) {
-			for (unsigned x = old_xpos; x < old_xpos + width; ++x)
-				line[x] = 0;
-		}
+		if (old_xpos >= 0)
+			memset(line + old_x0, black_y, old_x1 - old_x0);
+
+		memset(line + x0, bcol, x1 - x0);
+	}
+
+	/* each UV line takes the color of the upper of its two luma lines */
+	unsigned uv_lines = (buf->height + 1) / 2;
+
+	if (uv_lines > buf->planes[1].size / buf->planes[1].stride)
+		uv_lines = buf->planes[1].size / buf->planes[1].stride;
+
+	for (unsigned y = 0; y < uv_lines; ++y) {
+		uint16_t bcol = chroma[y * 2 * ARRAY_SIZE(bar_colors) / buf->height];
+		uint16_t *line = (uint16_t*)(buf->planes[1].map + buf->planes[1].stride * y);
+
+		if (old_xpos >= 0)
+			fill16(line + old_x0 / 2, black_uv, (old_x1 - old_x0) / 2);
+
+		fill16(line + x0 / 2, bcol, (x1 - x0) / 2);
+	}
+}
+
+static void set_rect(struct drm_mode_rect *r, int x1, int y1, int x2, int y2)
+{
+	r->x1 = x1;
+	r->y1 = y1;
+	r->x2 = x2;
+	r->y2 = y2;
+}
 
-		for (unsigned x = xpos; x < xpos + width; ++x)
-			line[x] = bcol;
+int drm_color_bar_damage(const struct framebuffer *buf, int old_xpos, int xpos, int width,
+	struct drm_mode_rect *damage)
+{
+	int num_damage = 0;
+	int h = buf->height;
+
+	if (old_xpos < 0) {
+		set_rect(&damage[num_damage++], xpos, 0, xpos + width, h);
+	} else if (old_xpos <= xpos + width && xpos <= old_xpos + width) {
+		/* overlapping or touching bars as one rect */
+		int x1 = old_xpos < xpos ? old_xpos : xpos;
+		int x2 = (old_xpos > xpos ? old_xpos : xpos) + width;
+
+		set_rect(&damage[num_damage++], x1, 0, x2, h);
+	} else {
+		set_rect(&damage[num_damage++], old_xpos, 0, old_xpos + width, h);
+		set_rect(&damage[num_damage++], xpos, 0, xpos + width, h);
+	}
+
+	/* the YUV kernels draw whole macropixels */
+	if (buf->format != DRM_FORMAT_XRGB8888 && buf->format != DRM_FORMAT_RGB565) {
+		for (int i = 0; i < num_damage; ++i) {
+			damage[i].x1 &= ~1;
+			damage[i].x2 = (damage[i].x2 + 1) & ~1;
+		}
 	}
+
+	return num_damage;
 }
 
-void drm_draw_color_bar(struct framebuffer *buf, int old_xpos, int xpos, int width)
+int drm_draw_color_bar(struct framebuffer *buf, int old_xpos, int xpos, int width,
+	struct drm_mode_rect *damage)
 {
+	int num_damage = 0;
+
+	drm_fb_map(buf);
+
+	if (damage)
+		num_damage = drm_color_bar_damage(buf, old_xpos, xpos, width, damage);
+
 	switch (buf->format) {
 		case DRM_FORMAT_NV12:
 		case DRM_FORMAT_NV21:
-			// XXX not right but gets something on the screen
 			drm_draw_color_bar_semiplanar_yuv(buf, old_xpos, xpos, width);
 			break;
 
 		case DRM_FORMAT_YUYV:
 		case DRM_FORMAT_UYVY:
-			// XXX not right but gets something on the screen
-			drm_draw_color_bar_rgb565(buf, old_xpos, xpos, width);
+			drm_draw_color_bar_packed_yuv(buf, old_xpos, xpos, width);
 			break;
 
 		case DRM_FORMAT_RGB565:
@@ -489,4 +1752,6 @@ void drm_draw_color_bar(struct framebuffer *buf, int old_xpos, int xpos, int wid
 		default:
 			ASSERT(false);
 	}
-}
\ No newline at end of file
+
+	return num_damage;
+}
@@ -26,9 +26,68 @@ static inline uint32_t MAKE_YUV_601_V(uint8_t r, uint8_t g, uint8_t b)
 	return (((112 * r -  94 * g -  18 * b + 128) >> 8) + 128);
 }
 
-void drm_draw_color_bar(struct framebuffer *buf, int old_xpos, int xpos, int width);
+/*
+ * Moves the bar from old_xpos (< 0 for none) to xpos. If damage is not
+ * NULL the changed area is stored there, up to two rects, and the number
+ * of rects is returned.
+ */
+int drm_draw_color_bar(struct framebuffer *buf, int old_xpos, int xpos, int width,
+	struct drm_mode_rect *damage);
+/* the area drm_draw_color_bar() would change, without drawing */
+int drm_color_bar_damage(const struct framebuffer *buf, int old_xpos, int xpos, int width,
+	struct drm_mode_rect *damage);
 void draw_pixel(struct framebuffer *buf, int x, int y, uint32_t color);
 void drm_draw_test_pattern(struct framebuffer *fb, int pattern);
+/* fill with black */
 void drm_clear_fb(struct framebuffer *fb);
+void drm_clear_rect(struct framebuffer *fb, const struct drm_mode_rect *rect);
+void fb_color_convert(struct framebuffer *dst, struct framebuffer *src);
+
+#define MAX_DRAW_THREADS 64
+
+/*
+ * Number of threads used by the functions above. Defaults to
+ * $DRM_DRAW_THREADS or the number of online cpus.
+ */
+void drm_draw_set_num_threads(int num_threads);
+int drm_draw_get_num_threads(void);
+
+/*
+ * drm_draw_test_pattern() renders each (width, height, format, pattern)
+ * once and copies it to later buffers. The cache holds up to 64 MB of
+ * patterns, $DRM_PATTERN_CACHE sets the size in MB and 0 disables it. With
+ * a directory set ($DRM_PATTERN_CACHE_DIR) the rendered patterns are kept
+ * there as files for later runs.
+ */
+void drm_pattern_cache_enable(bool enable);
+void drm_pattern_cache_set_dir(const char *dir);
+void drm_pattern_cache_flush(void);
+
+#define DAMAGE_HISTORY_FRAMES 32
+#define DAMAGE_MAX_RECTS 4
+
+/* per-frame damage, for redrawing only what changed since a buffer's frame */
+struct damage_history {
+	uint64_t frame;		/* current frame, 0 before the first one */
+	int num_rects[DAMAGE_HISTORY_FRAMES];	/* -1 = full frame */
+	struct drm_mode_rect rects[DAMAGE_HISTORY_FRAMES][DAMAGE_MAX_RECTS];
+};
+
+/*
+ * Add r to a set of rects, merging it with rects it lines up with. The
+ * new number of rects, or -1 if more than max_rects would be needed.
+ */
+int damage_add_rect(struct drm_mode_rect *rects, int num_rects, int max_rects,
+	struct drm_mode_rect r);
+
+/* start a new frame which changed 'rects', returns the frame number */
+uint64_t damage_history_add(struct damage_history *hist, const struct drm_mode_rect *rects,
+	int num_rects);
+/*
+ * Damage since a buffer held 'frame', the number of rects stored in
+ * 'rects' or -1 if the whole buffer has to be redrawn.
+ */
+int damage_history_get(const struct damage_history *hist, uint64_t frame,
+	struct drm_mode_rect *rects, int max_rects);
 
 #endif
@@ -1,3 +1,7 @@
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/dma-buf.h>
+
 #include "common-drm.h"
 #include "common.h"
 
@@ -13,6 +17,14 @@ int drm_open_dev_dumb(const char *node)
 	return fd;
 }
 
+void drm_close_dev(int fd)
+{
+	/* a later open may get the same fd number */
+	drm_invalidate_props(fd);
+
+	close(fd);
+}
+
 void drm_destroy_dumb(int fd, uint32_t handle)
 {
 	struct drm_mode_destroy_dumb dreq = {
@@ -64,23 +76,52 @@ static const struct format_info *find_format(uint32_t format)
 	return NULL;
 }
 
-void drm_create_dumb_fb2(int fd, uint32_t width, uint32_t height, uint32_t format,
-	struct framebuffer *buf)
+uint32_t drm_find_format(const char *fourcc)
 {
-	int r;
+	for (int i = 0; i < ARRAY_SIZE(format_info_array); ++i) {
+		if (strcmp(fourcc, format_info_array[i].fourcc) == 0)
+			return format_info_array[i].format;
+	}
 
-	memset(buf, 0, sizeof(*buf));
+	return 0;
+}
 
-	buf->fd = fd;
-	buf->width = width;
-	buf->height = height;
-	buf->format = format;
+uint32_t drm_format_black(uint32_t format, int plane)
+{
+	/* Y 16, U and V 128 */
+	switch (format) {
+		case DRM_FORMAT_YUYV:
+			return 0x80108010;
+		case DRM_FORMAT_UYVY:
+			return 0x10801080;
+		case DRM_FORMAT_NV12:
+		case DRM_FORMAT_NV21:
+			return plane == 0 ? 0x10101010 : 0x80808080;
+		default:
+			return 0;
+	}
+}
 
-	const struct format_info *format_info = find_format(format);
+static void map_dumb(int fd, uint32_t handle, uint32_t size, uint8_t **map)
+{
+	int r;
 
-	ASSERT(format_info);
+	/* prepare buffer for memory mapping */
+	struct drm_mode_map_dumb mreq = {
+		.handle = handle,
+	};
+	r = drmIoctl(fd, DRM_IOCTL_MODE_MAP_DUMB, &mreq);
+	ASSERT(r == 0);
 
-	buf->num_planes = format_info->num_planes;
+	/* perform actual memory mapping */
+	*map = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, mreq.offset);
+	ASSERT(*map != MAP_FAILED);
+}
+
+/* one dumb buffer per plane */
+static void create_plane_bos(const struct format_info *format_info, struct framebuffer *buf)
+{
+	int r;
 
 	for (int i = 0; i < format_info->num_planes; ++i) {
 		const struct format_plane_info *pi = &format_info->planes[i];
@@ -92,7 +133,7 @@ void drm_create_dumb_fb2(int fd, uint32_t width, uint32_t height, uint32_t forma
 			.height = buf->height / pi->ysub,
 			.bpp = pi->bitspp,
 		};
-		r = drmIoctl(fd, DRM_IOCTL_MODE_CREATE_DUMB, &creq);
+		r = drmIoctl(buf->fd, DRM_IOCTL_MODE_CREATE_DUMB, &creq);
 		ASSERT(r == 0);
 
 		plane->handle = creq.handle;
@@ -104,72 +145,631 @@ void drm_create_dumb_fb2(int fd, uint32_t width, uint32_t height, uint32_t forma
 			i, creq.width, creq.height, pi->bitspp, plane->stride, plane->size);
 		*/
 
-		/* prepare buffer for memory mapping */
-		struct drm_mode_map_dumb mreq = {
-			.handle = plane->handle,
-		};
-		r = drmIoctl(fd, DRM_IOCTL_MODE_MAP_DUMB, &mreq);
+	}
+}
+
+/*
+ * All planes in one dumb buffer, one after the other. The buffer is
+ * allocated as 8 bpp lines as wide as the first plane's lines, and the
+ * other planes' strides scale from the pitch the driver gives for it.
+ */
+static void create_single_bo(const struct format_info *format_info, struct framebuffer *buf)
+{
+	uint32_t line_bytes[4];
+	uint32_t num_lines = 0;
+	uint32_t offset = 0;
+	int r;
+
+	for (int i = 0; i < format_info->num_planes; ++i) {
+		const struct format_plane_info *pi = &format_info->planes[i];
+
+		line_bytes[i] = buf->width / pi->xsub * pi->bitspp / 8;
+		num_lines += (buf->height / pi->ysub * line_bytes[i] + line_bytes[0] - 1) /
+			line_bytes[0];
+	}
+
+	struct drm_mode_create_dumb creq = {
+		.width = line_bytes[0],
+		.height = num_lines,
+		.bpp = 8,
+	};
+	r = drmIoctl(buf->fd, DRM_IOCTL_MODE_CREATE_DUMB, &creq);
+	ASSERT(r == 0);
+
+	for (int i = 0; i < format_info->num_planes; ++i) {
+		const struct format_plane_info *pi = &format_info->planes[i];
+		struct framebuffer_plane *plane = &buf->planes[i];
+
+		ASSERT((uint64_t)creq.pitch * line_bytes[i] % line_bytes[0] == 0);
+
+		plane->handle = creq.handle;
+		plane->offset = offset;
+		plane->stride = (uint64_t)creq.pitch * line_bytes[i] / line_bytes[0];
+		plane->size = buf->height / pi->ysub * plane->stride;
+
+		offset += plane->size;
+	}
+
+	ASSERT(offset <= creq.height * creq.pitch);
+}
+
+/* the buffer object of the plane as a dma-buf, exported on first use */
+static int plane_dmabuf_fd(struct framebuffer *buf, int plane_idx)
+{
+	struct framebuffer_plane *plane = &buf->planes[plane_idx];
+
+	if (plane->dmabuf_fd < 0) {
+		int r = drmPrimeHandleToFD(buf->fd, plane->handle, DRM_CLOEXEC | DRM_RDWR,
+			&plane->dmabuf_fd);
 		ASSERT(r == 0);
+	}
 
-		/* perform actual memory mapping */
-		buf->planes[i].map = mmap(0, plane->size, PROT_READ | PROT_WRITE, MAP_SHARED,
-			        fd, mreq.offset);
+	return plane->dmabuf_fd;
+}
+
+static void map_plane_bo(struct framebuffer *buf, int plane_idx, uint32_t size)
+{
+	struct framebuffer_plane *plane = &buf->planes[plane_idx];
+
+	if (buf->flags & DRM_FB_DMABUF_MAP) {
+		plane->map = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			plane_dmabuf_fd(buf, plane_idx), 0);
 		ASSERT(plane->map != MAP_FAILED);
+	} else {
+		map_dumb(buf->fd, plane->handle, size, &plane->map);
+	}
+}
+
+void drm_fb_map(struct framebuffer *buf)
+{
+	if (buf->planes[0].map)
+		return;
+
+	if (buf->flags & DRM_FB_SINGLE_BO) {
+		struct framebuffer_plane *last = &buf->planes[buf->num_planes - 1];
+
+		map_plane_bo(buf, 0, last->offset + last->size);
+
+		for (int i = 1; i < buf->num_planes; ++i)
+			buf->planes[i].map = buf->planes[0].map + buf->planes[i].offset;
+	} else {
+		for (int i = 0; i < buf->num_planes; ++i)
+			map_plane_bo(buf, i, buf->planes[i].size);
+	}
 
-		/* clear the framebuffer to 0 */
-		memset(plane->map, 0, plane->size);
+	/* dumb maps are write-combined, dma-buf maps often cached */
+	if (!(buf->flags & DRM_FB_DMABUF_MAP))
+		buf->flags |= DRM_FB_STREAM;
+
+	if (!(buf->flags & DRM_FB_NO_CLEAR)) {
+		/* clear the framebuffer to black, zero is green for YUV */
+		for (int i = 0; i < buf->num_planes; ++i) {
+			uint32_t black = drm_format_black(buf->format, i);
+			uint32_t *p = (uint32_t *)buf->planes[i].map;
+
+			if (black == 0) {
+				memset(p, 0, buf->planes[i].size);
+				continue;
+			}
+
+			for (size_t j = 0; j < buf->planes[i].size / 4; ++j)
+				p[j] = black;
+
+			memcpy(&p[buf->planes[i].size / 4], &black, buf->planes[i].size % 4);
+		}
+
+		/* only once, the contents are ours from now on */
+		buf->flags |= DRM_FB_NO_CLEAR;
+	}
+}
+
+void drm_fb_unmap(struct framebuffer *buf)
+{
+	if (!buf->planes[0].map)
+		return;
+
+	if (buf->flags & DRM_FB_SINGLE_BO) {
+		struct framebuffer_plane *last = &buf->planes[buf->num_planes - 1];
+
+		munmap(buf->planes[0].map, last->offset + last->size);
+	} else {
+		for (int i = 0; i < buf->num_planes; ++i)
+			munmap(buf->planes[i].map, buf->planes[i].size);
 	}
 
+	for (int i = 0; i < buf->num_planes; ++i)
+		buf->planes[i].map = NULL;
+}
+
+void drm_create_dumb_fb2(int fd, uint32_t width, uint32_t height, uint32_t format,
+	struct framebuffer *buf)
+{
+	drm_create_dumb_fb3(fd, width, height, format, 0, buf);
+}
+
+void drm_create_dumb_fb3(int fd, uint32_t width, uint32_t height, uint32_t format,
+	uint32_t flags, struct framebuffer *buf)
+{
+	int r;
+
+	memset(buf, 0, sizeof(*buf));
+
+	buf->fd = fd;
+	buf->width = width;
+	buf->height = height;
+	buf->format = format;
+	buf->flags = flags;
+
+	for (unsigned i = 0; i < ARRAY_SIZE(buf->planes); ++i)
+		buf->planes[i].dmabuf_fd = -1;
+
+	const struct format_info *format_info = find_format(format);
+
+	ASSERT(format_info);
+
+	buf->num_planes = format_info->num_planes;
+
+	if (flags & DRM_FB_SINGLE_BO)
+		create_single_bo(format_info, buf);
+	else
+		create_plane_bos(format_info, buf);
+
+	if (!(flags & DRM_FB_LAZY_MAP))
+		drm_fb_map(buf);
+
 	/* create framebuffer object for the dumb-buffer */
-	uint32_t bo_handles[4] = { buf->planes[0].handle, buf->planes[1].handle };
-	uint32_t pitches[4] = { buf->planes[0].stride, buf->planes[1].stride };
+	uint32_t bo_handles[4] = { 0 };
+	uint32_t pitches[4] = { 0 };
 	uint32_t offsets[4] = { 0 };
+
+	for (int i = 0; i < buf->num_planes; ++i) {
+		bo_handles[i] = buf->planes[i].handle;
+		pitches[i] = buf->planes[i].stride;
+		offsets[i] = buf->planes[i].offset;
+	}
+
 	r = drmModeAddFB2(fd, buf->width, buf->height, format,
 		bo_handles, pitches, offsets, &buf->fb_id, 0);
 	ASSERT(r == 0);
 }
 
+static void dmabuf_sync(struct framebuffer *buf, unsigned access, uint64_t flags)
+{
+	/* not a gem buffer, nothing to sync */
+	if (!buf->planes[0].handle)
+		return;
+
+	if (access & DRM_FB_ACCESS_READ)
+		flags |= DMA_BUF_SYNC_READ;
+	if (access & DRM_FB_ACCESS_WRITE)
+		flags |= DMA_BUF_SYNC_WRITE;
+
+	int num_bos = buf->flags & DRM_FB_SINGLE_BO ? 1 : buf->num_planes;
+
+	for (int i = 0; i < num_bos; ++i) {
+		struct dma_buf_sync sync = {
+			.flags = flags,
+		};
+		int fd = plane_dmabuf_fd(buf, i);
+		int r;
+
+		do {
+			r = ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
+		} while (r < 0 && (errno == EINTR || errno == EAGAIN));
+
+		ASSERT(r == 0);
+	}
+}
+
+void drm_fb_begin_cpu_access(struct framebuffer *buf, unsigned access)
+{
+	dmabuf_sync(buf, access, DMA_BUF_SYNC_START);
+}
+
+void drm_fb_end_cpu_access(struct framebuffer *buf, unsigned access)
+{
+	dmabuf_sync(buf, access, DMA_BUF_SYNC_END);
+}
+
+void drm_fb_close_dmabufs(struct framebuffer *buf)
+{
+	for (int i = 0; i < buf->num_planes; ++i) {
+		if (buf->planes[i].dmabuf_fd >= 0)
+			close(buf->planes[i].dmabuf_fd);
+
+		buf->planes[i].dmabuf_fd = -1;
+	}
+}
+
 void drm_destroy_dumb_fb(struct framebuffer *buf)
 {
 	/* delete framebuffer */
 	drmModeRmFB(buf->fd, buf->fb_id);
 
-	for (int i = 0; i < buf->num_planes; ++i) {
-		struct framebuffer_plane *plane = &buf->planes[i];
-
-		/* unmap buffer */
-		munmap(plane->map, plane->size);
+	drm_fb_unmap(buf);
+	drm_fb_close_dmabufs(buf);
 
-		/* delete dumb buffer */
-		drm_destroy_dumb(buf->fd, plane->handle);
+	/* delete dumb buffers */
+	if (buf->flags & DRM_FB_SINGLE_BO) {
+		drm_destroy_dumb(buf->fd, buf->planes[0].handle);
+	} else {
+		for (int i = 0; i < buf->num_planes; ++i)
+			drm_destroy_dumb(buf->fd, buf->planes[i].handle);
 	}
 
 	memset(buf, 0, sizeof(*buf));
 }
 
-void drm_set_dpms(int fd, uint32_t conn_id, int dpms)
+/*
+ * Framebuffer pool. Released buffers stay created, mapped and registered
+ * on an idle list, and acquiring one with the same size and format takes
+ * it from there. Idle buffers over the pool's byte limit are destroyed,
+ * least recently used first.
+ */
+
+struct pool_buf {
+	struct framebuffer fb;		/* first, see drm_fb_pool_release() */
+	struct pool_buf *next;
+	size_t size;
+};
+
+struct drm_fb_pool {
+	int fd;
+	pthread_mutex_t lock;
+
+	struct pool_buf *idle;		/* most recently released first */
+	size_t max_idle_bytes;
+
+	struct drm_fb_pool_stats stats;
+};
+
+static size_t fb_size(const struct framebuffer *fb)
 {
-	uint32_t prop = 0;
-	drmModeObjectProperties *props;
-	drmModePropertyRes *propRes;
-	int j;
-	int r;
+	size_t size = 0;
 
-	printf("set dpms %u: %d\n", conn_id, dpms);
+	for (int i = 0; i < fb->num_planes; ++i)
+		size += fb->planes[i].size;
+
+	return size;
+}
+
+struct drm_fb_pool *drm_fb_pool_create(int fd, size_t max_idle_bytes)
+{
+	struct drm_fb_pool *pool = calloc(1, sizeof(*pool));
+	ASSERT(pool);
+
+	pool->fd = fd;
+	pool->max_idle_bytes = max_idle_bytes;
+	pthread_mutex_init(&pool->lock, NULL);
+
+	return pool;
+}
+
+void drm_fb_pool_destroy(struct drm_fb_pool *pool)
+{
+	drm_fb_pool_trim(pool, 0);
+
+	/* all buffers have to be released first */
+	ASSERT(pool->stats.num_busy == 0);
+
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
 
-	props = drmModeObjectGetProperties(fd, conn_id, DRM_MODE_OBJECT_CONNECTOR);
-	for (j = 0; j < props->count_props; j++) {
-		propRes = drmModeGetProperty(fd, props->props[j]);
+struct framebuffer *drm_fb_pool_acquire(struct drm_fb_pool *pool, uint32_t width,
+	uint32_t height, uint32_t format)
+{
+	struct pool_buf **pp, *buf = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+
+	for (pp = &pool->idle; *pp; pp = &(*pp)->next) {
+		struct framebuffer *fb = &(*pp)->fb;
+
+		if (fb->width == width && fb->height == height && fb->format == format) {
+			buf = *pp;
+			*pp = buf->next;
+			break;
+		}
+	}
+
+	if (buf) {
+		pool->stats.hits++;
+		pool->stats.num_idle--;
+		pool->stats.idle_bytes -= buf->size;
+	} else {
+		pool->stats.misses++;
+	}
+
+	pool->stats.num_busy++;
+
+	pthread_mutex_unlock(&pool->lock);
+
+	if (!buf) {
+		buf = calloc(1, sizeof(*buf));
+		ASSERT(buf);
+
+		drm_create_dumb_fb3(pool->fd, width, height, format, DRM_FB_SINGLE_BO,
+			&buf->fb);
+		buf->size = fb_size(&buf->fb);
+	}
+
+	buf->next = NULL;
+
+	return &buf->fb;
+}
+
+/* called with the lock held, returns the buffers to destroy */
+static struct pool_buf *pool_trim_locked(struct drm_fb_pool *pool, size_t max_idle_bytes)
+{
+	struct pool_buf *freed = NULL;
+
+	while (pool->stats.idle_bytes > max_idle_bytes) {
+		struct pool_buf **pp = &pool->idle;
+
+		/* the least recently used is at the end */
+		while ((*pp)->next)
+			pp = &(*pp)->next;
+
+		struct pool_buf *buf = *pp;
+		*pp = NULL;
+
+		pool->stats.num_idle--;
+		pool->stats.idle_bytes -= buf->size;
+		pool->stats.trimmed++;
+
+		buf->next = freed;
+		freed = buf;
+	}
+
+	return freed;
+}
+
+static void pool_free_bufs(struct pool_buf *buf)
+{
+	while (buf) {
+		struct pool_buf *next = buf->next;
 
-		if (propRes == NULL)
+		drm_destroy_dumb_fb(&buf->fb);
+		free(buf);
+
+		buf = next;
+	}
+}
+
+void drm_fb_pool_release(struct drm_fb_pool *pool, struct framebuffer *fb)
+{
+	struct pool_buf *buf = (struct pool_buf *)fb;
+	struct pool_buf *freed;
+
+	pthread_mutex_lock(&pool->lock);
+
+	buf->next = pool->idle;
+	pool->idle = buf;
+
+	pool->stats.num_busy--;
+	pool->stats.num_idle++;
+	pool->stats.idle_bytes += buf->size;
+
+	freed = pool_trim_locked(pool, pool->max_idle_bytes);
+
+	pthread_mutex_unlock(&pool->lock);
+
+	pool_free_bufs(freed);
+}
+
+void drm_fb_pool_trim(struct drm_fb_pool *pool, size_t max_idle_bytes)
+{
+	struct pool_buf *freed;
+
+	pthread_mutex_lock(&pool->lock);
+	freed = pool_trim_locked(pool, max_idle_bytes);
+	pthread_mutex_unlock(&pool->lock);
+
+	pool_free_bufs(freed);
+}
+
+void drm_fb_pool_get_stats(struct drm_fb_pool *pool, struct drm_fb_pool_stats *stats)
+{
+	pthread_mutex_lock(&pool->lock);
+	*stats = pool->stats;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Property cache. The properties of a KMS object are read once, on the
+ * first lookup, and kept until drm_invalidate_props(). Recently used
+ * objects are kept at the front of the list.
+ */
+
+struct prop_entry {
+	struct drm_prop prop;
+	char name[DRM_PROP_NAME_LEN];
+
+	int num_enums;
+	struct drm_mode_property_enum *enums;
+};
+
+struct prop_object {
+	int fd;
+	uint32_t obj_id;
+	uint32_t obj_type;
+
+	int num_props;
+	struct prop_entry *props;
+
+	struct prop_object *next;
+};
+
+static struct prop_object *prop_objects;
+static pthread_mutex_t prop_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct prop_object *read_prop_object(int fd, uint32_t obj_id, uint32_t obj_type)
+{
+	struct prop_object *obj = calloc(1, sizeof(*obj));
+	ASSERT(obj);
+
+	obj->fd = fd;
+	obj->obj_id = obj_id;
+	obj->obj_type = obj_type;
+
+	drmModeObjectProperties *props = drmModeObjectGetProperties(fd, obj_id, obj_type);
+
+	if (!props)
+		return obj;
+
+	obj->props = calloc(props->count_props, sizeof(*obj->props));
+	ASSERT(obj->props || props->count_props == 0);
+
+	for (uint32_t i = 0; i < props->count_props; ++i) {
+		drmModePropertyRes *res = drmModeGetProperty(fd, props->props[i]);
+
+		if (!res)
 			continue;
 
-		if (strcmp(propRes->name, "DPMS") == 0) {
-			prop = props->props[j];
+		struct prop_entry *prop = &obj->props[obj->num_props++];
+
+		prop->prop.id = res->prop_id;
+		prop->prop.flags = res->flags;
+		/* a mutable value would be stale by the time it's used */
+		if (res->flags & DRM_MODE_PROP_IMMUTABLE)
+			prop->prop.value = props->prop_values[i];
+		memcpy(prop->name, res->name, sizeof(prop->name));
+		prop->name[sizeof(prop->name) - 1] = 0;
+
+		if (res->count_enums) {
+			prop->enums = malloc(res->count_enums * sizeof(*prop->enums));
+			ASSERT(prop->enums);
+			memcpy(prop->enums, res->enums, res->count_enums * sizeof(*prop->enums));
+			prop->num_enums = res->count_enums;
+		}
+
+		drmModeFreeProperty(res);
+	}
+
+	drmModeFreeObjectProperties(props);
+
+	return obj;
+}
+
+static void free_prop_object(struct prop_object *obj)
+{
+	for (int i = 0; i < obj->num_props; ++i)
+		free(obj->props[i].enums);
+
+	free(obj->props);
+	free(obj);
+}
+
+/* called with prop_lock held, the entry is only valid until it's dropped */
+static const struct prop_entry *find_prop_entry(int fd, uint32_t obj_id, uint32_t obj_type,
+	const char *name)
+{
+	struct prop_object **pp, *obj;
+
+	for (pp = &prop_objects; *pp; pp = &(*pp)->next) {
+		if ((*pp)->fd == fd && (*pp)->obj_id == obj_id && (*pp)->obj_type == obj_type)
+			break;
+	}
+
+	if (*pp) {
+		obj = *pp;
+		*pp = obj->next;
+	} else {
+		obj = read_prop_object(fd, obj_id, obj_type);
+	}
+
+	obj->next = prop_objects;
+	prop_objects = obj;
+
+	for (int i = 0; i < obj->num_props; ++i) {
+		if (strcmp(obj->props[i].name, name) == 0)
+			return &obj->props[i];
+	}
+
+	return NULL;
+}
+
+bool drm_find_prop(int fd, uint32_t obj_id, uint32_t obj_type, const char *name,
+	struct drm_prop *prop)
+{
+	const struct prop_entry *e;
+
+	pthread_mutex_lock(&prop_lock);
+
+	e = find_prop_entry(fd, obj_id, obj_type, name);
+	if (e)
+		*prop = e->prop;
+
+	pthread_mutex_unlock(&prop_lock);
+
+	return e != NULL;
+}
+
+uint32_t drm_find_prop_id(int fd, uint32_t obj_id, uint32_t obj_type, const char *name)
+{
+	struct drm_prop prop;
+
+	return drm_find_prop(fd, obj_id, obj_type, name, &prop) ? prop.id : 0;
+}
+
+bool drm_prop_enum_value(int fd, uint32_t obj_id, uint32_t obj_type, const char *name,
+	const char *enum_name, uint64_t *value)
+{
+	const struct prop_entry *e;
+	bool found = false;
+
+	pthread_mutex_lock(&prop_lock);
+
+	e = find_prop_entry(fd, obj_id, obj_type, name);
+
+	for (int i = 0; e && i < e->num_enums; ++i) {
+		if (strcmp(e->enums[i].name, enum_name) == 0) {
+			*value = e->enums[i].value;
+			found = true;
 			break;
 		}
 	}
 
+	pthread_mutex_unlock(&prop_lock);
+
+	return found;
+}
+
+static void drop_plane_set(int fd);
+
+void drm_invalidate_props(int fd)
+{
+	struct prop_object **pp = &prop_objects;
+
+	pthread_mutex_lock(&prop_lock);
+
+	while (*pp) {
+		struct prop_object *obj = *pp;
+
+		if (obj->fd != fd) {
+			pp = &obj->next;
+			continue;
+		}
+
+		*pp = obj->next;
+		free_prop_object(obj);
+	}
+
+	pthread_mutex_unlock(&prop_lock);
+
+	/* the plane snapshot was read through the same cache */
+	drop_plane_set(fd);
+}
+
+void drm_set_dpms(int fd, uint32_t conn_id, int dpms)
+{
+	uint32_t prop;
+	int r;
+
+	printf("set dpms %u: %d\n", conn_id, dpms);
+
+	prop = drm_find_prop_id(fd, conn_id, DRM_MODE_OBJECT_CONNECTOR, "DPMS");
 	ASSERT(prop);
 
 	r = drmModeObjectSetProperty(fd, conn_id,
@@ -177,58 +777,293 @@ void drm_set_dpms(int fd, uint32_t conn_id, int dpms)
 	ASSERT(r == 0);
 }
 
-static uint32_t reserved_plane_ids[8];
+/*
+ * Plane manager. The planes of a device are read once, on the first
+ * reservation, with their type, possible CRTCs and the formats and
+ * modifiers they can scan out. Reservations are then matched against
+ * the snapshot under a lock.
+ */
+
+struct plane_format {
+	uint32_t format;
+	uint64_t modifier;
+};
+
+struct plane_info {
+	uint32_t id;
+	uint32_t possible_crtcs;	/* mask of crtc indices */
+	uint64_t type;
+	bool reserved;
+
+	int num_formats;
+	struct plane_format *formats;
+};
+
+struct plane_set {
+	int fd;
 
-static int find_reserved_plane(uint32_t plane_id)
+	int num_crtcs;
+	uint32_t *crtc_ids;
+
+	int num_planes;
+	struct plane_info *planes;
+
+	struct plane_set *next;
+};
+
+static struct plane_set *plane_sets;
+static pthread_mutex_t plane_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* called with plane_lock held */
+static struct plane_set *find_plane_set(int fd)
 {
-	for (int i = 0; i < ARRAY_SIZE(reserved_plane_ids); ++i) {
-		if (reserved_plane_ids[i] == plane_id)
-			return i;
+	for (struct plane_set *set = plane_sets; set; set = set->next) {
+		if (set->fd == fd)
+			return set;
 	}
 
-	return -1;
+	return NULL;
 }
 
-uint32_t drm_reserve_plane(int fd)
+/* forget the planes of fd, and their reservations */
+static void drop_plane_set(int fd)
+{
+	struct plane_set **pp = &plane_sets;
+
+	pthread_mutex_lock(&plane_lock);
+
+	while (*pp) {
+		struct plane_set *set = *pp;
+
+		if (set->fd != fd) {
+			pp = &set->next;
+			continue;
+		}
+
+		*pp = set->next;
+
+		for (int i = 0; i < set->num_planes; ++i)
+			free(set->planes[i].formats);
+
+		free(set->planes);
+		free(set->crtc_ids);
+		free(set);
+	}
+
+	pthread_mutex_unlock(&plane_lock);
+}
+
+/* format/modifier pairs from an IN_FORMATS blob */
+static void read_in_formats(int fd, uint32_t blob_id, struct plane_info *info)
+{
+	drmModePropertyBlobRes *blob = drmModeGetPropertyBlob(fd, blob_id);
+	ASSERT(blob);
+
+	const struct drm_format_modifier_blob *hdr = blob->data;
+	const uint32_t *formats = (const uint32_t *)((const uint8_t *)hdr + hdr->formats_offset);
+	const struct drm_format_modifier *mods =
+		(const struct drm_format_modifier *)((const uint8_t *)hdr + hdr->modifiers_offset);
+
+	int num = 0;
+
+	for (uint32_t i = 0; i < hdr->count_modifiers; ++i)
+		num += __builtin_popcountll(mods[i].formats);
+
+	info->formats = malloc(num * sizeof(*info->formats));
+	ASSERT(info->formats || num == 0);
+
+	for (uint32_t i = 0; i < hdr->count_modifiers; ++i) {
+		for (int j = 0; j < 64; ++j) {
+			if (!(mods[i].formats & (1ull << j)))
+				continue;
+
+			info->formats[info->num_formats++] = (struct plane_format) {
+				.format = formats[mods[i].offset + j],
+				.modifier = mods[i].modifier,
+			};
+		}
+	}
+
+	drmModeFreePropertyBlob(blob);
+}
+
+static void read_plane(int fd, uint32_t plane_id, struct plane_info *info)
 {
-	drmModePlaneRes *res = drmModeGetPlaneResources(fd);
+	drmModePlane *plane = drmModeGetPlane(fd, plane_id);
+	ASSERT(plane);
+
+	info->id = plane_id;
+	info->possible_crtcs = plane->possible_crtcs;
+	/* without universal planes only overlays are listed */
+	info->type = DRM_PLANE_TYPE_OVERLAY;
+
+	struct drm_prop type, in_formats;
+
+	/* both are immutable, so the cached values are current */
+	if (drm_find_prop(fd, plane_id, DRM_MODE_OBJECT_PLANE, "type", &type))
+		info->type = type.value;
+
+	if (drm_find_prop(fd, plane_id, DRM_MODE_OBJECT_PLANE, "IN_FORMATS", &in_formats) &&
+		in_formats.value) {
+		read_in_formats(fd, in_formats.value, info);
+	} else {
+		/* no modifier support, linear only */
+		info->formats = malloc(plane->count_formats * sizeof(*info->formats));
+		ASSERT(info->formats || plane->count_formats == 0);
+
+		for (uint32_t i = 0; i < plane->count_formats; ++i) {
+			info->formats[i] = (struct plane_format) {
+				.format = plane->formats[i],
+				.modifier = DRM_FORMAT_MOD_LINEAR,
+			};
+		}
+
+		info->num_formats = plane->count_formats;
+	}
+
+	drmModeFreePlane(plane);
+}
+
+/* called with plane_lock held */
+static struct plane_set *get_plane_set(int fd)
+{
+	struct plane_set *set = find_plane_set(fd);
+
+	if (set)
+		return set;
+
+	set = calloc(1, sizeof(*set));
+	ASSERT(set);
+
+	set->fd = fd;
+
+	drmModeRes *res = drmModeGetResources(fd);
 	ASSERT(res);
 
-	for (int i = 0; i < res->count_planes; i++) {
-		uint32_t plane_id = res->planes[i];
+	set->num_crtcs = res->count_crtcs;
+	set->crtc_ids = malloc(res->count_crtcs * sizeof(uint32_t));
+	ASSERT(set->crtc_ids || res->count_crtcs == 0);
+	memcpy(set->crtc_ids, res->crtcs, res->count_crtcs * sizeof(uint32_t));
+
+	drmModeFreeResources(res);
+
+	drmModePlaneRes *plane_res = drmModeGetPlaneResources(fd);
+	ASSERT(plane_res);
+
+	set->num_planes = plane_res->count_planes;
+	set->planes = calloc(plane_res->count_planes, sizeof(*set->planes));
+	ASSERT(set->planes || plane_res->count_planes == 0);
+
+	for (uint32_t i = 0; i < plane_res->count_planes; ++i)
+		read_plane(fd, plane_res->planes[i], &set->planes[i]);
+
+	drmModeFreePlaneResources(plane_res);
+
+	set->next = plane_sets;
+	plane_sets = set;
+
+	return set;
+}
+
+static bool plane_matches(const struct plane_set *set, const struct plane_info *info,
+	const struct drm_plane_req *req)
+{
+	if (info->type == DRM_PLANE_TYPE_CURSOR)
+		return false;
+
+	/* primary planes go to whoever drives the crtc, on request only */
+	if (req->primary != (info->type == DRM_PLANE_TYPE_PRIMARY))
+		return false;
+
+	/*
+	 * KMS doesn't tell which planes can scale. Primary planes often
+	 * can't, so scaling is only expected from overlays.
+	 */
+	if (req->scaling && info->type != DRM_PLANE_TYPE_OVERLAY)
+		return false;
 
+	if (req->crtc_id) {
 		int idx;
 
-		idx = find_reserved_plane(plane_id);
+		for (idx = 0; idx < set->num_crtcs; ++idx) {
+			if (set->crtc_ids[idx] == req->crtc_id)
+				break;
+		}
+
+		if (idx == set->num_crtcs || !(info->possible_crtcs & (1u << idx)))
+			return false;
+	}
 
-		if (idx >= 0)
+	if (!req->format)
+		return true;
+
+	for (int i = 0; i < info->num_formats; ++i) {
+		if (info->formats[i].format != req->format)
 			continue;
 
-		drmModePlane *plane = drmModeGetPlane(fd, plane_id);
-		ASSERT(plane);
+		if (req->modifier == DRM_FORMAT_MOD_INVALID ||
+			info->formats[i].modifier == req->modifier)
+			return true;
+	}
+
+	return false;
+}
 
-		// TODO: check for required plane attributes
+uint32_t drm_reserve_plane2(int fd, const struct drm_plane_req *req)
+{
+	uint32_t plane_id = 0;
 
-		drmModeFreePlane(plane);
+	pthread_mutex_lock(&plane_lock);
 
-		idx = find_reserved_plane(0);
-		ASSERT(idx >= 0);
+	struct plane_set *set = get_plane_set(fd);
 
-		reserved_plane_ids[idx] = plane_id;
+	for (int i = 0; i < set->num_planes; ++i) {
+		struct plane_info *info = &set->planes[i];
 
-		drmModeFreePlaneResources(res);
+		if (info->reserved || !plane_matches(set, info, req))
+			continue;
 
-		return plane_id;
+		info->reserved = true;
+		plane_id = info->id;
+		break;
 	}
 
-	ASSERT(false);
+	pthread_mutex_unlock(&plane_lock);
+
+	return plane_id;
 }
 
-void drm_release_plane(uint32_t plane_id)
+uint32_t drm_reserve_plane(int fd)
 {
-	int idx = find_reserved_plane(plane_id);
+	const struct drm_plane_req req = {
+		.modifier = DRM_FORMAT_MOD_INVALID,
+	};
+
+	return drm_reserve_plane2(fd, &req);
+}
+
+void drm_release_plane(int fd, uint32_t plane_id)
+{
+	struct plane_info *info = NULL;
+
+	pthread_mutex_lock(&plane_lock);
+
+	struct plane_set *set = find_plane_set(fd);
+
+	/* dropped with the props of the device, along with the reservation */
+	if (!set) {
+		pthread_mutex_unlock(&plane_lock);
+		return;
+	}
+
+	for (int i = 0; i < set->num_planes; ++i) {
+		if (set->planes[i].id == plane_id)
+			info = &set->planes[i];
+	}
+
+	ASSERT(info && info->reserved);
 
-	ASSERT(idx >= 0);
+	info->reserved = false;
 
-	reserved_plane_ids[idx] = 0;
+	pthread_mutex_unlock(&plane_lock);
 }
@@ -18,10 +18,12 @@ struct omap_bo;
 
 struct framebuffer_plane {
 	uint32_t handle;
+	uint32_t offset;	/* of the plane in the buffer object */
 	uint32_t size;
 	uint32_t stride;
 	uint8_t *map;
 	struct omap_bo *omap_bo;
+	int dmabuf_fd;		/* -1 until exported for cpu access syncing */
 };
 
 struct framebuffer {
@@ -35,19 +37,121 @@ struct framebuffer {
 	struct framebuffer_plane planes[4];
 
 	uint32_t fb_id;
+
+	uint32_t flags;
 };
 
+/* allocation flags for drm_create_dumb_fb3() */
+#define DRM_FB_SINGLE_BO	(1 << 0)	/* all planes in one buffer object */
+#define DRM_FB_NO_CLEAR		(1 << 1)	/* leave the contents undefined */
+#define DRM_FB_LAZY_MAP		(1 << 2)	/* map on first drm_fb_map() */
+/* map through the exported dma-buf, often cached, needs cpu access syncing */
+#define DRM_FB_DMABUF_MAP	(1 << 3)
+/* write with streaming stores, set by drm_fb_map() for write-combined maps */
+#define DRM_FB_STREAM		(1 << 4)
+
 int drm_open_dev_dumb(const char *node);
+/* close a device, dropping what is cached for its fd */
+void drm_close_dev(int fd);
 void drm_create_dumb_fb(int fd, uint32_t width, uint32_t height, struct framebuffer *buf);
 void drm_create_dumb_fb2(int fd, uint32_t width, uint32_t height, uint32_t format,
 	struct framebuffer *buf);
+void drm_create_dumb_fb3(int fd, uint32_t width, uint32_t height, uint32_t format,
+	uint32_t flags, struct framebuffer *buf);
+/*
+ * Map a DRM_FB_LAZY_MAP buffer for CPU access, and release the mapping
+ * when it's no longer needed. The drawing functions map on their own.
+ */
+void drm_fb_map(struct framebuffer *buf);
+void drm_fb_unmap(struct framebuffer *buf);
+
+/*
+ * Bracket cpu access to a buffer shared with devices. Issues
+ * DMA_BUF_IOCTL_SYNC on the buffer's dma-buf, exported on first use,
+ * and does nothing for buffers that aren't gem objects.
+ */
+#define DRM_FB_ACCESS_READ	(1 << 0)
+#define DRM_FB_ACCESS_WRITE	(1 << 1)
+
+void drm_fb_begin_cpu_access(struct framebuffer *buf, unsigned access);
+void drm_fb_end_cpu_access(struct framebuffer *buf, unsigned access);
+/* close the dma-bufs exported for syncing, for buffers freed by hand */
+void drm_fb_close_dmabufs(struct framebuffer *buf);
+
 void drm_destroy_dumb_fb(struct framebuffer *buf);
+
+/*
+ * Pool of dumb framebuffers keyed by size and format. Released buffers
+ * keep their contents, mapping and fb_id, and are handed out again by
+ * drm_fb_pool_acquire(). Up to max_idle_bytes of idle buffers are kept.
+ */
+struct drm_fb_pool;
+
+struct drm_fb_pool_stats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t trimmed;	/* idle buffers destroyed */
+	unsigned num_busy;
+	unsigned num_idle;
+	size_t idle_bytes;
+};
+
+struct drm_fb_pool *drm_fb_pool_create(int fd, size_t max_idle_bytes);
+void drm_fb_pool_destroy(struct drm_fb_pool *pool);
+struct framebuffer *drm_fb_pool_acquire(struct drm_fb_pool *pool, uint32_t width,
+	uint32_t height, uint32_t format);
+void drm_fb_pool_release(struct drm_fb_pool *pool, struct framebuffer *fb);
+/* destroy idle buffers until at most max_idle_bytes remain, e.g. on memory pressure */
+void drm_fb_pool_trim(struct drm_fb_pool *pool, size_t max_idle_bytes);
+void drm_fb_pool_get_stats(struct drm_fb_pool *pool, struct drm_fb_pool_stats *stats);
+
+/* format for a fourcc name like "XR24" or "NV12", 0 if not supported */
+uint32_t drm_find_format(const char *fourcc);
+/* black for a plane of format, as a 32-bit pattern in memory order */
+uint32_t drm_format_black(uint32_t format, int plane);
+
+/*
+ * Cached properties of KMS objects, read once per object. Lookups copy the
+ * property out, the cache of a device has to be invalidated when its
+ * objects change, e.g. on hotplug, which also drops the device's planes
+ * with their reservations.
+ */
+struct drm_prop {
+	uint32_t id;
+	uint32_t flags;
+	/* value when the object was read, only kept for immutable properties */
+	uint64_t value;
+};
+
+/* false if the object doesn't have the property */
+bool drm_find_prop(int fd, uint32_t obj_id, uint32_t obj_type, const char *name,
+	struct drm_prop *prop);
+uint32_t drm_find_prop_id(int fd, uint32_t obj_id, uint32_t obj_type, const char *name);
+/* value of the enum entry enum_name of an enum or bitmask property */
+bool drm_prop_enum_value(int fd, uint32_t obj_id, uint32_t obj_type, const char *name,
+	const char *enum_name, uint64_t *value);
+void drm_invalidate_props(int fd);
+
 void drm_set_dpms(int fd, uint32_t conn_id, int dpms);
 
 #define for_each_output(pos, head) \
 	for (struct modeset_out *(pos) = (head); (pos); (pos) = (pos)->next)
 
+/* what a plane is needed for, zeroed fields match any crtc/format */
+struct drm_plane_req {
+	uint32_t crtc_id;
+	uint32_t format;
+	/* with format; DRM_FORMAT_MOD_LINEAR (0) for dumb buffers, _INVALID for any */
+	uint64_t modifier;
+	bool scaling;
+	/* the crtc's primary plane, needs DRM_CLIENT_CAP_UNIVERSAL_PLANES */
+	bool primary;
+};
+
+/* a free plane matching req, 0 if there's none */
+uint32_t drm_reserve_plane2(int fd, const struct drm_plane_req *req);
+/* any free plane, 0 if there's none */
 uint32_t drm_reserve_plane(int fd);
-void drm_release_plane(uint32_t plane_id);
+void drm_release_plane(int fd, uint32_t plane_id);
 
 #endif
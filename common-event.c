@@ -0,0 +1,369 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+
+#include "common.h"
+#include "common-event.h"
+
+#define MAX_EVENTS 16
+
+enum source_type {
+	SOURCE_FD,
+	SOURCE_DRM,
+	SOURCE_TIMER,
+	SOURCE_SIGNAL,
+	SOURCE_INPUT,
+};
+
+struct event_source {
+	struct event_source *next;
+
+	int fd;
+	enum source_type type;
+	bool removed;
+
+	event_func func;
+	void *data;
+	drmEventContext *ev;
+
+	/* signal mask before the source's signals were blocked */
+	sigset_t old_mask;
+};
+
+struct event_loop {
+	int epfd;
+	bool quit;
+	/* removed sources are freed after the dispatch they're removed in */
+	bool dispatching;
+
+	struct event_source *sources;
+
+	bool (*idle)(void *data);
+	void *idle_data;
+};
+
+struct event_loop *event_loop_create(void)
+{
+	struct event_loop *loop = calloc(1, sizeof(*loop));
+	ASSERT(loop);
+
+	loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+	ASSERT(loop->epfd >= 0);
+
+	return loop;
+}
+
+static void free_source(struct event_source *src)
+{
+	if (src->type == SOURCE_TIMER)
+		close(src->fd);
+
+	if (src->type == SOURCE_SIGNAL) {
+		close(src->fd);
+		sigprocmask(SIG_SETMASK, &src->old_mask, NULL);
+	}
+
+	free(src);
+}
+
+static void free_removed(struct event_loop *loop)
+{
+	struct event_source **p = &loop->sources;
+
+	while (*p) {
+		struct event_source *src = *p;
+
+		if (src->removed) {
+			*p = src->next;
+			free_source(src);
+		} else {
+			p = &src->next;
+		}
+	}
+}
+
+void event_loop_destroy(struct event_loop *loop)
+{
+	/* signal sources restore the mask in reverse order of adding */
+	while (loop->sources) {
+		struct event_source *src = loop->sources;
+
+		loop->sources = src->next;
+		free_source(src);
+	}
+
+	close(loop->epfd);
+	free(loop);
+}
+
+/* NULL with errno set if the fd can't be polled, e.g. EPERM for a regular file */
+static struct event_source *add_source(struct event_loop *loop, int fd,
+	enum source_type type, event_func func, void *data)
+{
+	struct event_source *src = calloc(1, sizeof(*src));
+	ASSERT(src);
+
+	src->fd = fd;
+	src->type = type;
+	src->func = func;
+	src->data = data;
+
+	struct epoll_event event = {
+		.events = EPOLLIN,
+		.data.ptr = src,
+	};
+
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &event) < 0) {
+		int err = errno;
+
+		free(src);
+		errno = err;
+		return NULL;
+	}
+
+	src->next = loop->sources;
+	loop->sources = src;
+
+	return src;
+}
+
+int event_loop_add(struct event_loop *loop, int fd, event_func func, void *data)
+{
+	if (!add_source(loop, fd, SOURCE_FD, func, data))
+		return -errno;
+
+	return 0;
+}
+
+void event_loop_remove(struct event_loop *loop, int fd)
+{
+	for (struct event_source *src = loop->sources; src; src = src->next) {
+		if (src->fd != fd || src->removed)
+			continue;
+
+		int r = epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+		ASSERT(r == 0);
+
+		src->removed = true;
+		break;
+	}
+
+	if (!loop->dispatching)
+		free_removed(loop);
+}
+
+int event_loop_add_drm(struct event_loop *loop, int fd, drmEventContext *ev)
+{
+	struct event_source *src = add_source(loop, fd, SOURCE_DRM, NULL, NULL);
+
+	if (!src)
+		return -errno;
+
+	src->ev = ev;
+
+	return 0;
+}
+
+int event_loop_add_timer(struct event_loop *loop, uint64_t interval_us,
+	event_func func, void *data)
+{
+	struct itimerspec its = {
+		.it_interval.tv_sec = interval_us / 1000000,
+		.it_interval.tv_nsec = interval_us % 1000000 * 1000,
+	};
+	int fd, r;
+
+	its.it_value = its.it_interval;
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	ASSERT(fd >= 0);
+
+	r = timerfd_settime(fd, 0, &its, NULL);
+	ASSERT(r == 0);
+
+	struct event_source *src = add_source(loop, fd, SOURCE_TIMER, func, data);
+	ASSERT(src);
+
+	return fd;
+}
+
+int event_loop_add_signals(struct event_loop *loop, const int *signals, int num_signals,
+	event_func func, void *data)
+{
+	sigset_t mask, old_mask;
+	int fd, r;
+
+	sigemptyset(&mask);
+
+	for (int i = 0; i < num_signals; ++i)
+		sigaddset(&mask, signals[i]);
+
+	r = sigprocmask(SIG_BLOCK, &mask, &old_mask);
+	ASSERT(r == 0);
+
+	fd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+	ASSERT(fd >= 0);
+
+	struct event_source *src = add_source(loop, fd, SOURCE_SIGNAL, func, data);
+	ASSERT(src);
+
+	src->old_mask = old_mask;
+
+	return fd;
+}
+
+/* a terminal or pipe open for reading, and not a source already */
+static bool input_pollable(struct event_loop *loop, int fd)
+{
+	struct stat st;
+	int flags = fcntl(fd, F_GETFL);
+
+	if (flags < 0 || (flags & O_ACCMODE) == O_WRONLY || fstat(fd, &st) < 0)
+		return false;
+
+	if (!isatty(fd) && !S_ISFIFO(st.st_mode) && !S_ISSOCK(st.st_mode))
+		return false;
+
+	for (struct event_source *src = loop->sources; src; src = src->next) {
+		if (src->fd == fd && !src->removed)
+			return false;
+	}
+
+	return true;
+}
+
+void event_loop_quit_on_input(struct event_loop *loop)
+{
+	static const int signals[] = { SIGINT, SIGTERM };
+
+	/*
+	 * Without a usable stdin, e.g. closed, redirected from a file or
+	 * reused for a device, only the signals quit.
+	 */
+	if (input_pollable(loop, 0))
+		add_source(loop, 0, SOURCE_INPUT, NULL, NULL);
+
+	event_loop_add_signals(loop, signals, ARRAY_SIZE(signals), NULL, NULL);
+}
+
+static bool fd_readable(int fd)
+{
+	struct pollfd pfd = {
+		.fd = fd,
+		.events = POLLIN,
+	};
+
+	return poll(&pfd, 1, 0) > 0;
+}
+
+static void dispatch_source(struct event_loop *loop, struct event_source *src)
+{
+	switch (src->type) {
+	case SOURCE_DRM:
+		/* one read gets at most 1k of events, drain the rest too */
+		do {
+			int r = drmHandleEvent(src->fd, src->ev);
+			ASSERT(r == 0);
+		} while (!src->removed && fd_readable(src->fd));
+		return;
+
+	case SOURCE_TIMER: {
+		uint64_t expirations;
+
+		if (read(src->fd, &expirations, sizeof(expirations)) < 0) {
+			ASSERT(errno == EAGAIN);
+			return;
+		}
+		break;
+	}
+
+	case SOURCE_SIGNAL: {
+		struct signalfd_siginfo info;
+
+		if (read(src->fd, &info, sizeof(info)) < 0) {
+			ASSERT(errno == EAGAIN);
+			return;
+		}
+
+		if (!src->func)
+			fprintf(stderr, "exit due to %s\n", strsignal(info.ssi_signo));
+		break;
+	}
+
+	case SOURCE_INPUT:
+		fprintf(stderr, "exit due to user-input\n");
+		break;
+
+	case SOURCE_FD:
+		if (!src->func)
+			break;
+
+		do {
+			src->func(src->fd, src->data);
+		} while (!src->removed && !loop->quit && fd_readable(src->fd));
+		return;
+	}
+
+	if (src->func)
+		src->func(src->fd, src->data);
+	else
+		loop->quit = true;
+}
+
+void event_loop_set_idle(struct event_loop *loop, bool (*func)(void *data), void *data)
+{
+	loop->idle = func;
+	loop->idle_data = data;
+}
+
+bool event_loop_dispatch(struct event_loop *loop, int timeout_ms)
+{
+	struct epoll_event events[MAX_EVENTS];
+	int n;
+
+	if (loop->quit)
+		return false;
+
+	if (loop->idle && loop->idle(loop->idle_data))
+		timeout_ms = 0;
+
+	n = epoll_wait(loop->epfd, events, MAX_EVENTS, timeout_ms);
+	if (n < 0) {
+		ASSERT(errno == EINTR);
+		return true;
+	}
+
+	loop->dispatching = true;
+
+	for (int i = 0; i < n && !loop->quit; ++i) {
+		struct event_source *src = events[i].data.ptr;
+
+		if (!src->removed)
+			dispatch_source(loop, src);
+	}
+
+	loop->dispatching = false;
+
+	free_removed(loop);
+
+	return !loop->quit;
+}
+
+void event_loop_run(struct event_loop *loop)
+{
+	while (event_loop_dispatch(loop, -1))
+		;
+}
+
+void event_loop_quit(struct event_loop *loop)
+{
+	loop->quit = true;
+}
@@ -0,0 +1,51 @@
+#ifndef _COMMON_EVENT_H_
+#define _COMMON_EVENT_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <xf86drm.h>
+
+/*
+ * epoll based event loop. Each source is a fd with a callback, called
+ * until the fd has no more input on each wakeup, so the callback has to
+ * consume some input per call. A NULL callback quits the loop instead.
+ * Sources can be added and removed from the callbacks.
+ */
+struct event_loop;
+
+typedef void (*event_func)(int fd, void *data);
+
+struct event_loop *event_loop_create(void);
+/* closes the timer and signal fds, other fds belong to the caller */
+void event_loop_destroy(struct event_loop *loop);
+
+/* 0, or -errno if the fd can't be added, e.g. -EPERM for a regular file */
+int event_loop_add(struct event_loop *loop, int fd, event_func func, void *data);
+void event_loop_remove(struct event_loop *loop, int fd);
+
+/* a drm device, all pending events are handled with ev on each wakeup */
+int event_loop_add_drm(struct event_loop *loop, int fd, drmEventContext *ev);
+/* a periodic timerfd, the expirations are consumed before func is called */
+int event_loop_add_timer(struct event_loop *loop, uint64_t interval_us,
+	event_func func, void *data);
+/*
+ * Block the signals and handle them through a signalfd. They are blocked
+ * in the calling thread only, helper threads must start with them blocked.
+ */
+int event_loop_add_signals(struct event_loop *loop, const int *signals, int num_signals,
+	event_func func, void *data);
+/* quit on user input on a terminal or pipe stdin, or on SIGINT and SIGTERM */
+void event_loop_quit_on_input(struct event_loop *loop);
+
+/*
+ * Called before each wait for events. While it returns true, i.e. has
+ * more work to do, the loop only checks for events without waiting.
+ */
+void event_loop_set_idle(struct event_loop *loop, bool (*func)(void *data), void *data);
+
+/* wait up to timeout_ms (-1 forever) and dispatch, false once quit */
+bool event_loop_dispatch(struct event_loop *loop, int timeout_ms);
+void event_loop_run(struct event_loop *loop);
+void event_loop_quit(struct event_loop *loop);
+
+#endif
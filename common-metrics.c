@@ -0,0 +1,292 @@
+#include <pthread.h>
+#include <signal.h>
+#include <inttypes.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "common-metrics.h"
+
+#define QUEUE_SIZE 256		/* power of two */
+
+struct metrics {
+	uint64_t seq;
+
+	/* shm:<name> */
+	struct metrics_shm *shm;
+	char shm_name[64];
+
+	/* files and pipes, written on the writer thread */
+	FILE *file;
+	bool json;
+	pthread_t thread;
+	bool stop;
+	int efd;			/* wakes the writer thread */
+	uint64_t num_lost;		/* records dropped with the queue full */
+
+	unsigned head __attribute__((aligned(64)));	/* writer thread */
+	unsigned tail __attribute__((aligned(64)));	/* event thread */
+	union metrics_record queue[QUEUE_SIZE];
+};
+
+static void write_json(FILE *f, const union metrics_record *rec)
+{
+	const struct metrics_header *hdr = &rec->hdr;
+
+	if (hdr->type == METRICS_FRAME) {
+		const struct metrics_frame *r = &rec->frame;
+
+		fprintf(f, "{\"type\":\"frame\",\"seq\":%" PRIu64 ",\"output\":%u,"
+			"\"vblank_seq\":%u,\"vblank_us\":%" PRIu64 ",\"missed\":%u,"
+			"\"interval_us\":%u,\"latency_us\":%u,\"draw_us\":%u,"
+			"\"queue_depth\":%u,\"dropped\":%u}\n",
+			hdr->seq, hdr->output_id,
+			r->vblank_seq, r->vblank_us, r->missed,
+			r->interval_us, r->latency_us, r->draw_us,
+			r->queue_depth, r->dropped);
+	} else {
+		const struct metrics_interval *r = &rec->interval;
+
+		fprintf(f, "{\"type\":\"interval\",\"seq\":%" PRIu64 ",\"output\":%u,"
+			"\"flips\":%u,\"missed\":%u,\"vblank_us\":%" PRIu64 ",\"dropped\":%u,"
+			"\"interval_us\":{\"p50\":%u,\"p99\":%u,\"max\":%u},"
+			"\"draw_us\":{\"p50\":%u,\"p99\":%u,\"max\":%u},"
+			"\"latency_us\":{\"p50\":%u,\"p99\":%u,\"max\":%u}}\n",
+			hdr->seq, hdr->output_id,
+			r->num_flips, r->missed, r->vblank_us, r->dropped,
+			r->interval_p50_us, r->interval_p99_us, r->interval_max_us,
+			r->draw_p50_us, r->draw_p99_us, r->draw_max_us,
+			r->latency_p50_us, r->latency_p99_us, r->latency_max_us);
+	}
+}
+
+static void *writer_thread(void *data)
+{
+	struct metrics *m = data;
+	bool failed = false;
+
+	while (true) {
+		unsigned head = m->head;
+		uint64_t v;
+
+		if (head == __atomic_load_n(&m->tail, __ATOMIC_ACQUIRE)) {
+			/* out of records, a good time to write out the buffered ones */
+			if (!failed && fflush(m->file) != 0) {
+				/* e.g. a pipe whose reader went away, EPIPE as SIGPIPE is blocked */
+				fprintf(stderr, "metrics: write failed: %m, no more records\n");
+				failed = true;
+			}
+
+			if (__atomic_load_n(&m->stop, __ATOMIC_ACQUIRE))
+				break;
+
+			if (read(m->efd, &v, sizeof(v)) < 0)
+				ASSERT(errno == EINTR);
+			continue;
+		}
+
+		const union metrics_record *rec = &m->queue[head % QUEUE_SIZE];
+
+		if (failed)
+			;
+		else if (m->json)
+			write_json(m->file, rec);
+		else
+			fwrite(rec, rec->hdr.size, 1, m->file);
+
+		__atomic_store_n(&m->head, head + 1, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+static void open_shm(struct metrics *m, const char *name)
+{
+	snprintf(m->shm_name, sizeof(m->shm_name), "%s%s", name[0] == '/' ? "" : "/", name);
+
+	int fd = shm_open(m->shm_name, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	ASSERT(fd >= 0);
+
+	int r = ftruncate(fd, sizeof(struct metrics_shm));
+	ASSERT(r == 0);
+
+	m->shm = mmap(NULL, sizeof(struct metrics_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	ASSERT(m->shm != MAP_FAILED);
+
+	close(fd);
+
+	m->shm->record_size = sizeof(union metrics_record);
+	m->shm->num_records = METRICS_SHM_RECORDS;
+	m->shm->version = METRICS_SHM_VERSION;
+	/* readers check the magic last */
+	__atomic_store_n(&m->shm->magic, METRICS_SHM_MAGIC, __ATOMIC_RELEASE);
+}
+
+static void open_file(struct metrics *m, const char *path, bool json)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "cannot open metrics sink %s: %m\n", path);
+		exit(1);
+	}
+
+	m->file = fdopen(fd, "w");
+	ASSERT(m->file);
+
+	m->json = json;
+
+	m->efd = eventfd(0, EFD_CLOEXEC);
+	ASSERT(m->efd >= 0);
+
+	/* signals are for the event thread, the writer thread starts with them blocked */
+	sigset_t all, old;
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	int r = pthread_create(&m->thread, NULL, writer_thread, m);
+	ASSERT(r == 0);
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+struct metrics *metrics_open(const char *sink)
+{
+	struct metrics *m = calloc(1, sizeof(*m));
+	ASSERT(m);
+
+	if (strncmp(sink, "shm:", 4) == 0)
+		open_shm(m, sink + 4);
+	else if (strncmp(sink, "bin:", 4) == 0)
+		open_file(m, sink + 4, false);
+	else
+		open_file(m, sink, true);
+
+	return m;
+}
+
+void metrics_close(struct metrics *m)
+{
+	if (m->shm) {
+		munmap(m->shm, sizeof(struct metrics_shm));
+		shm_unlink(m->shm_name);
+	} else {
+		uint64_t v = 1;
+
+		__atomic_store_n(&m->stop, true, __ATOMIC_RELEASE);
+		ssize_t r = write(m->efd, &v, sizeof(v));
+		ASSERT(r == sizeof(v));
+
+		pthread_join(m->thread, NULL);
+
+		if (m->num_lost)
+			fprintf(stderr, "metrics: %" PRIu64 " records lost\n", m->num_lost);
+
+		fclose(m->file);
+		close(m->efd);
+	}
+
+	free(m);
+}
+
+bool metrics_shm_read(const struct metrics_shm *shm, uint64_t seq, union metrics_record *rec)
+{
+	uint64_t head = __atomic_load_n(&shm->head, __ATOMIC_ACQUIRE);
+
+	if (seq >= head || head - seq > shm->num_records)
+		return false;
+
+	*rec = shm->records[seq % shm->num_records];
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	/* the slot is rewritten while head is at seq + num_records */
+	head = __atomic_load_n(&shm->head, __ATOMIC_RELAXED);
+
+	return head - seq < shm->num_records;
+}
+
+static void write_record(struct metrics *m, union metrics_record *rec)
+{
+	rec->hdr.seq = m->seq++;
+
+	if (m->shm) {
+		struct metrics_shm *shm = m->shm;
+		uint64_t head = shm->head;
+
+		/* a reader that sees any of the record sees head past the one it replaces */
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+
+		shm->records[head % METRICS_SHM_RECORDS] = *rec;
+
+		__atomic_store_n(&shm->head, head + 1, __ATOMIC_RELEASE);
+		return;
+	}
+
+	unsigned tail = m->tail;
+
+	if (tail - __atomic_load_n(&m->head, __ATOMIC_ACQUIRE) == QUEUE_SIZE) {
+		m->num_lost++;
+		return;
+	}
+
+	m->queue[tail % QUEUE_SIZE] = *rec;
+
+	__atomic_store_n(&m->tail, tail + 1, __ATOMIC_RELEASE);
+
+	/* a record pushed after the writer saw the queue empty also signals */
+	uint64_t v = 1;
+
+	ssize_t r = write(m->efd, &v, sizeof(v));
+	ASSERT(r == sizeof(v));
+}
+
+void metrics_write_frame(struct metrics *m, struct modeset_out *out,
+	unsigned queue_depth, unsigned dropped)
+{
+	const struct frame_timing *t = &out->timing;
+	union metrics_record rec = {
+		.frame = {
+			.hdr.type = METRICS_FRAME,
+			.hdr.size = sizeof(struct metrics_frame),
+			.hdr.output_id = out->output_id,
+			.vblank_seq = t->vblank_seq,
+			.missed = t->last_missed,
+			.vblank_us = t->vblank_us,
+			.interval_us = t->last_interval_us,
+			.latency_us = t->last_latency_us,
+			.draw_us = t->last_draw_us,
+			.queue_depth = queue_depth,
+			.dropped = dropped,
+		},
+	};
+
+	write_record(m, &rec);
+}
+
+void metrics_write_interval(struct metrics *m, struct modeset_out *out, unsigned dropped)
+{
+	const struct frame_timing *t = &out->timing;
+	union metrics_record rec = {
+		.interval = {
+			.hdr.type = METRICS_INTERVAL,
+			.hdr.size = sizeof(struct metrics_interval),
+			.hdr.output_id = out->output_id,
+			.num_flips = t->num_flips,
+			.missed = t->missed,
+			.vblank_us = t->vblank_us,
+			.dropped = dropped,
+			.interval_p50_us = hist_percentile(&t->flip_interval, 50),
+			.interval_p99_us = hist_percentile(&t->flip_interval, 99),
+			.interval_max_us = t->flip_interval.max,
+			.draw_p50_us = hist_percentile(&t->draw, 50),
+			.draw_p99_us = hist_percentile(&t->draw, 99),
+			.draw_max_us = t->draw.max,
+			.latency_p50_us = hist_percentile(&t->latency, 50),
+			.latency_p99_us = hist_percentile(&t->latency, 99),
+			.latency_max_us = t->latency.max,
+		},
+	};
+
+	write_record(m, &rec);
+}
@@ -0,0 +1,103 @@
+#ifndef _COMMON_METRICS_H_
+#define _COMMON_METRICS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "common-modeset.h"
+
+/*
+ * Machine readable timing records, per frame and per measure interval.
+ * The sink is given as:
+ *
+ *   <path>       JSON lines, to a file or a named pipe
+ *   bin:<path>   binary records, to a file or a named pipe
+ *   shm:<name>   binary records in a POSIX shared memory ring
+ *
+ * Writing a record never blocks the caller. Records for files and pipes
+ * are queued to a writer thread, and dropped if it falls behind, e.g.
+ * on a pipe nobody reads. The shared memory ring overwrites the oldest
+ * records, a slow reader sees a gap in the sequence numbers.
+ */
+
+enum metrics_type {
+	METRICS_FRAME = 1,
+	METRICS_INTERVAL = 2,
+};
+
+/* the binary records start with this, size includes it */
+struct metrics_header {
+	uint16_t type;
+	uint16_t size;
+	uint32_t output_id;
+	uint64_t seq;			/* of the record, from 0 */
+};
+
+struct metrics_frame {
+	struct metrics_header hdr;
+	uint32_t vblank_seq;
+	uint32_t missed;		/* vblanks missed before this flip */
+	uint64_t vblank_us;		/* CLOCK_MONOTONIC */
+	uint32_t interval_us;		/* since the previous flip */
+	uint32_t latency_us;		/* from the flip ioctl to the vblank */
+	uint32_t draw_us;		/* of the last drawn frame */
+	uint32_t queue_depth;		/* frames drawn and waiting for a flip */
+	uint32_t dropped;		/* frames never shown, since the previous record */
+	uint32_t pad;
+};
+
+struct metrics_interval {
+	struct metrics_header hdr;
+	uint32_t num_flips;
+	uint32_t missed;
+	uint64_t vblank_us;		/* of the last flip */
+	uint32_t dropped;
+	uint32_t interval_p50_us, interval_p99_us, interval_max_us;
+	uint32_t draw_p50_us, draw_p99_us, draw_max_us;
+	uint32_t latency_p50_us, latency_p99_us, latency_max_us;
+};
+
+union metrics_record {
+	struct metrics_header hdr;
+	struct metrics_frame frame;
+	struct metrics_interval interval;
+};
+
+/* shared memory ring layout */
+#define METRICS_SHM_MAGIC 0x4d52544d	/* "MTRM" */
+#define METRICS_SHM_VERSION 1
+#define METRICS_SHM_RECORDS 1024
+
+struct metrics_shm {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_size;		/* sizeof(union metrics_record) */
+	uint32_t num_records;
+	/* records written, each at records[seq % num_records] */
+	uint64_t head __attribute__((aligned(64)));
+	union metrics_record records[METRICS_SHM_RECORDS];
+};
+
+/*
+ * Copy record seq of the ring, false if it's not written yet, or was
+ * overwritten already or while copying it. Readers start at head.
+ */
+bool metrics_shm_read(const struct metrics_shm *shm, uint64_t seq, union metrics_record *rec);
+
+struct metrics;
+
+/* exits on a bad sink, a named pipe waits for a reader to open it */
+struct metrics *metrics_open(const char *sink);
+/* writes out the queued records */
+void metrics_close(struct metrics *m);
+
+/*
+ * The timing of the last flip of out, to be called from its flip event.
+ * queue_depth and dropped are the tool's own, 0 if they don't apply.
+ */
+void metrics_write_frame(struct metrics *m, struct modeset_out *out,
+	unsigned queue_depth, unsigned dropped);
+/* the stats of out->timing, to be called before timing_report() */
+void metrics_write_interval(struct metrics *m, struct modeset_out *out, unsigned dropped);
+
+#endif
@@ -1,5 +1,6 @@
 #include "common-modeset.h"
 #include "common.h"
+#include "common-event.h"
 
 static int modeset_find_crtc(int fd, drmModeRes *res, drmModeConnector *conn,
 			     struct modeset_out *out, struct modeset_out *out_list)
@@ -76,6 +77,102 @@ static int modeset_find_crtc(int fd, drmModeRes *res, drmModeConnector *conn,
 	return -ENOENT;
 }
 
+/* true for the first output of each device in the list */
+static bool first_of_device(struct modeset_out *list, struct modeset_out *out)
+{
+	for (struct modeset_out *o = list; o != out; o = o->next) {
+		if (o->fd == out->fd)
+			return false;
+	}
+
+	return true;
+}
+
+/* the outputs of the device in list */
+#define for_each_device_output(pos, head, dev_fd) \
+	for_each_output(pos, head) \
+		if ((pos)->fd == (dev_fd))
+
+static void modeset_disable_atomic(struct modeset_out *list, int fd)
+{
+	for_each_device_output(out, list, fd) {
+		if (out->primary_plane_id)
+			drm_release_plane(out->fd, out->primary_plane_id);
+
+		out->primary_plane_id = 0;
+		out->atomic = false;
+	}
+
+	/*
+	 * Also turns universal planes off again, as the legacy path expects.
+	 * The cached plane set still lists the primary planes, but those are
+	 * only handed out on request.
+	 */
+	drmSetClientCap(fd, DRM_CLIENT_CAP_ATOMIC, 0);
+}
+
+static void atomic_add(drmModeAtomicReq *req, int fd, uint32_t obj_id, uint32_t obj_type,
+	const char *name, uint64_t value)
+{
+	uint32_t prop = drm_find_prop_id(fd, obj_id, obj_type, name);
+	ASSERT(prop);
+
+	int r = drmModeAtomicAddProperty(req, obj_id, prop, value);
+	ASSERT(r >= 0);
+}
+
+/* fb scaled to the given area of the crtc */
+static void atomic_add_plane(drmModeAtomicReq *req, struct modeset_out *out,
+	uint32_t plane_id, struct framebuffer *fb, int x, int y, int w, int h)
+{
+	const uint32_t t = DRM_MODE_OBJECT_PLANE;
+
+	atomic_add(req, out->fd, plane_id, t, "FB_ID", fb->fb_id);
+	atomic_add(req, out->fd, plane_id, t, "CRTC_ID", out->crtc_id);
+	atomic_add(req, out->fd, plane_id, t, "SRC_X", 0);
+	atomic_add(req, out->fd, plane_id, t, "SRC_Y", 0);
+	atomic_add(req, out->fd, plane_id, t, "SRC_W", (uint64_t)fb->width << 16);
+	atomic_add(req, out->fd, plane_id, t, "SRC_H", (uint64_t)fb->height << 16);
+	atomic_add(req, out->fd, plane_id, t, "CRTC_X", x);
+	atomic_add(req, out->fd, plane_id, t, "CRTC_Y", y);
+	atomic_add(req, out->fd, plane_id, t, "CRTC_W", w);
+	atomic_add(req, out->fd, plane_id, t, "CRTC_H", h);
+}
+
+static void atomic_add_flip(drmModeAtomicReq *req, struct modeset_out *out,
+	struct framebuffer *fb)
+{
+	atomic_add_plane(req, out, out->primary_plane_id, fb,
+		0, 0, out->mode.hdisplay, out->mode.vdisplay);
+
+	if (!out->num_damage)
+		return;
+
+	uint32_t prop = drm_find_prop_id(out->fd, out->primary_plane_id,
+		DRM_MODE_OBJECT_PLANE, "FB_DAMAGE_CLIPS");
+
+	/* without it the whole plane is damaged */
+	if (!prop)
+		return;
+
+	int r = drmModeCreatePropertyBlob(out->fd, out->damage,
+		sizeof(out->damage[0]) * out->num_damage, &out->damage_blob_id);
+	ASSERT(r == 0);
+
+	r = drmModeAtomicAddProperty(req, out->primary_plane_id, prop, out->damage_blob_id);
+	ASSERT(r >= 0);
+}
+
+/* the commit holds its own reference to the damage blob */
+static void atomic_put_damage(struct modeset_out *out)
+{
+	if (out->damage_blob_id)
+		drmModeDestroyPropertyBlob(out->fd, out->damage_blob_id);
+
+	out->damage_blob_id = 0;
+	out->num_damage = 0;
+}
+
 static int modeset_setup_output(int fd, drmModeRes *res, drmModeConnector *conn,
 			     struct modeset_out *out, struct modeset_out *out_list)
 {
@@ -117,7 +214,48 @@ static int modeset_setup_output(int fd, drmModeRes *res, drmModeConnector *conn,
 	return 0;
 }
 
-void modeset_prepare(int fd, struct modeset_out **out_list)
+/*
+ * Use atomic commits if the driver supports them and $DRM_ATOMIC isn't
+ * 0. Each output needs the primary plane of its crtc for that.
+ */
+static void modeset_init_atomic(int fd, struct modeset_out *list)
+{
+	const char *env = getenv("DRM_ATOMIC");
+	uint64_t crtc_in_event;
+
+	if (!list || (env && strcmp(env, "0") == 0))
+		return;
+
+	/* flip events of a multi-crtc commit are told apart by crtc id */
+	if (drmGetCap(fd, DRM_CAP_CRTC_IN_VBLANK_EVENT, &crtc_in_event) != 0 || !crtc_in_event)
+		return;
+
+	if (drmSetClientCap(fd, DRM_CLIENT_CAP_ATOMIC, 1) != 0)
+		return;
+
+	for_each_output(out, list) {
+		const struct drm_plane_req req = {
+			.crtc_id = out->crtc_id,
+			.modifier = DRM_FORMAT_MOD_INVALID,
+			.primary = true,
+		};
+
+		out->primary_plane_id = drm_reserve_plane2(fd, &req);
+
+		if (!out->primary_plane_id) {
+			fprintf(stderr, "no primary plane for crtc %u, not using atomic\n",
+				out->crtc_id);
+			modeset_disable_atomic(list, fd);
+			return;
+		}
+	}
+
+	for_each_output(out, list)
+		out->atomic = true;
+}
+
+/* output ids start from id_base, to keep them unique over devices */
+static void modeset_prepare_dev(int fd, uint32_t id_base, struct modeset_out **out_list)
 {
 	drmModeRes *res;
 	drmModeConnector *conn;
@@ -126,6 +264,9 @@ void modeset_prepare(int fd, struct modeset_out **out_list)
 	struct modeset_out *o_list=NULL;
 	int r;
 
+	/* the objects may have changed since the last probe, e.g. on hotplug */
+	drm_invalidate_props(fd);
+
 	/* retrieve resources */
 	res = drmModeGetResources(fd);
 	ASSERT(res);
@@ -141,7 +282,7 @@ void modeset_prepare(int fd, struct modeset_out **out_list)
 		memset(out, 0, sizeof(*out));
 		out->fd = fd;
 		out->conn_id = conn->connector_id;
-		out->output_id = i;
+		out->output_id = id_base + i;
 
 		/* call helper function to prepare this output */
 		r = modeset_setup_output(fd, res, conn, out, o_list);
@@ -173,10 +314,68 @@ void modeset_prepare(int fd, struct modeset_out **out_list)
 	/* free resources again */
 	drmModeFreeResources(res);
 
+	modeset_init_atomic(fd, o_list);
+
 	*out_list = o_list;
 }
 
+void modeset_prepare(int fd, struct modeset_out **out_list)
+{
+	modeset_prepare_dev(fd, 0, out_list);
+}
+
+void modeset_prepare_devices(const int *fds, int num_fds, struct modeset_out **out_list)
+{
+	struct modeset_out **tail = out_list;
+	uint32_t id_base = 0;
+
+	*out_list = NULL;
+
+	for (int i = 0; i < num_fds; ++i) {
+		modeset_prepare_dev(fds[i], id_base, tail);
+
+		while (*tail) {
+			id_base = (*tail)->output_id + 1;
+			tail = &(*tail)->next;
+		}
+	}
+}
+
+void modeset_add_card(struct modeset_devices *devs, const char *card)
+{
+	if (devs->num_devs == MODESET_MAX_DEVICES) {
+		fprintf(stderr, "too many cards, at most %d\n", MODESET_MAX_DEVICES);
+		exit(1);
+	}
+
+	devs->cards[devs->num_devs++] = card;
+}
+
+void modeset_open_devices(struct modeset_devices *devs, struct modeset_out **out_list)
+{
+	if (devs->num_devs == 0)
+		modeset_add_card(devs, "/dev/dri/card0");
+
+	for (int i = 0; i < devs->num_devs; ++i)
+		devs->fds[i] = drm_open_dev_dumb(devs->cards[i]);
+
+	modeset_prepare_devices(devs->fds, devs->num_devs, out_list);
+}
+
+void modeset_close_devices(struct modeset_devices *devs)
+{
+	for (int i = 0; i < devs->num_devs; ++i)
+		drm_close_dev(devs->fds[i]);
+
+	devs->num_devs = 0;
+}
+
 void modeset_alloc_fbs(struct modeset_out *list, int num_buffers)
+{
+	modeset_alloc_fbs2(list, num_buffers, DRM_FORMAT_XRGB8888);
+}
+
+void modeset_alloc_fbs2(struct modeset_out *list, int num_buffers, uint32_t format)
 {
 	for_each_output(out, list) {
 		struct framebuffer *bufs;
@@ -186,25 +385,81 @@ void modeset_alloc_fbs(struct modeset_out *list, int num_buffers)
 		ASSERT(bufs);
 
 		for(i = 0 ; i < num_buffers; i++)
-			drm_create_dumb_fb(out->fd,
-				out->mode.hdisplay, out->mode.vdisplay, &bufs[i]);
+			drm_create_dumb_fb3(out->fd,
+				out->mode.hdisplay, out->mode.vdisplay, format,
+				DRM_FB_SINGLE_BO, &bufs[i]);
 
 		out->bufs = bufs;
 		out->num_buffers = num_buffers;
 	}
 }
 
+static void modeset_set_modes_atomic(struct modeset_out *list, int fd)
+{
+	drmModeAtomicReq *req = drmModeAtomicAlloc();
+	ASSERT(req);
+
+	for_each_device_output(out, list, fd) {
+		int r = drmModeCreatePropertyBlob(out->fd, &out->mode, sizeof(out->mode),
+			&out->mode_blob_id);
+		ASSERT(r == 0);
+
+		atomic_add(req, out->fd, out->conn_id, DRM_MODE_OBJECT_CONNECTOR,
+			"CRTC_ID", out->crtc_id);
+		atomic_add(req, out->fd, out->crtc_id, DRM_MODE_OBJECT_CRTC,
+			"MODE_ID", out->mode_blob_id);
+		atomic_add(req, out->fd, out->crtc_id, DRM_MODE_OBJECT_CRTC,
+			"ACTIVE", 1);
+		atomic_add_plane(req, out, out->primary_plane_id, &out->bufs[0],
+			0, 0, out->mode.hdisplay, out->mode.vdisplay);
+	}
+
+	const uint32_t flags = DRM_MODE_ATOMIC_ALLOW_MODESET;
+	int r;
+
+	r = drmModeAtomicCommit(fd, req, flags | DRM_MODE_ATOMIC_TEST_ONLY, NULL);
+	if (r == 0)
+		r = drmModeAtomicCommit(fd, req, flags, NULL);
+
+	drmModeAtomicFree(req);
+
+	if (r == 0)
+		return;
+
+	fprintf(stderr, "atomic modeset failed (%d), falling back to legacy\n", r);
+
+	for_each_device_output(out, list, fd) {
+		drmModeDestroyPropertyBlob(out->fd, out->mode_blob_id);
+		out->mode_blob_id = 0;
+	}
+
+	modeset_disable_atomic(list, fd);
+}
+
 void modeset_set_modes(struct modeset_out *list)
 {
 	for_each_output(out, list) {
-		struct framebuffer *buf;
-		int r;
-
-		fprintf(stderr, "Output %u: Connector %u, Encoder %u, CRTC %u, FB %u/%u, Mode %ux%u\n",
+		fprintf(stderr, "Output %u: Connector %u, Encoder %u, CRTC %u, FB %u/%u, Mode %ux%u%s\n",
 			out->output_id,
 			out->conn_id, out->enc_id, out->crtc_id,
 			out->bufs[0].fb_id, out->bufs[1].fb_id,
-			out->mode.hdisplay, out->mode.vdisplay);
+			out->mode.hdisplay, out->mode.vdisplay,
+			out->atomic ? ", atomic" : "");
+	}
+
+	/* all crtcs of a device in one commit */
+	for_each_output(dev, list) {
+		if (dev->atomic && first_of_device(list, dev))
+			modeset_set_modes_atomic(list, dev->fd);
+	}
+
+	for_each_output(out, list) {
+		struct framebuffer *buf;
+		int r;
+
+		/* set in the atomic commit */
+		if (out->atomic)
+			continue;
 
 		buf = &out->bufs[0];
 
@@ -214,19 +469,193 @@ void modeset_set_modes(struct modeset_out *list)
 	}
 }
 
+/*
+ * Set the area of the back buffer that differs from the frame on screen.
+ * Used by the next flip only, without a call the whole buffer is
+ * considered damaged. Only the atomic backend passes the damage on, as
+ * FB_DAMAGE_CLIPS, the legacy flip drops it.
+ */
+void modeset_set_damage(struct modeset_out *out, const struct drm_mode_rect *rects,
+	int num_rects)
+{
+	if (num_rects <= MODESET_MAX_DAMAGE) {
+		memcpy(out->damage, rects, sizeof(*rects) * num_rects);
+		out->num_damage = num_rects;
+		return;
+	}
+
+	/* too many, report the bounding box */
+	struct drm_mode_rect *bb = &out->damage[0];
+
+	*bb = rects[0];
+
+	for (int i = 1; i < num_rects; ++i) {
+		if (rects[i].x1 < bb->x1)
+			bb->x1 = rects[i].x1;
+		if (rects[i].y1 < bb->y1)
+			bb->y1 = rects[i].y1;
+		if (rects[i].x2 > bb->x2)
+			bb->x2 = rects[i].x2;
+		if (rects[i].y2 > bb->y2)
+			bb->y2 = rects[i].y2;
+	}
+
+	out->num_damage = 1;
+}
+
+bool modeset_supports_damage(struct modeset_out *out)
+{
+	return out->atomic && drm_find_prop_id(out->fd, out->primary_plane_id,
+		DRM_MODE_OBJECT_PLANE, "FB_DAMAGE_CLIPS") != 0;
+}
+
+void modeset_flip_fb(struct modeset_out *out, struct framebuffer *fb)
+{
+	modeset_flip_fb_fenced(out, fb, -1, NULL);
+}
+
+void modeset_flip_fb_fenced(struct modeset_out *out, struct framebuffer *fb,
+	int in_fence, int *out_fence)
+{
+	bool damage = false;
+	int r;
+
+	if (out_fence)
+		*out_fence = -1;
+
+	if (out->atomic) {
+		drmModeAtomicReq *req = drmModeAtomicAlloc();
+		ASSERT(req);
+
+		atomic_add_flip(req, out, fb);
+
+		if (in_fence >= 0)
+			atomic_add(req, out->fd, out->primary_plane_id, DRM_MODE_OBJECT_PLANE,
+				"IN_FENCE_FD", in_fence);
+
+		if (out_fence)
+			atomic_add(req, out->fd, out->crtc_id, DRM_MODE_OBJECT_CRTC,
+				"OUT_FENCE_PTR", (uintptr_t)out_fence);
+
+		r = drmModeAtomicCommit(out->fd, req,
+			DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT, out);
+		ASSERT(r == 0);
+
+		drmModeAtomicFree(req);
+
+		damage = out->damage_blob_id != 0;
+		atomic_put_damage(out);
+	} else {
+		/* the legacy flip doesn't take a fence */
+		if (in_fence >= 0)
+			fence_wait(in_fence, -1);
+
+		/*
+		 * A legacy flip can't carry damage. DirtyFB only acts on the fb
+		 * already on the plane, so sending it for the back buffer would
+		 * be a wasted ioctl.
+		 */
+		out->num_damage = 0;
+
+		r = drmModePageFlip(out->fd, out->crtc_id, fb->fb_id,
+			DRM_MODE_PAGE_FLIP_EVENT, out);
+		ASSERT(r == 0);
+	}
+
+	timing_flip_submitted(&out->timing, damage);
+	out->pflip_pending = true;
+}
+
+void modeset_flip_fb_async(struct modeset_out *out, struct framebuffer *fb)
+{
+	/* also fine with the atomic cap, the event comes to the same handler */
+	int r = drmModePageFlip(out->fd, out->crtc_id, fb->fb_id,
+		DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_PAGE_FLIP_ASYNC, out);
+	ASSERT(r == 0);
+
+	/* the async flip doesn't take damage */
+	out->num_damage = 0;
+
+	timing_flip_submitted(&out->timing, false);
+	out->pflip_pending = true;
+}
+
 void modeset_start_flip(struct modeset_out *out)
 {
 	struct framebuffer *buf;
-	int r;
 
 	/* back buffer */
 	buf = &out->bufs[(out->front_buf + 1) % out->num_buffers];
 
-	r = drmModePageFlip(out->fd, out->crtc_id, buf->fb_id, DRM_MODE_PAGE_FLIP_EVENT, out);
-	ASSERT(r == 0);
+	modeset_flip_fb(out, buf);
 
 	out->front_buf = (out->front_buf + 1) % out->num_buffers;
-	out->pflip_pending = true;
+}
+
+/*
+ * With one commit for all crtcs of a device the flip events share the
+ * list head as their data, and are told apart by device and crtc id in
+ * modeset_page_flip_event2().
+ */
+static void modeset_start_flips_atomic(struct modeset_out *list, int fd)
+{
+	drmModeAtomicReq *req = drmModeAtomicAlloc();
+	ASSERT(req);
+
+	for_each_device_output(out, list, fd)
+		atomic_add_flip(req, out, &out->bufs[(out->front_buf + 1) % out->num_buffers]);
+
+	int r = drmModeAtomicCommit(fd, req,
+		DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT, list);
+	ASSERT(r == 0);
+
+	drmModeAtomicFree(req);
+
+	for_each_device_output(out, list, fd) {
+		bool damage = out->damage_blob_id != 0;
+
+		atomic_put_damage(out);
+
+		out->front_buf = (out->front_buf + 1) % out->num_buffers;
+
+		timing_flip_submitted(&out->timing, damage);
+		out->pflip_pending = true;
+	}
+}
+
+void modeset_start_flips(struct modeset_out *list)
+{
+	for_each_output(out, list) {
+		if (!out->atomic)
+			modeset_start_flip(out);
+		else if (first_of_device(list, out))
+			modeset_start_flips_atomic(list, out->fd);
+	}
+}
+
+void modeset_set_plane(struct modeset_out *out, uint32_t plane_id, struct framebuffer *fb,
+	int x, int y, int w, int h)
+{
+	int r;
+
+	if (out->atomic) {
+		drmModeAtomicReq *req = drmModeAtomicAlloc();
+		ASSERT(req);
+
+		atomic_add_plane(req, out, plane_id, fb, x, y, w, h);
+
+		r = drmModeAtomicCommit(out->fd, req, 0, NULL);
+		ASSERT(r == 0);
+
+		drmModeAtomicFree(req);
+	} else {
+		r = drmModeSetPlane(out->fd, plane_id, out->crtc_id,
+			fb->fb_id, 0,
+			x, y, w, h,
+			0 << 16, 0 << 16,
+			fb->width << 16, fb->height << 16);
+		ASSERT(r == 0);
+	}
 }
 
 static void modeset_page_flip_event(int fd, unsigned int frame,
@@ -237,6 +666,8 @@ static void modeset_page_flip_event(int fd, unsigned int frame,
 
 	out->pflip_pending = false;
 
+	timing_flip_done(&out->timing, frame, sec, usec);
+
 	if (out->cleanup)
 		return;
 
@@ -244,41 +675,45 @@ static void modeset_page_flip_event(int fd, unsigned int frame,
 		out->flip_event(data);
 }
 
-void modeset_main_loop(struct modeset_out *modeset_list, void (*flip_event)(void *))
+static void modeset_page_flip_event2(int fd, unsigned int frame,
+				     unsigned int sec, unsigned int usec,
+				     unsigned int crtc_id, void *data)
+{
+	struct modeset_out *out = data;
+
+	/* older kernels don't pass the crtc, then data is the output */
+	if (crtc_id) {
+		while (out && (out->fd != fd || out->crtc_id != crtc_id))
+			out = out->next;
+
+		ASSERT(out);
+	}
+
+	modeset_page_flip_event(fd, frame, sec, usec, out);
+}
+
+void modeset_run_loop(struct modeset_out *modeset_list, struct event_loop *loop)
 {
 	drmEventContext ev = {
 		.version = DRM_EVENT_CONTEXT_VERSION,
-		.page_flip_handler = modeset_page_flip_event,
+		.page_flip_handler2 = modeset_page_flip_event2,
 	};
 
-	/* start the page flips */
+	/* every device of the list, once */
 	for_each_output(out, modeset_list) {
-		out->flip_event = flip_event;
-		modeset_start_flip(out);
+		if (first_of_device(modeset_list, out)) {
+			int r = event_loop_add_drm(loop, out->fd, &ev);
+			ASSERT(r == 0);
+		}
 	}
 
-	int fd = modeset_list->fd;
+	event_loop_quit_on_input(loop);
 
-	fd_set fds;
+	event_loop_run(loop);
 
-	FD_ZERO(&fds);
-
-	while (true) {
-		int r;
-
-		FD_SET(0, &fds);
-		FD_SET(fd, &fds);
-
-		r = select(fd + 1, &fds, NULL, NULL, NULL);
-		if (r < 0) {
-			fprintf(stderr, "select() failed with %d: %m\n", errno);
-			break;
-		} else if (FD_ISSET(0, &fds)) {
-			fprintf(stderr, "exit due to user-input\n");
-			break;
-		} else if (FD_ISSET(fd, &fds)) {
-			drmHandleEvent(fd, &ev);
-		}
+	for_each_output(out, modeset_list) {
+		if (first_of_device(modeset_list, out))
+			event_loop_remove(loop, out->fd);
 	}
 
 	for_each_output(out, modeset_list) {
@@ -294,12 +729,27 @@ void modeset_main_loop(struct modeset_out *modeset_list, void (*flip_event)(void
 
 		while (out->pflip_pending) {
 			int r;
-			r = drmHandleEvent(fd, &ev);
+			r = drmHandleEvent(out->fd, &ev);
 			ASSERT(r == 0);
 		}
 	}
 }
 
+void modeset_main_loop(struct modeset_out *modeset_list, void (*flip_event)(void *))
+{
+	struct event_loop *loop = event_loop_create();
+
+	/* start the page flips */
+	for_each_output(out, modeset_list)
+		out->flip_event = flip_event;
+
+	modeset_start_flips(modeset_list);
+
+	modeset_run_loop(modeset_list, loop);
+
+	event_loop_destroy(loop);
+}
+
 void modeset_cleanup(struct modeset_out *out_list)
 {
 	struct modeset_out *iter;
@@ -315,6 +765,12 @@ void modeset_cleanup(struct modeset_out *out_list)
 			drm_destroy_dumb_fb(&iter->bufs[i]);
 		}
 
+		if (iter->mode_blob_id)
+			drmModeDestroyPropertyBlob(iter->fd, iter->mode_blob_id);
+
+		if (iter->primary_plane_id)
+			drm_release_plane(iter->fd, iter->primary_plane_id);
+
 		/* free allocated memory */
 		free(iter->bufs);
 		free(iter);
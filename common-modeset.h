@@ -2,6 +2,14 @@
 #define _COMMON_MODESET_H_
 
 #include "common-drm.h"
+#include "common-timing.h"
+
+#define MODESET_MAX_DAMAGE 8
+#define MODESET_MAX_DEVICES 8
+
+struct event_loop;
+struct render_worker;
+struct stats_output;
 
 struct modeset_out {
 	struct modeset_out *next;
@@ -29,13 +37,72 @@ struct modeset_out {
 
 	int dpms;
 
+	/* atomic backend, see modeset_init_atomic() */
+	bool atomic;
+	uint32_t primary_plane_id;
+	uint32_t mode_blob_id;
+	uint32_t damage_blob_id;
+
+	/* damage for the next flip, see modeset_set_damage() */
+	struct drm_mode_rect damage[MODESET_MAX_DAMAGE];
+	int num_damage;
+
+	/* render thread, see render_main_loop() */
+	struct render_worker *render;
+
+	/* updated by the flip functions, before flip_event is called */
+	struct frame_timing timing;
+
+	/* live stats in shared memory, see stats_open() */
+	struct stats_output *stats;
 };
 
 void modeset_prepare(int fd, struct modeset_out **out_list);
+/* one list over the outputs of all the devices, with unique output ids */
+void modeset_prepare_devices(const int *fds, int num_fds, struct modeset_out **out_list);
+
+/* the cards given with -c options, /dev/dri/card0 if none */
+struct modeset_devices {
+	int num_devs;
+	const char *cards[MODESET_MAX_DEVICES];
+	int fds[MODESET_MAX_DEVICES];
+};
+
+void modeset_add_card(struct modeset_devices *devs, const char *card);
+/* open the cards and prepare their outputs */
+void modeset_open_devices(struct modeset_devices *devs, struct modeset_out **out_list);
+void modeset_close_devices(struct modeset_devices *devs);
+
 void modeset_alloc_fbs(struct modeset_out *list, int num_buffers);
+void modeset_alloc_fbs2(struct modeset_out *list, int num_buffers, uint32_t format);
 void modeset_set_modes(struct modeset_out *list);
+void modeset_set_damage(struct modeset_out *out, const struct drm_mode_rect *rects,
+	int num_rects);
+/* damage reaches the kernel, with the atomic backend and FB_DAMAGE_CLIPS only */
+bool modeset_supports_damage(struct modeset_out *out);
 void modeset_start_flip(struct modeset_out *out);
+/* flip all outputs at once, in one commit per device with the atomic backend */
+void modeset_start_flips(struct modeset_out *list);
+/* flip to a buffer not allocated by modeset_alloc_fbs() */
+void modeset_flip_fb(struct modeset_out *out, struct framebuffer *fb);
+/*
+ * Flip to fb once in_fence (or -1) signals. If out_fence isn't NULL it
+ * gets a fence that signals when fb is on screen and the previous buffer
+ * is released, or -1 without the atomic backend.
+ */
+void modeset_flip_fb_fenced(struct modeset_out *out, struct framebuffer *fb,
+	int in_fence, int *out_fence);
+/* flip to fb without waiting for vblank, needs DRM_CAP_ASYNC_PAGE_FLIP */
+void modeset_flip_fb_async(struct modeset_out *out, struct framebuffer *fb);
+/* show fb scaled to the given area of the output, on a reserved plane */
+void modeset_set_plane(struct modeset_out *out, uint32_t plane_id, struct framebuffer *fb,
+	int x, int y, int w, int h);
 void modeset_main_loop(struct modeset_out *modeset_list, void (*flip_event)(void *));
+/*
+ * Run loop with the flip events of all devices until quit on user input,
+ * then wait for the pending flips. The flips have to be started already.
+ */
+void modeset_run_loop(struct modeset_out *modeset_list, struct event_loop *loop);
 void modeset_cleanup(struct modeset_out *out_list);
 
 static inline struct modeset_out *find_output(struct modeset_out *list, int output_id)
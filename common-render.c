@@ -0,0 +1,217 @@
+#include <pthread.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+
+#include "common.h"
+#include "common-event.h"
+#include "common-render.h"
+
+struct render_worker {
+	struct modeset_out *out;
+	render_func draw;
+	void (*flip_event)(void *);
+
+	pthread_t thread;
+	bool stop;
+
+	struct spsc_queue free_bufs;	/* to the render thread */
+	struct spsc_queue ready_bufs;	/* to the event thread */
+	int free_efd;			/* wakes the render thread */
+	int ready_efd;			/* wakes the event thread */
+
+	/* damage and draw time of each drawn buffer, published by ready_bufs */
+	struct drm_mode_rect (*damage)[MODESET_MAX_DAMAGE];
+	int *num_damage;
+	uint64_t *draw_us;
+
+	/* event thread */
+	int flipping;		/* buffer being flipped to, -1 if none */
+};
+
+static void efd_signal(int efd)
+{
+	uint64_t v = 1;
+	ssize_t r = write(efd, &v, sizeof(v));
+	ASSERT(r == sizeof(v));
+}
+
+static void *render_thread(void *data)
+{
+	struct render_worker *w = data;
+	struct modeset_out *out = w->out;
+
+	while (!__atomic_load_n(&w->stop, __ATOMIC_ACQUIRE)) {
+		struct timespec ts1, ts2;
+		uint64_t v;
+		int idx;
+
+		/* a free buffer pushed after the pop also signals, so no wakeup is lost */
+		if (!spsc_queue_pop(&w->free_bufs, &idx)) {
+			if (read(w->free_efd, &v, sizeof(v)) < 0)
+				ASSERT(errno == EINTR);
+			continue;
+		}
+
+		struct framebuffer *buf = &out->bufs[idx];
+
+		get_time_now(&ts1);
+
+		drm_fb_begin_cpu_access(buf, DRM_FB_ACCESS_WRITE);
+		w->num_damage[idx] = w->draw(out, buf, w->damage[idx]);
+		drm_fb_end_cpu_access(buf, DRM_FB_ACCESS_WRITE);
+
+		get_time_now(&ts2);
+
+		w->draw_us[idx] = get_time_elapsed_us(&ts1, &ts2);
+
+		bool ok = spsc_queue_push(&w->ready_bufs, idx);
+		ASSERT(ok);
+		efd_signal(w->ready_efd);
+	}
+
+	return NULL;
+}
+
+/* flip to the oldest drawn buffer, false if there's none yet */
+static bool flip_next(struct render_worker *w)
+{
+	struct modeset_out *out = w->out;
+	int idx;
+
+	if (!spsc_queue_pop(&w->ready_bufs, &idx))
+		return false;
+
+	if (w->num_damage[idx])
+		modeset_set_damage(out, w->damage[idx], w->num_damage[idx]);
+
+	modeset_flip_fb(out, &out->bufs[idx]);
+
+	w->flipping = idx;
+
+	return true;
+}
+
+static void render_flip_done(void *data)
+{
+	struct modeset_out *out = data;
+	struct render_worker *w = out->render;
+
+	/* the old front buffer is off screen now */
+	bool ok = spsc_queue_push(&w->free_bufs, out->front_buf);
+	ASSERT(ok);
+	efd_signal(w->free_efd);
+
+	out->front_buf = w->flipping;
+	w->flipping = -1;
+
+	timing_add_draw(&out->timing, w->draw_us[out->front_buf]);
+
+	if (w->flip_event)
+		w->flip_event(out);
+
+	flip_next(w);
+}
+
+/* a buffer was drawn, flip it unless a flip is in flight already */
+static void ready_event(int fd, void *data)
+{
+	struct render_worker *w = data;
+	uint64_t v;
+
+	if (read(fd, &v, sizeof(v)) < 0)
+		ASSERT(errno == EAGAIN);
+
+	if (!w->out->pflip_pending && !w->out->cleanup)
+		flip_next(w);
+}
+
+static void render_start(struct modeset_out *out, struct event_loop *loop,
+	render_func draw, void (*flip_event)(void *))
+{
+	struct render_worker *w = calloc(1, sizeof(*w));
+	ASSERT(w);
+
+	ASSERT(out->num_buffers >= 2 && out->num_buffers <= SPSC_QUEUE_SIZE);
+
+	w->out = out;
+	w->draw = draw;
+	w->flip_event = flip_event;
+	w->flipping = -1;
+
+	w->damage = calloc(out->num_buffers, sizeof(*w->damage));
+	w->num_damage = calloc(out->num_buffers, sizeof(*w->num_damage));
+	w->draw_us = calloc(out->num_buffers, sizeof(*w->draw_us));
+	ASSERT(w->damage && w->num_damage && w->draw_us);
+
+	w->free_efd = eventfd(0, EFD_CLOEXEC);
+	w->ready_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	ASSERT(w->free_efd >= 0 && w->ready_efd >= 0);
+
+	/* the front buffer is on screen since the modeset */
+	for (int i = 1; i < out->num_buffers; ++i)
+		spsc_queue_push(&w->free_bufs, (out->front_buf + i) % out->num_buffers);
+
+	out->render = w;
+	out->flip_event = render_flip_done;
+
+	int r = event_loop_add(loop, w->ready_efd, ready_event, w);
+	ASSERT(r == 0);
+
+	/* signals are for the event thread, the render thread starts with them blocked */
+	sigset_t all, old;
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	r = pthread_create(&w->thread, NULL, render_thread, w);
+	ASSERT(r == 0);
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+static void render_stop(struct modeset_out *out, struct event_loop *loop)
+{
+	struct render_worker *w = out->render;
+
+	__atomic_store_n(&w->stop, true, __ATOMIC_RELEASE);
+	efd_signal(w->free_efd);
+
+	pthread_join(w->thread, NULL);
+
+	event_loop_remove(loop, w->ready_efd);
+
+	close(w->free_efd);
+	close(w->ready_efd);
+
+	free(w->damage);
+	free(w->num_damage);
+	free(w->draw_us);
+	free(w);
+
+	out->render = NULL;
+	out->flip_event = NULL;
+}
+
+unsigned render_queue_depth(struct modeset_out *out)
+{
+	struct render_worker *w = out->render;
+
+	return __atomic_load_n(&w->ready_bufs.tail, __ATOMIC_ACQUIRE) - w->ready_bufs.head;
+}
+
+void render_main_loop(struct modeset_out *list, render_func draw,
+	void (*flip_event)(void *))
+{
+	struct event_loop *loop = event_loop_create();
+
+	for_each_output(out, list)
+		render_start(out, loop, draw, flip_event);
+
+	/* the first flips are started as soon as the first frames are drawn */
+	modeset_run_loop(list, loop);
+
+	for_each_output(out, list)
+		render_stop(out, loop);
+
+	event_loop_destroy(loop);
+}
@@ -0,0 +1,74 @@
+#ifndef _COMMON_RENDER_H_
+#define _COMMON_RENDER_H_
+
+#include <stdbool.h>
+
+#include "common-modeset.h"
+
+/*
+ * Lock-free ring for one producer and one consumer thread. Each side
+ * only writes its own index, with release ordering, so the item is
+ * published together with the index. The indices are on separate
+ * cachelines to keep the two threads from bouncing one line.
+ */
+#define SPSC_QUEUE_SIZE 16	/* power of two */
+
+struct spsc_queue {
+	unsigned head __attribute__((aligned(64)));	/* consumer */
+	unsigned tail __attribute__((aligned(64)));	/* producer */
+	int items[SPSC_QUEUE_SIZE];
+};
+
+static inline bool spsc_queue_push(struct spsc_queue *q, int item)
+{
+	unsigned tail = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+
+	if (tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == SPSC_QUEUE_SIZE)
+		return false;
+
+	q->items[tail % SPSC_QUEUE_SIZE] = item;
+
+	__atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+static inline bool spsc_queue_pop(struct spsc_queue *q, int *item)
+{
+	unsigned head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+
+	if (head == __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE))
+		return false;
+
+	*item = q->items[head % SPSC_QUEUE_SIZE];
+
+	__atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+/*
+ * Draw the next frame into buf, one of out->bufs, and return the damage
+ * since the previous frame drawn for out, at most MODESET_MAX_DAMAGE
+ * rects, or 0 for all of it. The frames are flipped in order, so that is
+ * the frame on screen when buf is flipped to. What to redraw in buf is
+ * up to the callback, buf may hold a much older frame. Called on the
+ * output's render thread, with cpu access to buf already begun.
+ */
+typedef int (*render_func)(struct modeset_out *out, struct framebuffer *buf,
+	struct drm_mode_rect *damage);
+
+/*
+ * Like modeset_main_loop(), but each output gets a render thread that
+ * draws ahead into the free back buffers, and the event thread only
+ * flips the drawn ones. A slow draw on one output then doesn't delay
+ * the flips of the others. The draw times go to out->timing.
+ * flip_event is called after each flip, before the next drawn buffer
+ * is flipped. Drawing ahead needs at least 3 buffers per output.
+ */
+void render_main_loop(struct modeset_out *list, render_func draw,
+	void (*flip_event)(void *));
+/* drawn buffers waiting for a flip, from the flip_event of out */
+unsigned render_queue_depth(struct modeset_out *out);
+
+#endif
@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "common-stats.h"
+
+#define READ_TRIES 1000
+
+static struct stats_page *page;
+static char shm_name[64];
+
+void stats_open(const char *name, struct modeset_out *list)
+{
+	snprintf(shm_name, sizeof(shm_name), "/" STATS_SHM_PREFIX "%d", getpid());
+
+	int fd = shm_open(shm_name, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (fd < 0) {
+		fprintf(stderr, "cannot publish stats: %m\n");
+		return;
+	}
+
+	int r = ftruncate(fd, sizeof(struct stats_page));
+	ASSERT(r == 0);
+
+	page = mmap(NULL, sizeof(struct stats_page), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	ASSERT(page != MAP_FAILED);
+
+	close(fd);
+
+	/* the path of argv[0] doesn't fit, and drmtop has no use for it */
+	const char *base = strrchr(name, '/');
+
+	snprintf(page->name, sizeof(page->name), "%s", base ? base + 1 : name);
+	page->pid = getpid();
+	page->version = STATS_VERSION;
+
+	for_each_output(out, list) {
+		if (page->num_outputs == STATS_MAX_OUTPUTS)
+			break;
+
+		struct stats_output *so = &page->outputs[page->num_outputs++];
+
+		so->output_id = out->output_id;
+		so->width = out->mode.hdisplay;
+		so->height = out->mode.vdisplay;
+		so->vrefresh = out->mode.vrefresh;
+		so->num_buffers = out->num_buffers;
+
+		out->stats = so;
+	}
+
+	/* readers check the magic last */
+	__atomic_store_n(&page->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+}
+
+void stats_close(struct modeset_out *list)
+{
+	if (!page)
+		return;
+
+	for_each_output(out, list)
+		out->stats = NULL;
+
+	munmap(page, sizeof(struct stats_page));
+	shm_unlink(shm_name);
+
+	page = NULL;
+}
+
+static void write_begin(struct stats_output *so)
+{
+	__atomic_store_n(&so->seq, so->seq + 1, __ATOMIC_RELAXED);
+	/* the odd seq is seen before any of the new values */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void write_end(struct stats_output *so)
+{
+	__atomic_store_n(&so->seq, so->seq + 1, __ATOMIC_RELEASE);
+}
+
+void stats_publish_frame(struct modeset_out *out, unsigned queue_depth, unsigned dropped)
+{
+	struct stats_output *so = out->stats;
+	const struct frame_timing *t = &out->timing;
+
+	if (!so)
+		return;
+
+	write_begin(so);
+
+	so->queue_depth = queue_depth;
+	so->flips++;
+	so->missed += t->last_missed;
+	so->dropped += dropped;
+	so->vblank_us = t->vblank_us;
+
+	write_end(so);
+}
+
+static void snapshot_hist(struct stats_hist *sh, const struct histogram *h)
+{
+	sh->p50_us = hist_percentile(h, 50);
+	sh->p90_us = hist_percentile(h, 90);
+	sh->p99_us = hist_percentile(h, 99);
+	sh->p999_us = hist_percentile(h, 99.9);
+	sh->max_us = h->max;
+}
+
+void stats_publish_interval(struct modeset_out *out)
+{
+	struct stats_output *so = out->stats;
+	const struct frame_timing *t = &out->timing;
+
+	if (!so)
+		return;
+
+	/* the percentiles outside of the seqlock, to keep it short */
+	struct stats_hist flip_interval, draw, latency;
+
+	snapshot_hist(&flip_interval, &t->flip_interval);
+	snapshot_hist(&draw, &t->draw);
+	snapshot_hist(&latency, &t->latency);
+
+	write_begin(so);
+
+	so->fps_milli = t->flip_interval.total ?
+		t->flip_interval.count * 1000000000ull / t->flip_interval.total : 0;
+	so->flip_interval = flip_interval;
+	so->draw = draw;
+	so->latency = latency;
+
+	write_end(so);
+}
+
+bool stats_read_output(const struct stats_output *so, struct stats_output *copy)
+{
+	for (int i = 0; i < READ_TRIES; ++i) {
+		uint32_t seq = __atomic_load_n(&so->seq, __ATOMIC_ACQUIRE);
+
+		if (seq & 1)
+			continue;
+
+		*copy = *so;
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		if (__atomic_load_n(&so->seq, __ATOMIC_RELAXED) == seq)
+			return true;
+	}
+
+	return false;
+}
@@ -0,0 +1,76 @@
+#ifndef _COMMON_STATS_H_
+#define _COMMON_STATS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "common-modeset.h"
+
+/*
+ * Live stats of a running tool, in POSIX shared memory at
+ * /drm-stats-<pid>, for drmtop to show. Each output has its own
+ * cacheline-aligned block, written with plain stores on the event
+ * thread and guarded by a seqlock: seq is odd while the block is being
+ * written, a reader retries if seq was odd or changed while it copied.
+ */
+#define STATS_SHM_PREFIX "drm-stats-"
+#define STATS_MAGIC 0x54534d44		/* "DMST" */
+#define STATS_VERSION 1
+#define STATS_MAX_OUTPUTS 16
+
+/* percentiles of the last measure interval */
+struct stats_hist {
+	uint32_t p50_us, p90_us, p99_us, p999_us, max_us;
+};
+
+struct stats_output {
+	uint32_t seq;
+
+	uint32_t output_id;
+	uint32_t width, height;
+	uint32_t vrefresh;
+	uint32_t num_buffers;
+
+	/* every flip */
+	uint32_t queue_depth;		/* frames drawn and waiting for a flip */
+	uint64_t flips;			/* since start */
+	uint64_t missed;		/* vblanks, since start */
+	uint64_t dropped;		/* frames never shown, since start */
+	uint64_t vblank_us;		/* of the last flip, CLOCK_MONOTONIC */
+
+	/* every measure interval */
+	uint32_t fps_milli;
+	struct stats_hist flip_interval;
+	struct stats_hist draw;
+	struct stats_hist latency;
+} __attribute__((aligned(64)));
+
+struct stats_page {
+	uint32_t magic;
+	uint32_t version;
+	pid_t pid;
+	char name[32];			/* of the tool */
+	uint32_t num_outputs;
+	struct stats_output outputs[STATS_MAX_OUTPUTS];
+};
+
+/*
+ * Publish the outputs of list, as out->stats. Without shared memory
+ * the tool runs unpublished.
+ */
+void stats_open(const char *name, struct modeset_out *list);
+void stats_close(struct modeset_out *list);
+
+/* from the flip event of out, after the flip, no-ops if not published */
+void stats_publish_frame(struct modeset_out *out, unsigned queue_depth, unsigned dropped);
+/* the stats of out->timing, to be called before timing_report() */
+void stats_publish_interval(struct modeset_out *out);
+
+/*
+ * Consistent copy of an output block of a page mapped by a reader,
+ * false if the writer kept changing it, or died while writing it.
+ */
+bool stats_read_output(const struct stats_output *so, struct stats_output *copy);
+
+#endif
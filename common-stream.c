@@ -0,0 +1,201 @@
+#include <string.h>
+
+#include "common-stream.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define HAVE_STREAM_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define HAVE_STREAM_NEON
+#endif
+
+/* bytes written one at a time to reach 'align' or to finish */
+static inline size_t head_bytes(const void *p, size_t align, size_t size)
+{
+	size_t head = -(uintptr_t)p & (align - 1);
+
+	return head < size ? head : size;
+}
+
+#if defined(HAVE_STREAM_SSE2)
+
+void stream_copy(void *dst, const void *src, size_t size)
+{
+	uint8_t *d = dst;
+	const uint8_t *s = src;
+	size_t head = head_bytes(d, 16, size);
+
+	memcpy(d, s, head);
+	d += head;
+	s += head;
+	size -= head;
+
+	for (; size >= 64; size -= 64, d += 64, s += 64) {
+		__m128i a = _mm_loadu_si128((const __m128i *)s + 0);
+		__m128i b = _mm_loadu_si128((const __m128i *)s + 1);
+		__m128i c = _mm_loadu_si128((const __m128i *)s + 2);
+		__m128i e = _mm_loadu_si128((const __m128i *)s + 3);
+
+		_mm_stream_si128((__m128i *)d + 0, a);
+		_mm_stream_si128((__m128i *)d + 1, b);
+		_mm_stream_si128((__m128i *)d + 2, c);
+		_mm_stream_si128((__m128i *)d + 3, e);
+	}
+
+	for (; size >= 16; size -= 16, d += 16, s += 16)
+		_mm_stream_si128((__m128i *)d, _mm_loadu_si128((const __m128i *)s));
+
+	memcpy(d, s, size);
+}
+
+void stream_fill32(void *dst, uint32_t pattern, size_t size)
+{
+	uint8_t *d = dst;
+	size_t head = head_bytes(d, 16, size);
+	__m128i v;
+
+	/* keep the pattern in phase with dst when writing the head */
+	for (size_t i = 0; i < head; ++i)
+		d[i] = pattern >> (8 * (i & 3));
+
+	pattern = pattern >> (8 * (head & 3)) | (uint64_t)pattern << (32 - 8 * (head & 3));
+	v = _mm_set1_epi32(pattern);
+
+	d += head;
+	size -= head;
+
+	for (; size >= 64; size -= 64, d += 64) {
+		_mm_stream_si128((__m128i *)d + 0, v);
+		_mm_stream_si128((__m128i *)d + 1, v);
+		_mm_stream_si128((__m128i *)d + 2, v);
+		_mm_stream_si128((__m128i *)d + 3, v);
+	}
+
+	for (; size >= 16; size -= 16, d += 16)
+		_mm_stream_si128((__m128i *)d, v);
+
+	for (size_t i = 0; i < size; ++i)
+		d[i] = pattern >> (8 * (i & 3));
+}
+
+void stream_flush(void)
+{
+	_mm_sfence();
+}
+
+const char *stream_store_name(void)
+{
+	return "sse2 non-temporal";
+}
+
+#elif defined(HAVE_STREAM_NEON)
+
+/*
+ * aarch64 has a non-temporal store pair, STNP, with no intrinsic. 32-bit
+ * ARM has none, there whole cachelines are written with ordinary stores,
+ * which still fill the WC buffers as full lines.
+ */
+#if defined(__aarch64__)
+static inline void store_line(uint8_t *d, uint8x16_t a, uint8x16_t b, uint8x16_t c,
+	uint8x16_t e)
+{
+	__asm__ __volatile__(
+		"stnp %q1, %q2, [%0]\n\t"
+		"stnp %q3, %q4, [%0, #32]"
+		:: "r"(d), "w"(a), "w"(b), "w"(c), "w"(e)
+		: "memory");
+}
+#else
+static inline void store_line(uint8_t *d, uint8x16_t a, uint8x16_t b, uint8x16_t c,
+	uint8x16_t e)
+{
+	vst1q_u8(d + 0, a);
+	vst1q_u8(d + 16, b);
+	vst1q_u8(d + 32, c);
+	vst1q_u8(d + 48, e);
+}
+#endif
+
+void stream_copy(void *dst, const void *src, size_t size)
+{
+	uint8_t *d = dst;
+	const uint8_t *s = src;
+	size_t head = head_bytes(d, 64, size);
+
+	memcpy(d, s, head);
+	d += head;
+	s += head;
+	size -= head;
+
+	/* a whole cacheline per iteration */
+	for (; size >= 64; size -= 64, d += 64, s += 64) {
+		store_line(d, vld1q_u8(s + 0), vld1q_u8(s + 16), vld1q_u8(s + 32),
+			vld1q_u8(s + 48));
+	}
+
+	memcpy(d, s, size);
+}
+
+void stream_fill32(void *dst, uint32_t pattern, size_t size)
+{
+	uint8_t *d = dst;
+	size_t head = head_bytes(d, 64, size);
+	uint8x16_t v;
+
+	for (size_t i = 0; i < head; ++i)
+		d[i] = pattern >> (8 * (i & 3));
+
+	pattern = pattern >> (8 * (head & 3)) | (uint64_t)pattern << (32 - 8 * (head & 3));
+	v = vreinterpretq_u8_u32(vdupq_n_u32(pattern));
+
+	d += head;
+	size -= head;
+
+	for (; size >= 64; size -= 64, d += 64)
+		store_line(d, v, v, v, v);
+
+	for (size_t i = 0; i < size; ++i)
+		d[i] = pattern >> (8 * (i & 3));
+}
+
+void stream_flush(void)
+{
+	__asm__ __volatile__("dmb ishst" ::: "memory");
+}
+
+const char *stream_store_name(void)
+{
+#if defined(__aarch64__)
+	return "aarch64 stnp non-temporal";
+#else
+	return "neon ordinary";
+#endif
+}
+
+#else
+
+void stream_copy(void *dst, const void *src, size_t size)
+{
+	memcpy(dst, src, size);
+}
+
+void stream_fill32(void *dst, uint32_t pattern, size_t size)
+{
+	uint8_t *d = dst;
+
+	for (size_t i = 0; i < size; ++i)
+		d[i] = pattern >> (8 * (i & 3));
+}
+
+void stream_flush(void)
+{
+	__sync_synchronize();
+}
+
+const char *stream_store_name(void)
+{
+	return "ordinary";
+}
+
+#endif
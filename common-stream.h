@@ -0,0 +1,23 @@
+#ifndef _COMMON_STREAM_H_
+#define _COMMON_STREAM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Writers for write-combined or uncached memory, like mapped dumb
+ * buffers. The data is written with non-temporal stores (SSE2, aarch64
+ * STNP) or, on 32-bit NEON which has none, with ordinary stores in whole
+ * cacheline bursts, so WC buffers are flushed as full lines. Sources
+ * should be cache resident, e.g. a line composed on the stack.
+ *
+ * stream_flush() orders the writes before the buffer is handed to
+ * another thread or to the display.
+ */
+void stream_copy(void *dst, const void *src, size_t size);
+void stream_fill32(void *dst, uint32_t pattern, size_t size);
+void stream_flush(void);
+/* the kind of stores used, for reports */
+const char *stream_store_name(void);
+
+#endif
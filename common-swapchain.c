@@ -0,0 +1,253 @@
+#include "common.h"
+#include "common-swapchain.h"
+#include "common-drawing.h"
+
+enum buf_state {
+	BUF_FREE,
+	BUF_ACQUIRED,
+	BUF_QUEUED,
+	BUF_FLIPPING,
+	BUF_FRONT,
+};
+
+struct swap_buf {
+	enum buf_state state;
+	uint64_t present_us;
+
+	/* against the frame shown before this one, 0 rects for all of it */
+	struct drm_mode_rect damage[MODESET_MAX_DAMAGE];
+	int num_damage;
+};
+
+struct swapchain {
+	struct modeset_out *out;
+	enum swapchain_mode mode;
+
+	int num_bufs;
+	struct swap_buf *bufs;
+	int next_acquire;	/* acquire round robin, for a predictable buffer age */
+
+	/* presented buffers waiting for a flip, one at most unless fifo */
+	int *queue;
+	int queue_head;
+	int queue_len;
+
+	int flipping;		/* -1 if no flip is pending */
+
+	struct swapchain_stats stats;
+};
+
+static const char *mode_names[] = {
+	[SWAPCHAIN_FIFO] = "fifo",
+	[SWAPCHAIN_MAILBOX] = "mailbox",
+	[SWAPCHAIN_IMMEDIATE] = "immediate",
+};
+
+const char *swapchain_mode_name(enum swapchain_mode mode)
+{
+	return mode_names[mode];
+}
+
+bool swapchain_find_mode(const char *name, enum swapchain_mode *mode)
+{
+	for (int i = 0; i < ARRAY_SIZE(mode_names); ++i) {
+		if (strcmp(name, mode_names[i]) == 0) {
+			*mode = i;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+struct swapchain *swapchain_create(struct modeset_out *out, enum swapchain_mode mode)
+{
+	struct swapchain *sc = calloc(1, sizeof(*sc));
+	ASSERT(sc);
+
+	if (mode == SWAPCHAIN_IMMEDIATE) {
+		uint64_t cap;
+
+		if (drmGetCap(out->fd, DRM_CAP_ASYNC_PAGE_FLIP, &cap) != 0 || !cap) {
+			fprintf(stderr, "no async page flips on output %u, using mailbox\n",
+				out->output_id);
+			mode = SWAPCHAIN_MAILBOX;
+		}
+	}
+
+	sc->out = out;
+	sc->mode = mode;
+	sc->num_bufs = out->num_buffers;
+	sc->flipping = -1;
+
+	sc->bufs = calloc(sc->num_bufs, sizeof(*sc->bufs));
+	sc->queue = calloc(sc->num_bufs, sizeof(*sc->queue));
+	ASSERT(sc->bufs && sc->queue);
+
+	sc->bufs[out->front_buf].state = BUF_FRONT;
+	sc->next_acquire = (out->front_buf + 1) % sc->num_bufs;
+
+	return sc;
+}
+
+void swapchain_destroy(struct swapchain *sc)
+{
+	free(sc->queue);
+	free(sc->bufs);
+	free(sc);
+}
+
+enum swapchain_mode swapchain_get_mode(struct swapchain *sc)
+{
+	return sc->mode;
+}
+
+static int buf_index(struct swapchain *sc, struct framebuffer *fb)
+{
+	int idx = fb - sc->out->bufs;
+
+	ASSERT(idx >= 0 && idx < sc->num_bufs);
+
+	return idx;
+}
+
+struct framebuffer *swapchain_acquire(struct swapchain *sc)
+{
+	for (int i = 0; i < sc->num_bufs; ++i) {
+		int idx = (sc->next_acquire + i) % sc->num_bufs;
+
+		if (sc->bufs[idx].state != BUF_FREE)
+			continue;
+
+		sc->bufs[idx].state = BUF_ACQUIRED;
+		sc->next_acquire = (idx + 1) % sc->num_bufs;
+
+		return &sc->out->bufs[idx];
+	}
+
+	return NULL;
+}
+
+void swapchain_release(struct swapchain *sc, struct framebuffer *fb)
+{
+	int idx = buf_index(sc, fb);
+
+	ASSERT(sc->bufs[idx].state == BUF_ACQUIRED);
+
+	sc->bufs[idx].state = BUF_FREE;
+}
+
+static void flip_next(struct swapchain *sc)
+{
+	struct modeset_out *out = sc->out;
+
+	if (sc->flipping >= 0 || sc->queue_len == 0)
+		return;
+
+	int idx = sc->queue[sc->queue_head];
+	struct swap_buf *buf = &sc->bufs[idx];
+
+	sc->queue_head = (sc->queue_head + 1) % sc->num_bufs;
+	sc->queue_len--;
+
+	if (buf->num_damage)
+		modeset_set_damage(out, buf->damage, buf->num_damage);
+
+	if (sc->mode == SWAPCHAIN_IMMEDIATE)
+		modeset_flip_fb_async(out, &out->bufs[idx]);
+	else
+		modeset_flip_fb(out, &out->bufs[idx]);
+
+	buf->state = BUF_FLIPPING;
+	sc->flipping = idx;
+}
+
+/*
+ * A frame replacing a dropped one is shown after the frame before that,
+ * so it carries the damage of both. All of it if either is full or the
+ * union doesn't fit.
+ */
+static int merge_damage(struct swap_buf *buf, const struct swap_buf *dropped)
+{
+	int n = buf->num_damage;
+
+	if (!n || !dropped->num_damage)
+		return 0;
+
+	for (int i = 0; i < dropped->num_damage; ++i) {
+		n = damage_add_rect(buf->damage, n, MODESET_MAX_DAMAGE, dropped->damage[i]);
+		if (n < 0)
+			return 0;
+	}
+
+	return n;
+}
+
+void swapchain_present(struct swapchain *sc, struct framebuffer *fb,
+	const struct drm_mode_rect *damage, int num_damage)
+{
+	int idx = buf_index(sc, fb);
+	struct swap_buf *buf = &sc->bufs[idx];
+
+	ASSERT(buf->state == BUF_ACQUIRED);
+	ASSERT(num_damage <= MODESET_MAX_DAMAGE);
+
+	buf->present_us = timing_now_us();
+
+	memcpy(buf->damage, damage, sizeof(*damage) * num_damage);
+	buf->num_damage = num_damage;
+
+	sc->stats.presented++;
+
+	if (sc->mode != SWAPCHAIN_FIFO && sc->queue_len) {
+		int old = sc->queue[sc->queue_head];
+
+		buf->num_damage = merge_damage(buf, &sc->bufs[old]);
+
+		sc->bufs[old].state = BUF_FREE;
+		sc->stats.dropped++;
+
+		sc->queue[sc->queue_head] = idx;
+	} else {
+		sc->queue[(sc->queue_head + sc->queue_len) % sc->num_bufs] = idx;
+		sc->queue_len++;
+	}
+
+	buf->state = BUF_QUEUED;
+
+	flip_next(sc);
+}
+
+void swapchain_flip_done(struct swapchain *sc)
+{
+	struct modeset_out *out = sc->out;
+
+	ASSERT(sc->flipping >= 0);
+
+	struct swap_buf *buf = &sc->bufs[sc->flipping];
+	uint64_t vblank_us = out->timing.vblank_us;
+
+	sc->stats.displayed++;
+	hist_add(&sc->stats.latency, vblank_us > buf->present_us ? vblank_us - buf->present_us : 0);
+
+	sc->bufs[out->front_buf].state = BUF_FREE;
+	buf->state = BUF_FRONT;
+	out->front_buf = sc->flipping;
+
+	sc->flipping = -1;
+
+	flip_next(sc);
+}
+
+unsigned swapchain_queue_depth(struct swapchain *sc)
+{
+	return sc->queue_len;
+}
+
+void swapchain_get_stats(struct swapchain *sc, struct swapchain_stats *stats, bool reset)
+{
+	*stats = sc->stats;
+
+	if (reset)
+		memset(&sc->stats, 0, sizeof(sc->stats));
+}
@@ -0,0 +1,61 @@
+#ifndef _COMMON_SWAPCHAIN_H_
+#define _COMMON_SWAPCHAIN_H_
+
+#include <stdbool.h>
+
+#include "common-modeset.h"
+
+/*
+ * Swapchain over the buffers of an output, any number of them. Buffers
+ * are acquired for drawing, and presented or released back. How the
+ * presented buffers reach the screen depends on the mode:
+ *
+ * fifo: each frame is shown, one per vblank, in order.
+ * mailbox: the latest frame replaces one still waiting to be shown,
+ *   for the lowest latency. Needs 4 buffers to draw without waiting.
+ * immediate: like mailbox, but flipped without waiting for vblank, for
+ *   the maximum rate. Falls back to mailbox if the driver can't.
+ */
+enum swapchain_mode {
+	SWAPCHAIN_FIFO,
+	SWAPCHAIN_MAILBOX,
+	SWAPCHAIN_IMMEDIATE,
+};
+
+struct swapchain_stats {
+	uint64_t presented;
+	uint64_t displayed;
+	uint64_t dropped;		/* replaced before they were shown */
+	/* from present to the vblank it was shown at, of the displayed frames */
+	struct histogram latency;
+};
+
+struct swapchain;
+
+/* the current front buffer of out stays on screen */
+struct swapchain *swapchain_create(struct modeset_out *out, enum swapchain_mode mode);
+void swapchain_destroy(struct swapchain *sc);
+enum swapchain_mode swapchain_get_mode(struct swapchain *sc);
+
+/* a buffer to draw into, NULL if all are in use */
+struct framebuffer *swapchain_acquire(struct swapchain *sc);
+/*
+ * damage is what changed since the previously presented frame, or 0 rects
+ * for all of it. Frames dropped in between are accounted for.
+ */
+void swapchain_present(struct swapchain *sc, struct framebuffer *fb,
+	const struct drm_mode_rect *damage, int num_damage);
+/* give an acquired buffer back without presenting it */
+void swapchain_release(struct swapchain *sc, struct framebuffer *fb);
+/* to be called from the flip event of the output */
+void swapchain_flip_done(struct swapchain *sc);
+/* presented buffers waiting for a flip */
+unsigned swapchain_queue_depth(struct swapchain *sc);
+
+void swapchain_get_stats(struct swapchain *sc, struct swapchain_stats *stats, bool reset);
+
+const char *swapchain_mode_name(enum swapchain_mode mode);
+/* mode for a name like "fifo", false if there's no such mode */
+bool swapchain_find_mode(const char *name, enum swapchain_mode *mode);
+
+#endif
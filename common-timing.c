@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "common.h"
+#include "common-timing.h"
+
+/* values up to 2^32 us, larger ones go to the last bucket */
+static int bucket_index(uint64_t v)
+{
+	if (v < HIST_SUB_COUNT)
+		return v;
+
+	if (v >> 32)
+		return HIST_NUM_BUCKETS - 1;
+
+	int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+
+	return (shift + 1) * HIST_SUB_COUNT + (v >> shift) - HIST_SUB_COUNT;
+}
+
+static uint64_t bucket_mid(int idx)
+{
+	if (idx < HIST_SUB_COUNT)
+		return idx;
+
+	int shift = idx / HIST_SUB_COUNT - 1;
+	uint64_t low = (uint64_t)(idx % HIST_SUB_COUNT + HIST_SUB_COUNT) << shift;
+
+	return low + (1ull << shift) / 2;
+}
+
+void hist_reset(struct histogram *h)
+{
+	memset(h, 0, sizeof(*h));
+}
+
+void hist_add(struct histogram *h, uint64_t us)
+{
+	if (h->count == 0 || us < h->min)
+		h->min = us;
+	if (us > h->max)
+		h->max = us;
+
+	h->count++;
+	h->total += us;
+	h->buckets[bucket_index(us)]++;
+}
+
+uint64_t hist_percentile(const struct histogram *h, double p)
+{
+	uint64_t target = h->count * p / 100;
+	uint64_t n = 0;
+
+	if (h->count == 0)
+		return 0;
+
+	for (int i = 0; i < HIST_NUM_BUCKETS; ++i) {
+		n += h->buckets[i];
+
+		if (n <= target)
+			continue;
+
+		uint64_t v = bucket_mid(i);
+
+		/* the extremes are known exactly */
+		if (v < h->min)
+			return h->min;
+		if (v > h->max)
+			return h->max;
+
+		return v;
+	}
+
+	return h->max;
+}
+
+void hist_print(const struct histogram *h, uint32_t output_id, const char *name)
+{
+	if (h->count == 0)
+		return;
+
+	printf("Output %u: %s avg/p50/p90/p99/p99.9/max %.3f/%.3f/%.3f/%.3f/%.3f/%.3f ms\n",
+		output_id, name,
+		(double)h->total / h->count / 1000,
+		hist_percentile(h, 50) / 1000.0,
+		hist_percentile(h, 90) / 1000.0,
+		hist_percentile(h, 99) / 1000.0,
+		hist_percentile(h, 99.9) / 1000.0,
+		h->max / 1000.0);
+}
+
+uint64_t timing_now_us(void)
+{
+	struct timespec ts;
+
+	get_time_now(&ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void timing_flip_submitted(struct frame_timing *t, bool damage)
+{
+	t->submit_us = timing_now_us();
+	t->submit_damage = damage;
+}
+
+void timing_flip_done(struct frame_timing *t, unsigned seq, unsigned sec, unsigned usec)
+{
+	uint64_t vblank_us = (uint64_t)sec * 1000000 + usec;
+
+	/* drivers without vblank timestamps pass 0 */
+	if (!vblank_us)
+		vblank_us = timing_now_us();
+
+	t->last_interval_us = 0;
+	t->last_latency_us = 0;
+	t->last_missed = 0;
+
+	if (t->started) {
+		unsigned vblanks = seq - t->vblank_seq;
+
+		/* async flips may land within the same vblank */
+		if (vblanks > 1)
+			t->last_missed = vblanks - 1;
+
+		t->missed += t->last_missed;
+		t->last_interval_us = vblank_us - t->vblank_us;
+		hist_add(&t->flip_interval, t->last_interval_us);
+	}
+
+	if (t->submit_us) {
+		t->last_latency_us = vblank_us > t->submit_us ? vblank_us - t->submit_us : 0;
+		hist_add(&t->latency, t->last_latency_us);
+	}
+
+	t->started = true;
+	t->vblank_seq = seq;
+	t->vblank_us = vblank_us;
+	t->submit_us = 0;
+
+	if (t->submit_damage)
+		t->damage_flips++;
+
+	t->submit_damage = false;
+
+	t->num_flips++;
+}
+
+void timing_add_draw(struct frame_timing *t, uint64_t us)
+{
+	t->last_draw_us = us;
+	hist_add(&t->draw, us);
+}
+
+void timing_report(struct frame_timing *t, uint32_t output_id)
+{
+	printf("Output %u: %u flips, %llu missed vblanks\n", output_id,
+		t->num_flips, (unsigned long long)t->missed);
+
+	hist_print(&t->flip_interval, output_id, "flip interval");
+	hist_print(&t->draw, output_id, "draw");
+	hist_print(&t->latency, output_id, "flip latency");
+
+	t->num_flips = 0;
+	t->damage_flips = 0;
+	t->missed = 0;
+
+	hist_reset(&t->flip_interval);
+	hist_reset(&t->draw);
+	hist_reset(&t->latency);
+}
@@ -0,0 +1,69 @@
+#ifndef _COMMON_TIMING_H_
+#define _COMMON_TIMING_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Histogram of microsecond values. The buckets are log2 ranges split
+ * into 32 linear sub-buckets each, so the percentiles are within ~3% of
+ * the real values from 1 us to over an hour, in a fixed 3.5 kB.
+ */
+#define HIST_SUB_BITS 5
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_NUM_BUCKETS ((32 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+struct histogram {
+	uint64_t count;
+	uint64_t total;
+	uint64_t min, max;
+	uint32_t buckets[HIST_NUM_BUCKETS];
+};
+
+void hist_reset(struct histogram *h);
+void hist_add(struct histogram *h, uint64_t us);
+/* value below which p percent of the values are, 0 if empty */
+uint64_t hist_percentile(const struct histogram *h, double p);
+/* "Output <id>: <name> avg/p50/p90/p99/p99.9/max" in ms, nothing if empty */
+void hist_print(const struct histogram *h, uint32_t output_id, const char *name);
+
+/*
+ * Frame timing of an output, from the vblank sequence and timestamp the
+ * kernel passes with each flip event. Kept in modeset_out, fed by the
+ * modeset flip functions and flip handler.
+ */
+struct frame_timing {
+	/* since the last report */
+	unsigned num_flips;
+	unsigned damage_flips;		/* of num_flips, those that passed damage */
+	uint64_t missed;		/* vblanks skipped between flips */
+
+	struct histogram flip_interval;
+	struct histogram draw;		/* see timing_add_draw() */
+	struct histogram latency;	/* from the flip ioctl to the vblank */
+
+	/* last flip */
+	bool started;
+	unsigned vblank_seq;
+	uint64_t vblank_us;		/* CLOCK_MONOTONIC */
+	uint64_t submit_us;		/* 0 if no flip is pending */
+	bool submit_damage;		/* the pending flip passed damage */
+	uint32_t last_interval_us;
+	uint32_t last_latency_us;
+	uint32_t last_missed;
+	uint32_t last_draw_us;
+};
+
+/* CLOCK_MONOTONIC in us, the clock of the kernel vblank timestamps */
+uint64_t timing_now_us(void);
+
+/* damage: the flip passed damage to the kernel */
+void timing_flip_submitted(struct frame_timing *t, bool damage);
+/* seq, sec and usec as passed to the page flip handler */
+void timing_flip_done(struct frame_timing *t, unsigned seq, unsigned sec, unsigned usec);
+/* draw time of a frame, by the tools that draw */
+void timing_add_draw(struct frame_timing *t, uint64_t us);
+/* print the stats since the last report, and reset them */
+void timing_report(struct frame_timing *t, uint32_t output_id);
+
+#endif
@@ -1,6 +1,9 @@
 #include <sys/socket.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
+#include <poll.h>
+#include <errno.h>
 
 #include "common.h"
 
@@ -129,3 +132,95 @@ ssize_t sock_fd_read(int sock, void *buf, ssize_t bufsize, int *fd)
 	}
 	return size;
 }
+
+ssize_t sock_fds_write(int sock, void *buf, ssize_t buflen, const int *fds, int num_fds)
+{
+	struct msghdr   msg = { 0 };
+	struct iovec	iov;
+	union {
+		struct cmsghdr  cmsghdr;
+		char		control[CMSG_SPACE(sizeof(int) * SOCK_MAX_FDS)];
+	} cmsgu;
+	struct cmsghdr  *cmsg;
+
+	ASSERT(num_fds <= SOCK_MAX_FDS);
+
+	iov.iov_base = buf;
+	iov.iov_len = buflen;
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	if (num_fds > 0) {
+		msg.msg_control = cmsgu.control;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * num_fds);
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * num_fds);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * num_fds);
+	}
+
+	return sendmsg(sock, &msg, 0);
+}
+
+ssize_t sock_fds_read(int sock, void *buf, ssize_t bufsize, int *fds, int *num_fds)
+{
+	struct msghdr   msg = { 0 };
+	struct iovec	iov;
+	union {
+		struct cmsghdr  cmsghdr;
+		char		control[CMSG_SPACE(sizeof(int) * SOCK_MAX_FDS)];
+	} cmsgu;
+	struct cmsghdr  *cmsg;
+	ssize_t	 size;
+
+	iov.iov_base = buf;
+	iov.iov_len = bufsize;
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsgu.control;
+	msg.msg_controllen = sizeof(cmsgu.control);
+
+	size = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	if (size < 0) {
+		perror("recvmsg");
+		exit(1);
+	}
+
+	*num_fds = 0;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+			fprintf(stderr, "invalid cmsg %d/%d\n",
+				cmsg->cmsg_level, cmsg->cmsg_type);
+			exit(1);
+		}
+
+		*num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * *num_fds);
+	}
+
+	return size;
+}
+
+int fence_wait(int fence_fd, int timeout_ms)
+{
+	struct pollfd pfd = {
+		.fd = fence_fd,
+		.events = POLLIN,
+	};
+	int r;
+
+	do {
+		r = poll(&pfd, 1, timeout_ms);
+	} while (r < 0 && errno == EINTR);
+
+	ASSERT(r >= 0);
+
+	return r;
+}
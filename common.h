@@ -25,4 +25,14 @@ ssize_t sock_fd_write(int sock, void *buf, ssize_t buflen, int fd);
 /* receive fd from another process */
 ssize_t sock_fd_read(int sock, void *buf, ssize_t bufsize, int *fd);
 
+#define SOCK_MAX_FDS 4
+
+/* send a message with up to SOCK_MAX_FDS fds */
+ssize_t sock_fds_write(int sock, void *buf, ssize_t buflen, const int *fds, int num_fds);
+/* receive a message and the fds sent with it, fds has room for SOCK_MAX_FDS */
+ssize_t sock_fds_read(int sock, void *buf, ssize_t bufsize, int *fds, int *num_fds);
+
+/* wait for a sync_file fence, 1 if it signaled, 0 on timeout */
+int fence_wait(int fence_fd, int timeout_ms);
+
 #endif
@@ -5,30 +5,41 @@
 #include <sys/queue.h>
 
 #include "test.h"
+#include "common-event.h"
+#include "common-metrics.h"
+#include "common-stats.h"
 #include "omap-prod-con.h"
 
 #define MAX_QUEUED_BUFS 10
 
 static const bool use_plane = false;
 
+static const unsigned measure_interval = 100;
+
+/* records of each interval, and of each frame too if metrics_frames */
+static struct metrics *metrics;
+static bool metrics_frames;
+
 static struct {
-	int drm_fd;
+	struct modeset_devices devs;
 	int sfd;
 	volatile struct shared_data *sdata;
 } global;
 
+/* a buffer from the producer */
+struct shared_fb {
+	struct framebuffer fb;		/* first, the queues hold &fb */
+	int buf_idx;
+	int in_fence;
+	bool released;
+};
+
 struct received_fb {
 	TAILQ_ENTRY(received_fb) entries;
 	struct framebuffer *fb;
 };
 
 struct flip_data {
-	unsigned num_frames_drawn;
-	struct timespec flip_time;
-	struct timespec draw_start_time;
-
-	uint64_t min_flip_time, max_flip_time;
-
 	TAILQ_HEAD(tailhead, received_fb) fb_list_head;
 	struct framebuffer *current_fb, *queued_fb;
 
@@ -90,35 +101,69 @@ static void update_queue_counts()
 	msync((void *)global.sdata, sizeof(struct shared_data), MS_SYNC);
 }
 
+/* tell the producer it can reuse the buffer once fence (or -1) signals */
+static void release_fb(struct modeset_out *out, struct framebuffer *fb, int fence)
+{
+	struct shared_fb *sfb = (struct shared_fb *)fb;
+
+	struct release_msg msg = {
+		.output_id = out->output_id,
+		.buf_idx = sfb->buf_idx,
+	};
+
+	ssize_t size = sock_fds_write(global.sfd, &msg, sizeof(msg), &fence, fence >= 0);
+	ASSERT(size == sizeof(msg));
+
+	sfb->released = true;
+}
+
 static void queue_page_flip(struct modeset_out *out, struct framebuffer *fb)
 {
 	struct flip_data *priv = out->data;
-	int r;
+	struct shared_fb *sfb = (struct shared_fb *)fb;
+	int out_fence;
 
-	out->pflip_pending = true;
 	priv->queued_fb = fb;
 
-	r = drmModePageFlip(out->fd, out->crtc_id, fb->fb_id, DRM_MODE_PAGE_FLIP_EVENT, out);
-	ASSERT(r == 0);
+	modeset_flip_fb_fenced(out, fb, sfb->in_fence, &out_fence);
+
+	if (sfb->in_fence >= 0) {
+		close(sfb->in_fence);
+		sfb->in_fence = -1;
+	}
+
+	/*
+	 * The out fence signals when the current buffer leaves the screen,
+	 * so the producer can have it back before we see the flip event.
+	 */
+	if (out_fence >= 0) {
+		if (priv->current_fb)
+			release_fb(out, priv->current_fb, out_fence);
+
+		close(out_fence);
+	}
 }
 
 static void queue_plane(struct modeset_out *out, struct framebuffer *fb)
 {
 	struct flip_data *priv = out->data;
-	int r;
 
 	int outw = fb->width * 2 / 3;
 	int outh = fb->height * 2 / 3;
 	int outx = (fb->width - outw) / 2;
 	int outy = (fb->height - outh) / 2;
 
-	r = drmModeSetPlane(out->fd, priv->plane_id, out->crtc_id,
-		fb->fb_id, 0,
-		outx, outy, outw, outh,
-		0 << 16, 0 << 16,
-		fb->width << 16, fb->height << 16);
-	ASSERT(r == 0);
+	struct shared_fb *sfb = (struct shared_fb *)fb;
+
+	if (sfb->in_fence >= 0) {
+		fence_wait(sfb->in_fence, -1);
+		close(sfb->in_fence);
+		sfb->in_fence = -1;
+	}
 
+	modeset_set_plane(out, priv->plane_id, fb, outx, outy, outw, outh);
+
+	timing_flip_submitted(&out->timing, false);
 	out->pflip_pending = true;
 	priv->queued_fb = fb;
 
@@ -129,7 +174,7 @@ static void queue_plane(struct modeset_out *out, struct framebuffer *fb)
 	vbl.request.sequence = 1;
 	vbl.request.signal = (unsigned long)out;
 
-	drmWaitVBlank(global.drm_fd, &vbl);
+	drmWaitVBlank(out->fd, &vbl);
 }
 
 static void modeset_page_flip_event(int fd, unsigned int frame,
@@ -137,7 +182,6 @@ static void modeset_page_flip_event(int fd, unsigned int frame,
 				    void *data)
 {
 	struct modeset_out *out = data;
-	struct timespec now;
 	struct flip_data *priv = out->data;
 
 	//printf("FLIP %d\n", out->output_id);
@@ -148,6 +192,9 @@ static void modeset_page_flip_event(int fd, unsigned int frame,
 
 		//printf("DELETE %d\n", fb->fb_id);
 
+		if (!((struct shared_fb *)fb)->released)
+			release_fb(out, fb, -1);
+
 		r = drmModeRmFB(fb->fd, fb->fb_id);
 		ASSERT(r == 0);
 
@@ -159,58 +206,27 @@ static void modeset_page_flip_event(int fd, unsigned int frame,
 
 	out->pflip_pending = false;
 
+	timing_flip_done(&out->timing, frame, sec, usec);
+
 	if (out->cleanup)
 		return;
 
-	get_time_now(&now);
+	unsigned queue_depth = count_queued_fbs(priv);
 
-	/* initialize values on first flip */
-	if (priv->num_frames_drawn == 0) {
-		priv->min_flip_time = UINT64_MAX;
-		priv->max_flip_time = 0;
-		priv->draw_start_time = now;
-		priv->flip_time = now;
-	}
-
-	/* measure min/max flip time */
-	if (priv->num_frames_drawn > 0) {
-		uint64_t us;
-
-		us = get_time_elapsed_us(&priv->flip_time, &now);
-
-		priv->flip_time = now;
-
-		if (us < priv->min_flip_time)
-			priv->min_flip_time = us;
-
-		if (us > priv->max_flip_time)
-			priv->max_flip_time = us;
-	}
+	stats_publish_frame(out, queue_depth, 0);
 
-	const int measure_interval = 100;
+	if (metrics_frames)
+		metrics_write_frame(metrics, out, queue_depth, 0);
 
-	if (priv->num_frames_drawn > 0 &&
-		priv->num_frames_drawn % measure_interval == 0) {
-		uint64_t us;
-		float flip_avg;
+	if (out->timing.num_flips == measure_interval) {
+		stats_publish_interval(out);
 
-		us = get_time_elapsed_us(&priv->draw_start_time, &now);
-		flip_avg = (float)us / measure_interval / 1000;
+		if (metrics)
+			metrics_write_interval(metrics, out, 0);
 
-		printf("Output %u: flip avg/min/max %f/%f/%f\n",
-			out->output_id,
-			flip_avg,
-			priv->min_flip_time / 1000.0,
-			priv->max_flip_time / 1000.0);
-
-		priv->draw_start_time = now;
-
-		priv->min_flip_time = UINT64_MAX;
-		priv->max_flip_time = 0;
+		timing_report(&out->timing, out->output_id);
 	}
 
-	priv->num_frames_drawn += 1;
-
 	if (TAILQ_EMPTY(&priv->fb_list_head))
 		return;
 
@@ -228,28 +244,18 @@ static void modeset_page_flip_event(int fd, unsigned int frame,
 	update_queue_counts();
 }
 
-static void init_drm()
-{
-	const char *card = "/dev/dri/card0";
-
-	global.drm_fd = drm_open_dev_dumb(card);
-}
-
-static void uninit_drm()
+static struct framebuffer *receive_fb(int sfd, int *output_id)
 {
-	close(global.drm_fd);
-}
-
-static void receive_fb(int sfd, int *output_id, struct framebuffer *fb)
-{
-	char buf[16];
-	int prime_fd;
+	struct buf_msg msg;
+	int fds[SOCK_MAX_FDS];
+	int num_fds;
 	int r;
 
-	size_t size = sock_fd_read(sfd, buf, sizeof(buf), &prime_fd);
-	ASSERT(size == 1);
+	size_t size = sock_fds_read(sfd, &msg, sizeof(msg), fds, &num_fds);
+	ASSERT(size == sizeof(msg));
+	ASSERT(num_fds == 1 + !!msg.has_fence);
 
-	*output_id = buf[0];
+	*output_id = msg.output_id;
 
 	struct modeset_out *out = find_output(modeset_list, *output_id);
 	ASSERT(out);
@@ -259,18 +265,30 @@ static void receive_fb(int sfd, int *output_id, struct framebuffer *fb)
 
 	ASSERT(w != 0 && h != 0);
 
-	r = drmPrimeFDToHandle(global.drm_fd, prime_fd, &fb->planes[0].handle);
+	struct shared_fb *sfb = calloc(1, sizeof(*sfb));
+	ASSERT(sfb);
+
+	struct framebuffer *fb = &sfb->fb;
+
+	sfb->buf_idx = msg.buf_idx;
+	sfb->in_fence = msg.has_fence ? fds[1] : -1;
+
+	int prime_fd = fds[0];
+
+	/* imported into the output's device, which may not be the producer's */
+	r = drmPrimeFDToHandle(out->fd, prime_fd, &fb->planes[0].handle);
 	ASSERT(r == 0);
 
-	fb->fd = global.drm_fd;
+	fb->fd = out->fd;
 	fb->num_planes = 1;
+	fb->planes[0].dmabuf_fd = -1;
 
 	fb->width = w;
 	fb->height = h;
 	fb->planes[0].stride = fb->width * 32 / 8;
 	fb->planes[0].size = fb->planes[0].stride * fb->height;
 
-	r = drmModeAddFB(global.drm_fd, fb->width, fb->height, 24, 32, fb->planes[0].stride,
+	r = drmModeAddFB(out->fd, fb->width, fb->height, 24, 32, fb->planes[0].stride,
 		   fb->planes[0].handle, &fb->fb_id);
 	ASSERT(r == 0);
 
@@ -278,79 +296,66 @@ static void receive_fb(int sfd, int *output_id, struct framebuffer *fb)
 
 	r = close(prime_fd);
 	ASSERT(r == 0);
+
+	return fb;
 }
 
-static void main_loop(int sfd)
+static void socket_event(int sfd, void *data)
 {
-	printf("reading...\n");
-
-	drmEventContext ev = {
-		.version = DRM_EVENT_CONTEXT_VERSION,
-		.page_flip_handler = modeset_page_flip_event,
-		.vblank_handler = modeset_page_flip_event,
-	};
-
-	update_queue_counts();
-
-	fd_set fds;
-
-	FD_ZERO(&fds);
-
-	int drm_fd = global.drm_fd;
+	struct framebuffer *fb;
+	int output_id;
 
-	int count = 0;
+	fb = receive_fb(sfd, &output_id);
 
-	while (true) {
-		int r;
+	//printf("received fb, for output %d, handle %x\n", output_id, fb->handle);
 
-		FD_SET(0, &fds);
-		FD_SET(drm_fd, &fds);
-		FD_SET(sfd, &fds);
+	struct modeset_out *out = find_output(modeset_list, output_id);
+	struct flip_data *priv = out->data;
+	ASSERT(out);
 
-		int max_fd = sfd > drm_fd ? sfd : drm_fd;
+	if (priv->queued_fb == NULL) {
+		//printf("queue pflip %d\n", out->output_id);
 
-		r = select(max_fd + 1, &fds, NULL, NULL, NULL);
+		if (use_plane) {
+			queue_plane(out, fb);
+		} else {
+			queue_page_flip(out, fb);
+		}
+	} else {
+		enqueue_fb(priv, fb);
+	}
 
-		ASSERT(r >= 0);
+	update_queue_counts();
+}
 
-		if (FD_ISSET(0, &fds)) {
-			fprintf(stderr, "exit due to user-input\n");
-			return;
-		}
+static void main_loop(int sfd)
+{
+	int r;
 
-		if (FD_ISSET(drm_fd, &fds)) {
-			//printf("drm event\n");
-			drmHandleEvent(drm_fd, &ev);
-		}
+	printf("reading...\n");
 
-		if (FD_ISSET(sfd, &fds)) {
-			struct framebuffer *fb = malloc(sizeof(*fb));
-			int output_id;
+	drmEventContext ev = {
+		.version = DRM_EVENT_CONTEXT_VERSION,
+		.page_flip_handler = modeset_page_flip_event,
+		.vblank_handler = modeset_page_flip_event,
+	};
 
-			receive_fb(sfd, &output_id, fb);
+	update_queue_counts();
 
-			//printf("received fb %d, for output %d, handle %x\n", count, output_id, fb->handle);
-			count++;
+	struct event_loop *loop = event_loop_create();
 
-			struct modeset_out *out = find_output(modeset_list, output_id);
-			struct flip_data *priv = out->data;
-			ASSERT(out);
+	for (int i = 0; i < global.devs.num_devs; ++i) {
+		r = event_loop_add_drm(loop, global.devs.fds[i], &ev);
+		ASSERT(r == 0);
+	}
 
-			if (priv->queued_fb == NULL) {
-				//printf("queue pflip %d\n", out->output_id);
+	r = event_loop_add(loop, sfd, socket_event, NULL);
+	ASSERT(r == 0);
+	event_loop_quit_on_input(loop);
 
-				if (use_plane) {
-					queue_plane(out, fb);
-				} else {
-					queue_page_flip(out, fb);
-				}
-			} else {
-				enqueue_fb(priv, fb);
-			}
+	event_loop_run(loop);
 
-			update_queue_counts();
-		}
-	}
+	event_loop_destroy(loop);
 
 	printf("done\n");
 
@@ -366,8 +371,7 @@ static void main_loop(int sfd)
 			out->output_id);
 
 		while (out->pflip_pending) {
-			int r;
-			r = drmHandleEvent(drm_fd, &ev);
+			r = drmHandleEvent(out->fd, &ev);
 			ASSERT(r == 0);
 		}
 	}
@@ -380,6 +384,9 @@ static void setup_config()
 	volatile struct shared_data *sdata = global.sdata;
 
 	for_each_output(out, modeset_list) {
+		/* the outputs of all cards share the producer's table */
+		ASSERT(count < ARRAY_SIZE(sdata->outputs));
+
 		volatile struct shared_output *sout = &sdata->outputs[count++];
 
 		sout->output_id = out->output_id;
@@ -424,49 +431,52 @@ static void open_shared_mem()
 	global.sdata = sdata;
 }
 
-static void find_planes(int fd, struct modeset_out *modeset_list)
+static void find_planes(struct modeset_out *modeset_list)
 {
-	drmModePlaneRes *plane_resources;
-	int cur_plane;
-
-	plane_resources = drmModeGetPlaneResources(fd);
-	ASSERT(plane_resources);
-
-	cur_plane = 0;
-
 	for_each_output(out, modeset_list) {
 		struct flip_data *pdata = out->data;
 
-		for (; cur_plane < plane_resources->count_planes; cur_plane++) {
-			drmModePlane *ovr;
-
-			ovr = drmModeGetPlane(fd, plane_resources->planes[cur_plane]);
-			ASSERT(ovr);
-
-			printf("Output %d: Plane %d\n",
-				out->output_id, ovr->plane_id);
-
-			pdata->plane_id = ovr->plane_id;
+		const struct drm_plane_req req = {
+			.crtc_id = out->crtc_id,
+			.format = DRM_FORMAT_XRGB8888,
+			.modifier = DRM_FORMAT_MOD_LINEAR,
+			.scaling = true,
+		};
 
-			cur_plane++;
+		pdata->plane_id = drm_reserve_plane2(out->fd, &req);
+		ASSERT(pdata->plane_id);
 
-			drmModeFreePlane(ovr);
-
-			break;
-		}
+		printf("Output %d: Plane %d\n",
+			out->output_id, pdata->plane_id);
 	}
-
-	drmModeFreePlaneResources(plane_resources);
 }
 
 int main(int argc, char **argv)
 {
 	int r;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "c:m:M")) != -1) {
+		switch (opt) {
+		case 'c':
+			modeset_add_card(&global.devs, optarg);
+			break;
+		case 'm':
+			metrics = metrics_open(optarg);
+			break;
+		case 'M':
+			metrics_frames = true;
+			break;
+		}
+	}
 
-	init_drm();
+	if (metrics_frames && !metrics) {
+		fprintf(stderr, "-M needs a metrics sink given with -m\n");
+		return 1;
+	}
 
-	// Prepare all connectors and CRTCs
-	modeset_prepare(global.drm_fd, &modeset_list);
+	// open the DRM devices and prepare all connectors and CRTCs
+	modeset_open_devices(&global.devs, &modeset_list);
 
 	// Allocate root buffers
 	modeset_alloc_fbs(modeset_list, 1);
@@ -484,7 +494,7 @@ int main(int argc, char **argv)
 	}
 
 	if (use_plane)
-		find_planes(global.drm_fd, modeset_list);
+		find_planes(modeset_list);
 
 	// Set modes
 	modeset_set_modes(modeset_list);
@@ -497,18 +507,25 @@ int main(int argc, char **argv)
 
 	global.sfd = sfd;
 
+	stats_open(argv[0], modeset_list);
+
 	main_loop(sfd);
 
+	stats_close(modeset_list);
+
 	// Free private data
 	for_each_output(out, modeset_list)
 		free(out->data);
 
+	if (metrics)
+		metrics_close(metrics);
+
 	r = close(sfd);
 	ASSERT(r == 0);
 
 	modeset_cleanup(modeset_list);
 
-	uninit_drm();
+	modeset_close_devices(&global.devs);
 
 	return 0;
 }
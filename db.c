@@ -1,81 +1,147 @@
 
 #include "test.h"
+#include "common-event.h"
+#include "common-metrics.h"
+#include "common-render.h"
+#include "common-stats.h"
+#include "common-swapchain.h"
 
 static const int bar_width = 40;
 static const int bar_speed = 8;
 
+#define MAX_BUFFERS 8
+
 static struct modeset_out *modeset_list = NULL;
 
+/* alternate between full and damage-only updates every interval */
+static bool damage_mode;
+/* draw in the flip handler instead of on per-output render threads */
+static bool draw_inline;
+/* draw in the event loop through a swapchain per output */
+static bool use_swapchain;
+static enum swapchain_mode swapchain_mode;
+
+/* records of each interval, and of each frame too if metrics_frames */
+static struct metrics *metrics;
+static bool metrics_frames;
+
+static const int measure_interval = 100;
+
 struct flip_data {
+	/* on the output's render thread, unless drawing inline */
 	int bar_xpos;
-
+	int buf_xpos[MAX_BUFFERS];	/* bar in each buffer, -1 if none */
 	unsigned num_frames_drawn;
-	struct timespec flip_time;
-	struct timespec draw_start_time;
-	uint64_t draw_total_time;
+	bool use_damage;		/* of the frames drawn now */
 
-	uint64_t min_flip_time, max_flip_time;
+	/* on the event thread */
+	struct swapchain *sc;
+	uint64_t dropped_seen;		/* of the swapchain stats, in this interval */
+	struct histogram submit;	/* time in the flip ioctl, drawing inline */
 };
 
+static int draw_bar(struct modeset_out *out, struct framebuffer *buf,
+	struct drm_mode_rect *damage)
+{
+	struct flip_data *priv = out->data;
+	int *buf_xpos = &priv->buf_xpos[buf - out->bufs];
+	int prev_xpos = priv->num_frames_drawn > 0 ? priv->bar_xpos : -1;
+
+	if (damage_mode && priv->num_frames_drawn > 0 &&
+		priv->num_frames_drawn % measure_interval == 0)
+		priv->use_damage = !priv->use_damage;
+
+	priv->num_frames_drawn += 1;
+
+	priv->bar_xpos = (priv->bar_xpos + bar_speed) % (buf->width - bar_width);
+
+	/* redraw what changed since the frame in this buffer */
+	drm_draw_color_bar(buf, *buf_xpos, priv->bar_xpos, bar_width, NULL);
+
+	*buf_xpos = priv->bar_xpos;
+
+	if (!priv->use_damage)
+		return 0;
+
+	/* but the kernel gets what changed since the previous frame */
+	return drm_color_bar_damage(buf, prev_xpos, priv->bar_xpos, bar_width, damage);
+}
+
 static void page_flip_event(void *data)
 {
 	struct modeset_out *out = data;
-	struct timespec now;
 	struct flip_data *priv = out->data;
 
-	get_time_now(&now);
+	/* frees the old front buffer, and flips to the next presented one */
+	if (priv->sc)
+		swapchain_flip_done(priv->sc);
+
+	unsigned queue_depth = 0, dropped = 0;
 
-	/* initialize values on first flip */
-	if (priv->num_frames_drawn == 0) {
-		priv->min_flip_time = UINT64_MAX;
-		priv->max_flip_time = 0;
-		priv->draw_start_time = now;
-		priv->flip_time = now;
-		priv->draw_total_time = 0;
+	if (priv->sc) {
+		struct swapchain_stats stats;
+
+		swapchain_get_stats(priv->sc, &stats, false);
+
+		queue_depth = swapchain_queue_depth(priv->sc);
+		dropped = stats.dropped - priv->dropped_seen;
+		priv->dropped_seen = stats.dropped;
+	} else if (!draw_inline) {
+		queue_depth = render_queue_depth(out);
 	}
 
-	/* measure min/max flip time */
-	if (priv->num_frames_drawn > 0) {
-		uint64_t us;
+	stats_publish_frame(out, queue_depth, dropped);
 
-		us = get_time_elapsed_us(&priv->flip_time, &now);
+	if (metrics_frames)
+		metrics_write_frame(metrics, out, queue_depth, dropped);
 
-		priv->flip_time = now;
+	if (out->timing.num_flips == measure_interval) {
+		uint64_t us = out->timing.flip_interval.total;
+		struct swapchain_stats stats = { 0 };
 
-		if (us < priv->min_flip_time)
-			priv->min_flip_time = us;
+		if (priv->sc) {
+			swapchain_get_stats(priv->sc, &stats, true);
+			priv->dropped_seen = 0;
+		}
 
-		if (us > priv->max_flip_time)
-			priv->max_flip_time = us;
-	}
+		stats_publish_interval(out);
 
-	const int measure_interval = 100;
+		if (metrics)
+			metrics_write_interval(metrics, out, stats.dropped);
 
-	if (priv->num_frames_drawn > 0 &&
-		priv->num_frames_drawn % measure_interval == 0) {
-		uint64_t us;
-		float flip_avg, draw_avg;
+		/* drawing runs ahead, so count what the flipped frames passed */
+		if (damage_mode) {
+			unsigned n = out->timing.damage_flips;
 
-		us = get_time_elapsed_us(&priv->draw_start_time, &now);
-		flip_avg = (float)us / measure_interval / 1000;
+			printf("Output %u: %s updates, %u of %u flips with damage\n",
+				out->output_id,
+				n == 0 ? "full" : n == out->timing.num_flips ? "damage" : "mixed",
+				n, out->timing.num_flips);
+		}
 
-		draw_avg = (float)priv->draw_total_time / measure_interval / 1000;
+		timing_report(&out->timing, out->output_id);
 
-		printf("Output %u: draw %f ms, flip avg/min/max %f/%f/%f\n",
-			out->output_id,
-			draw_avg,
-			flip_avg,
-			priv->min_flip_time / 1000.0,
-			priv->max_flip_time / 1000.0);
+		hist_print(&priv->submit, out->output_id, "submit");
+		hist_reset(&priv->submit);
 
-		priv->draw_start_time = now;
-		priv->draw_total_time = 0;
+		if (priv->sc) {
+			printf("Output %u: %s, presented %f fps, dropped %llu\n",
+				out->output_id,
+				swapchain_mode_name(swapchain_get_mode(priv->sc)),
+				us ? stats.presented * 1000000.0 / us : 0,
+				(unsigned long long)stats.dropped);
 
-		priv->min_flip_time = UINT64_MAX;
-		priv->max_flip_time = 0;
+			hist_print(&stats.latency, out->output_id, "present latency");
+		}
 	}
 
+	if (!draw_inline)
+		return;
+
 	/* draw */
+	struct drm_mode_rect damage[MODESET_MAX_DAMAGE];
+	int num_damage;
+
 	{
 		/* back buffer */
 		struct framebuffer *buf = &out->bufs[(out->front_buf + 1) % out->num_buffers];
@@ -84,64 +150,226 @@ static void page_flip_event(void *data)
 
 		get_time_now(&ts1);
 
-		int old_xpos = (priv->bar_xpos + (buf->width - bar_width - bar_speed)) %
-			(buf->width - bar_width);
+		num_damage = draw_bar(out, buf, damage);
+
+		get_time_now(&ts2);
+
+		timing_add_draw(&out->timing, get_time_elapsed_us(&ts1, &ts2));
+
+		if (num_damage)
+			modeset_set_damage(out, damage, num_damage);
+	}
+
+	/* flip, including passing the damage to the kernel */
+	{
+		struct timespec ts1, ts2;
 
-		priv->bar_xpos = (priv->bar_xpos + bar_speed) % (buf->width - bar_width);
+		get_time_now(&ts1);
 
-		drm_draw_color_bar(buf, old_xpos, priv->bar_xpos, bar_width);
+		modeset_start_flip(out);
 
 		get_time_now(&ts2);
 
-		priv->draw_total_time += get_time_elapsed_us(&ts1, &ts2);
+		hist_add(&priv->submit, get_time_elapsed_us(&ts1, &ts2));
 	}
+}
 
-	priv->num_frames_drawn += 1;
+/* draw into every free buffer, false once there's none left to draw */
+static bool draw_swapchains(void *data)
+{
+	bool drawn = false;
+
+	for_each_output(out, modeset_list) {
+		struct flip_data *priv = out->data;
+		struct drm_mode_rect damage[MODESET_MAX_DAMAGE];
+		struct framebuffer *buf;
+		struct timespec ts1, ts2;
+		int num_damage;
+
+		/* fifo only has buffers free after flips, the others after each present */
+		buf = swapchain_acquire(priv->sc);
+		if (!buf)
+			continue;
+
+		get_time_now(&ts1);
+
+		drm_fb_begin_cpu_access(buf, DRM_FB_ACCESS_WRITE);
+		num_damage = draw_bar(out, buf, damage);
+		drm_fb_end_cpu_access(buf, DRM_FB_ACCESS_WRITE);
+
+		get_time_now(&ts2);
+
+		timing_add_draw(&out->timing, get_time_elapsed_us(&ts1, &ts2));
+
+		swapchain_present(priv->sc, buf, damage, num_damage);
+
+		drawn = true;
+	}
+
+	return drawn;
+}
+
+/*
+ * Legacy flips can't carry damage, so -d would compare full updates with
+ * full updates there.
+ */
+static bool damage_supported(void)
+{
+	for_each_output(out, modeset_list) {
+		if (!modeset_supports_damage(out)) {
+			fprintf(stderr, "output %u can't pass damage, -d needs the atomic backend and FB_DAMAGE_CLIPS\n",
+				out->output_id);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static void swapchain_main_loop(void)
+{
+	struct event_loop *loop = event_loop_create();
+
+	for_each_output(out, modeset_list) {
+		struct flip_data *priv = out->data;
+
+		priv->sc = swapchain_create(out, swapchain_mode);
+		out->flip_event = page_flip_event;
+	}
+
+	event_loop_set_idle(loop, draw_swapchains, NULL);
+
+	modeset_run_loop(modeset_list, loop);
+
+	for_each_output(out, modeset_list) {
+		struct flip_data *priv = out->data;
+
+		swapchain_destroy(priv->sc);
+		priv->sc = NULL;
+		out->flip_event = NULL;
+	}
 
-	modeset_start_flip(out);
+	event_loop_destroy(loop);
 }
 
 int main(int argc, char **argv)
 {
-	int fd;
+	struct modeset_devices devs = { 0 };
 	int opt;
-	const char *card = "/dev/dri/card0";
+	uint32_t format = DRM_FORMAT_XRGB8888;
+	int num_buffers = 0;
 
-	while ((opt = getopt(argc, argv, "c:")) != -1) {
+	while ((opt = getopt(argc, argv, "b:c:df:im:Ms:")) != -1) {
 		switch (opt) {
 		case 'c':
-			card = optarg;
+			modeset_add_card(&devs, optarg);
+			break;
+		case 'd':
+			damage_mode = true;
+			break;
+		case 'i':
+			draw_inline = true;
+			break;
+		case 's':
+			if (!swapchain_find_mode(optarg, &swapchain_mode)) {
+				fprintf(stderr, "unknown swapchain mode %s\n", optarg);
+				return 1;
+			}
+			use_swapchain = true;
+			break;
+		case 'b':
+			num_buffers = atoi(optarg);
+			if (num_buffers < 2 || num_buffers > MAX_BUFFERS) {
+				fprintf(stderr, "buffers must be 2-%d\n", MAX_BUFFERS);
+				return 1;
+			}
+			break;
+		case 'm':
+			metrics = metrics_open(optarg);
+			break;
+		case 'M':
+			metrics_frames = true;
+			break;
+		case 'f':
+			format = drm_find_format(optarg);
+			if (!format) {
+				fprintf(stderr, "unsupported format %s\n", optarg);
+				return 1;
+			}
 			break;
 		}
 	}
 
-	// open the DRM device
-	fd = drm_open_dev_dumb(card);
+	if (damage_mode && use_swapchain && swapchain_mode == SWAPCHAIN_IMMEDIATE) {
+		fprintf(stderr, "-d needs vsynced flips, async flips don't take damage\n");
+		return 1;
+	}
+
+	if (metrics_frames && !metrics) {
+		fprintf(stderr, "-M needs a metrics sink given with -m\n");
+		return 1;
+	}
+
+	// open the DRM devices and prepare all connectors and CRTCs
+	modeset_open_devices(&devs, &modeset_list);
 
-	// Prepare all connectors and CRTCs
-	modeset_prepare(fd, &modeset_list);
+	// Allocate buffers, a third one to draw ahead on the render threads,
+	// a fourth one for mailbox to never wait for a free one
+	if (draw_inline)
+		num_buffers = 2;
+	else if (!num_buffers)
+		num_buffers = use_swapchain && swapchain_mode != SWAPCHAIN_FIFO ? 4 : 3;
 
-	// Allocate buffers
-	modeset_alloc_fbs(modeset_list, 2);
+	modeset_alloc_fbs2(modeset_list, num_buffers, format);
 
 	// Allocate private data
-	for_each_output(out, modeset_list)
-		out->data = calloc(1, sizeof(struct flip_data));
+	for_each_output(out, modeset_list) {
+		struct flip_data *priv = calloc(1, sizeof(struct flip_data));
+		ASSERT(priv);
+
+		for (int i = 0; i < MAX_BUFFERS; ++i)
+			priv->buf_xpos[i] = -1;
+
+		out->data = priv;
+	}
 
 	// Set modes
 	modeset_set_modes(modeset_list);
 
+	/* after the modeset, the atomic one may have fallen back to legacy */
+	if (damage_mode && !damage_supported()) {
+		for_each_output(out, modeset_list)
+			free(out->data);
+
+		modeset_cleanup(modeset_list);
+		modeset_close_devices(&devs);
+
+		return 1;
+	}
+
+	stats_open(argv[0], modeset_list);
+
 	// Draw color bar
-	modeset_main_loop(modeset_list, &page_flip_event);
+	if (draw_inline)
+		modeset_main_loop(modeset_list, &page_flip_event);
+	else if (use_swapchain)
+		swapchain_main_loop();
+	else
+		render_main_loop(modeset_list, &draw_bar, &page_flip_event);
+
+	stats_close(modeset_list);
 
 	// Free private data
 	for_each_output(out, modeset_list)
 		free(out->data);
 
+	if (metrics)
+		metrics_close(metrics);
+
 	// Free modeset data
 	modeset_cleanup(modeset_list);
 
-	close(fd);
+	modeset_close_devices(&devs);
 
 	fprintf(stderr, "exiting\n");
 
@@ -0,0 +1,203 @@
+#include <dirent.h>
+#include <signal.h>
+#include <sys/stat.h>
+
+#include "test.h"
+#include "common-event.h"
+#include "common-stats.h"
+
+#define MAX_SEEN 64
+
+static bool once;
+
+/* flips of each output at the previous refresh, for the current fps */
+static struct {
+	pid_t pid;
+	uint32_t output_id;
+	uint64_t flips;
+	uint64_t time_us;
+} seen[MAX_SEEN];
+
+static int num_seen;
+
+static double current_fps(pid_t pid, const struct stats_output *so, uint64_t now)
+{
+	double fps = -1;
+	int i;
+
+	for (i = 0; i < num_seen; ++i) {
+		if (seen[i].pid == pid && seen[i].output_id == so->output_id)
+			break;
+	}
+
+	if (i == num_seen) {
+		if (num_seen == MAX_SEEN)
+			return -1;
+
+		num_seen++;
+	} else if (now > seen[i].time_us) {
+		fps = (so->flips - seen[i].flips) * 1000000.0 / (now - seen[i].time_us);
+	}
+
+	seen[i].pid = pid;
+	seen[i].output_id = so->output_id;
+	seen[i].flips = so->flips;
+	seen[i].time_us = now;
+
+	return fps;
+}
+
+static void print_hist(const struct stats_hist *h)
+{
+	char buf[64];
+
+	snprintf(buf, sizeof(buf), "%.2f/%.2f/%.2f",
+		h->p50_us / 1000.0, h->p99_us / 1000.0, h->max_us / 1000.0);
+
+	printf(" %20s", buf);
+}
+
+static void print_output(const struct stats_page *page, const struct stats_output *so, uint64_t now)
+{
+	char mode[32];
+	double fps = current_fps(page->pid, so, now);
+
+	snprintf(mode, sizeof(mode), "%ux%u@%u", so->width, so->height, so->vrefresh);
+
+	printf("%6d %-10.10s %3u %-14s %4u %2u", page->pid, page->name, so->output_id,
+		mode, so->num_buffers, so->queue_depth);
+
+	/* before the first refresh, the fps of the last measure interval */
+	printf(" %7.2f", fps >= 0 ? fps : so->fps_milli / 1000.0);
+
+	printf(" %7llu %7llu", (unsigned long long)so->missed, (unsigned long long)so->dropped);
+
+	print_hist(&so->flip_interval);
+	print_hist(&so->draw);
+	print_hist(&so->latency);
+
+	printf("\n");
+}
+
+static bool show_instance(const char *name, uint64_t now)
+{
+	char path[300];
+	struct stat st;
+	bool shown = false;
+
+	snprintf(path, sizeof(path), "/%s", name);
+
+	int fd = shm_open(path, O_RDONLY, 0);
+	if (fd < 0)
+		return false;
+
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(struct stats_page)) {
+		close(fd);
+		return false;
+	}
+
+	const struct stats_page *page = mmap(NULL, sizeof(*page), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	ASSERT(page != MAP_FAILED);
+
+	/* pages of crashed tools stay behind */
+	if (__atomic_load_n(&page->magic, __ATOMIC_ACQUIRE) != STATS_MAGIC ||
+		page->version != STATS_VERSION ||
+		(kill(page->pid, 0) < 0 && errno == ESRCH))
+		goto out;
+
+	for (unsigned i = 0; i < page->num_outputs && i < STATS_MAX_OUTPUTS; ++i) {
+		struct stats_output so;
+
+		if (!stats_read_output(&page->outputs[i], &so))
+			continue;
+
+		print_output(page, &so, now);
+		shown = true;
+	}
+
+out:
+	munmap((void *)page, sizeof(*page));
+
+	return shown;
+}
+
+static void refresh(int fd, void *data)
+{
+	int num_instances = 0;
+
+	DIR *dir = opendir("/dev/shm");
+	if (!dir) {
+		fprintf(stderr, "cannot open /dev/shm: %m\n");
+		exit(1);
+	}
+
+	/* like top, unless printing once for a log */
+	if (!once)
+		printf("\033[H\033[J");
+
+	printf("%6s %-10s %3s %-14s %4s %2s %7s %7s %7s %20s %20s %20s\n",
+		"PID", "NAME", "OUT", "MODE", "BUFS", "Q", "FPS", "MISSED", "DROPPED",
+		"FLIP p50/p99/max ms", "DRAW p50/p99/max ms", "LAT p50/p99/max ms");
+
+	uint64_t now = timing_now_us();
+	struct dirent *de;
+
+	while ((de = readdir(dir))) {
+		if (strncmp(de->d_name, STATS_SHM_PREFIX, strlen(STATS_SHM_PREFIX)) != 0)
+			continue;
+
+		if (show_instance(de->d_name, now))
+			num_instances++;
+	}
+
+	closedir(dir);
+
+	if (num_instances == 0)
+		printf("no running tools\n");
+
+	fflush(stdout);
+}
+
+static void usage()
+{
+	fprintf(stderr, "usage: drmtop [-d <seconds>] [-n]\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	double delay = 1;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:n")) != -1) {
+		switch (opt) {
+		case 'd':
+			delay = atof(optarg);
+			if (delay <= 0)
+				usage();
+			break;
+		case 'n':
+			once = true;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	refresh(-1, NULL);
+
+	if (once)
+		return 0;
+
+	struct event_loop *loop = event_loop_create();
+
+	event_loop_add_timer(loop, delay * 1000000, refresh, NULL);
+	event_loop_quit_on_input(loop);
+
+	event_loop_run(loop);
+
+	event_loop_destroy(loop);
+
+	return 0;
+}
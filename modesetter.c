@@ -5,23 +5,19 @@ static struct modeset_out *modeset_list = NULL;
 
 int main(int argc, char **argv)
 {
-	int fd;
-	const char *card = "/dev/dri/card0";
+	struct modeset_devices devs = { 0 };
 	int opt;
 
 	while ((opt = getopt(argc, argv, "c:")) != -1) {
 		switch (opt) {
 		case 'c':
-			card = optarg;
+			modeset_add_card(&devs, optarg);
 			break;
 		}
 	}
 
-	// open the DRM device
-	fd = drm_open_dev_dumb(card);
-
-	// Prepare all connectors and CRTCs
-	modeset_prepare(fd, &modeset_list);
+	// open the DRM devices and prepare all connectors and CRTCs
+	modeset_open_devices(&devs, &modeset_list);
 
 	// Allocate buffers
 	modeset_alloc_fbs(modeset_list, 2);
@@ -1,6 +1,9 @@
 #include <omap_drmif.h>
 
 #include "test.h"
+#include "common-metrics.h"
+#include "common-render.h"
+#include "common-stats.h"
 
 static const int bar_width = 40;
 static const int bar_speed = 8;
@@ -15,15 +18,18 @@ struct {
 	struct omap_device *omap_dev;
 } global;
 
-struct flip_data {
-	int bar_xpos;
+#define NUM_BUFFERS 3
+
+static const unsigned measure_interval = 100;
 
-	unsigned num_frames_drawn;
-	struct timespec flip_time;
-	struct timespec draw_start_time;
-	uint64_t draw_total_time;
+/* records of each interval, and of each frame too if metrics_frames */
+static struct metrics *metrics;
+static bool metrics_frames;
 
-	uint64_t min_flip_time, max_flip_time;
+struct flip_data {
+	/* on the output's render thread */
+	int bar_xpos;
+	int buf_xpos[NUM_BUFFERS];	/* bar in each buffer, -1 if none */
 };
 
 static int drm_open_dev_omap(const char *node, struct omap_device **omap_dev)
@@ -41,7 +47,7 @@ static int drm_open_dev_omap(const char *node, struct omap_device **omap_dev)
 static void drm_close_dev_omap(int fd, struct omap_device *omap_dev)
 {
 	omap_device_del(omap_dev);
-	close(fd);
+	drm_close_dev(fd);
 }
 
 struct format_plane_info
@@ -94,6 +100,9 @@ static void create_omap_fb(int fd, struct omap_device *omap_dev,
 	buf->height = height;
 	buf->format = format;
 
+	for (unsigned i = 0; i < ARRAY_SIZE(buf->planes); ++i)
+		buf->planes[i].dmabuf_fd = -1;
+
 	const struct format_info *format_info = find_format(format);
 
 	ASSERT(format_info);
@@ -168,6 +177,8 @@ static void destroy_omap_fb(struct framebuffer *fb)
 {
 	drmModeRmFB(fb->fd, fb->fb_id);
 
+	drm_fb_close_dmabufs(fb);
+
 	for (int i = 0; i < fb->num_planes; ++i) {
 		struct framebuffer_plane *plane = &fb->planes[i];
 
@@ -181,102 +192,71 @@ static void destroy_omap_fb(struct framebuffer *fb)
 	memset(fb, 0, sizeof(*fb));
 }
 
-static void page_flip_event(void *data)
+/* on the output's render thread, with cpu access begun */
+static int draw_bar(struct modeset_out *out, struct framebuffer *buf,
+	struct drm_mode_rect *damage)
 {
-	struct modeset_out *out = data;
-	struct timespec now;
 	struct flip_data *priv = out->data;
+	int *buf_xpos = &priv->buf_xpos[buf - out->bufs];
 
-	get_time_now(&now);
-
-	/* initialize values on first flip */
-	if (priv->num_frames_drawn == 0) {
-		priv->min_flip_time = UINT64_MAX;
-		priv->max_flip_time = 0;
-		priv->draw_start_time = now;
-		priv->flip_time = now;
-		priv->draw_total_time = 0;
-	}
-
-	/* measure min/max flip time */
-	if (priv->num_frames_drawn > 0) {
-		uint64_t us;
-
-		us = get_time_elapsed_us(&priv->flip_time, &now);
-
-		priv->flip_time = now;
-
-		if (us < priv->min_flip_time)
-			priv->min_flip_time = us;
-
-		if (us > priv->max_flip_time)
-			priv->max_flip_time = us;
-	}
-
-	const int measure_interval = 100;
-
-	if (priv->num_frames_drawn > 0 &&
-		priv->num_frames_drawn % measure_interval == 0) {
-		uint64_t us;
-		float flip_avg, draw_avg;
-
-		us = get_time_elapsed_us(&priv->draw_start_time, &now);
-		flip_avg = (float)us / measure_interval / 1000;
-
-		draw_avg = (float)priv->draw_total_time / measure_interval / 1000;
-
-		printf("Output %u: draw %f ms, flip avg/min/max %f/%f/%f\n",
-			out->output_id,
-			draw_avg,
-			flip_avg,
-			priv->min_flip_time / 1000.0,
-			priv->max_flip_time / 1000.0);
+	priv->bar_xpos = (priv->bar_xpos + bar_speed) % (buf->width - bar_width);
 
-		priv->draw_start_time = now;
-		priv->draw_total_time = 0;
+	drm_draw_color_bar(buf, *buf_xpos, priv->bar_xpos, bar_width, NULL);
 
-		priv->min_flip_time = UINT64_MAX;
-		priv->max_flip_time = 0;
-	}
+	*buf_xpos = priv->bar_xpos;
 
-	/* draw */
-	{
-		/* back buffer */
-		struct framebuffer *buf = &out->bufs[(out->front_buf + 1) % out->num_buffers];
+	return 0;
+}
 
-		struct timespec ts1, ts2;
+static void page_flip_event(void *data)
+{
+	struct modeset_out *out = data;
 
-		get_time_now(&ts1);
+	unsigned queue_depth = render_queue_depth(out);
 
-		int old_xpos = (priv->bar_xpos + (buf->width - bar_width - bar_speed)) %
-			(buf->width - bar_width);
+	stats_publish_frame(out, queue_depth, 0);
 
-		priv->bar_xpos = (priv->bar_xpos + bar_speed) % (buf->width - bar_width);
+	if (metrics_frames)
+		metrics_write_frame(metrics, out, queue_depth, 0);
 
-		//omap_bo_cpu_prep(buf->omap_bo, OMAP_GEM_WRITE);
-		drm_draw_color_bar(buf, old_xpos, priv->bar_xpos, bar_width);
-		//omap_bo_cpu_fini(buf->omap_bo, OMAP_GEM_WRITE);
+	if (out->timing.num_flips == measure_interval) {
+		stats_publish_interval(out);
 
-		get_time_now(&ts2);
+		if (metrics)
+			metrics_write_interval(metrics, out, 0);
 
-		priv->draw_total_time += get_time_elapsed_us(&ts1, &ts2);
+		timing_report(&out->timing, out->output_id);
 	}
-
-	priv->num_frames_drawn += 1;
-
-	modeset_start_flip(out);
 }
 
 int main(int argc, char **argv)
 {
+	int opt;
+
+	while ((opt = getopt(argc, argv, "m:M")) != -1) {
+		switch (opt) {
+		case 'm':
+			metrics = metrics_open(optarg);
+			break;
+		case 'M':
+			metrics_frames = true;
+			break;
+		}
+	}
+
+	if (metrics_frames && !metrics) {
+		fprintf(stderr, "-M needs a metrics sink given with -m\n");
+		return 1;
+	}
+
 	// open the DRM device
 	global.drm_fd = drm_open_dev_omap("/dev/dri/card0", &global.omap_dev);
 
 	// Prepare all connectors and CRTCs
 	modeset_prepare(global.drm_fd, &modeset_list);
 
-	// Allocate buffers
-	int num_buffers = 2;
+	// Allocate buffers, a third one to draw ahead on the render threads
+	int num_buffers = NUM_BUFFERS;
 	for_each_output(out, modeset_list) {
 		struct framebuffer *bufs;
 		int i;
@@ -295,19 +275,33 @@ int main(int argc, char **argv)
 	}
 
 	// Allocate private data
-	for_each_output(out, modeset_list)
-		out->data = calloc(1, sizeof(struct flip_data));
+	for_each_output(out, modeset_list) {
+		struct flip_data *priv = calloc(1, sizeof(struct flip_data));
+		ASSERT(priv);
+
+		for (int i = 0; i < NUM_BUFFERS; ++i)
+			priv->buf_xpos[i] = -1;
+
+		out->data = priv;
+	}
 
 	// Set modes
 	modeset_set_modes(modeset_list);
 
+	stats_open(argv[0], modeset_list);
+
 	// Draw color bar
-	modeset_main_loop(modeset_list, &page_flip_event);
+	render_main_loop(modeset_list, &draw_bar, &page_flip_event);
+
+	stats_close(modeset_list);
 
 	// Free private data
 	for_each_output(out, modeset_list)
 		free(out->data);
 
+	if (metrics)
+		metrics_close(metrics);
+
 	// Free modeset data
 	{
 	struct modeset_out *out_list = modeset_list;
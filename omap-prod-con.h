@@ -1,6 +1,8 @@
 #ifndef _OMAP_PROD_CON_H_
 #define _OMAP_PROD_CON_H_
 
+#include <stdint.h>
+
 struct shared_output
 {
 	int output_id;
@@ -15,6 +17,27 @@ struct shared_data
 	struct shared_output outputs[10];
 };
 
+/*
+ * producer -> consumer: a buffer to show, sent with its dma-buf fd and,
+ * if has_fence, a fence that signals when the buffer is ready
+ */
+struct buf_msg
+{
+	uint8_t output_id;
+	uint8_t buf_idx;
+	uint8_t has_fence;
+};
+
+/*
+ * consumer -> producer: the buffer can be reused once the fence sent
+ * with the message signals, or right away if there's no fence
+ */
+struct release_msg
+{
+	uint8_t output_id;
+	uint8_t buf_idx;
+};
+
 #define SOCKNAME "/tmp/mysock"
 #define SHARENAME "/omap-drm-test"
 
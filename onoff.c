@@ -6,22 +6,18 @@ static struct modeset_out *modeset_list = NULL;
 int main(int argc, char **argv)
 {
 	int opt;
-	int fd;
-	const char *card = "/dev/dri/card0";
+	struct modeset_devices devs = { 0 };
 
 	while ((opt = getopt(argc, argv, "c:")) != -1) {
 		switch (opt) {
 		case 'c':
-			card = optarg;
+			modeset_add_card(&devs, optarg);
 			break;
 		}
 	}
 
-	// open the DRM device
-	fd = drm_open_dev_dumb(card);
-
-	// Prepare all connectors and CRTCs
-	modeset_prepare(fd, &modeset_list);
+	// open the DRM devices and prepare all connectors and CRTCs
+	modeset_open_devices(&devs, &modeset_list);
 
 	// Allocate buffers
 	modeset_alloc_fbs(modeset_list, 1);
@@ -43,7 +39,7 @@ int main(int argc, char **argv)
 		usleep(500000);
 		for_each_output(out, modeset_list) {
 			usleep(1500000);
-			drm_set_dpms(fd, out->conn_id, out->dpms);
+			drm_set_dpms(out->fd, out->conn_id, out->dpms);
 
 			out->dpms = (c & 1) ? DRM_MODE_DPMS_OFF : DRM_MODE_DPMS_ON;
 		}
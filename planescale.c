@@ -9,12 +9,19 @@ struct flip_data {
 	int w, h;
 };
 
-static void find_planes(int fd, struct modeset_out *modeset_list)
+static void find_planes(struct modeset_out *modeset_list)
 {
 	for_each_output(out, modeset_list) {
 		struct flip_data *pdata = out->data;
 
-		uint32_t plane_id = drm_reserve_plane(fd);
+		const struct drm_plane_req req = {
+			.crtc_id = out->crtc_id,
+			.format = DRM_FORMAT_NV12,
+			.modifier = DRM_FORMAT_MOD_LINEAR,
+			.scaling = true,
+		};
+
+		uint32_t plane_id = drm_reserve_plane2(out->fd, &req);
 		ASSERT(plane_id > 0);
 
 		pdata->plane_id = plane_id;
@@ -26,23 +33,19 @@ static void find_planes(int fd, struct modeset_out *modeset_list)
 
 int main(int argc, char **argv)
 {
-	int fd;
 	int opt;
-	const char *card = "/dev/dri/card0";
+	struct modeset_devices devs = { 0 };
 
 	while ((opt = getopt(argc, argv, "c:")) != -1) {
 		switch (opt) {
 		case 'c':
-			card = optarg;
+			modeset_add_card(&devs, optarg);
 			break;
 		}
 	}
 
-	// open the DRM device
-	fd = drm_open_dev_dumb(card);
-
-	// Prepare all connectors and CRTCs
-	modeset_prepare(fd, &modeset_list);
+	// open the DRM devices and prepare all connectors and CRTCs
+	modeset_open_devices(&devs, &modeset_list);
 
 	// Allocate buffers
 	modeset_alloc_fbs(modeset_list, 2);
@@ -51,7 +54,7 @@ int main(int argc, char **argv)
 	for_each_output(out, modeset_list)
 		out->data = calloc(1, sizeof(struct flip_data));
 
-	find_planes(fd, modeset_list);
+	find_planes(modeset_list);
 
 	for_each_output(out, modeset_list) {
 		struct flip_data *pdata = out->data;
@@ -95,16 +98,10 @@ int main(int argc, char **argv)
 	for_each_output(out, modeset_list) {
 		struct flip_data *pdata = out->data;
 		struct framebuffer *buf;
-		int r;
 
 		buf = &pdata->plane_buf;
 
-		r = drmModeSetPlane(out->fd, pdata->plane_id, out->crtc_id,
-			buf->fb_id, 0,
-			0, 0, pdata->w, pdata->h,
-			0 << 16, 0 << 16,
-			buf->width << 16, buf->height << 16);
-		ASSERT(r == 0);
+		modeset_set_plane(out, pdata->plane_id, buf, 0, 0, pdata->w, pdata->h);
 	}
 
 	for_each_output(out, modeset_list) {
@@ -124,7 +121,7 @@ int main(int argc, char **argv)
 	// Free modeset data
 	modeset_cleanup(modeset_list);
 
-	close(fd);
+	modeset_close_devices(&devs);
 
 	fprintf(stderr, "exiting\n");
 
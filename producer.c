@@ -12,19 +12,48 @@ static const int bar_speed = 8;
 #define MAX_OUTPUTS 5
 #define BUF_QUEUE_SIZE 15
 
-static const bool always_create_new_bufs = false;
+/* idle buffers the pool keeps around for reuse */
+#define POOL_MAX_IDLE_BYTES (64 * 1024 * 1024)
 
 static struct {
 	int drm_fd;
 	volatile struct shared_data *sdata;
 	struct framebuffer bufs[MAX_OUTPUTS][BUF_QUEUE_SIZE];
 	int buf_num[MAX_OUTPUTS];
+	int num_bufs;
+
+	/*
+	 * A sent buffer is busy until the consumer releases it, and then
+	 * until its release fence signals, if it came with one.
+	 */
+	bool buf_busy[MAX_OUTPUTS][BUF_QUEUE_SIZE];
+	int release_fence[MAX_OUTPUTS][BUF_QUEUE_SIZE];
+
+	/* frame each buffer last held, for redrawing only what changed */
+	uint64_t buf_frame[MAX_OUTPUTS][BUF_QUEUE_SIZE];
+	struct damage_history damage[MAX_OUTPUTS];
+	struct drm_mode_rect bar_rect[MAX_OUTPUTS];
+
+	/* compare each frame against a full redraw */
+	bool verify;
+	uint8_t *verify_buf;
+
+	uint64_t pixels_drawn;
+	uint64_t pixels_full;
+
+	/*
+	 * Take a buffer from the pool for every frame instead of cycling
+	 * through a fixed set. A slot's buffer goes back to the pool when
+	 * the slot is reused, i.e. after the consumer released it.
+	 */
+	bool use_pool;
+	struct drm_fb_pool *pool;
+	struct framebuffer *pool_bufs[MAX_OUTPUTS][BUF_QUEUE_SIZE];
 } global;
 
-static void init_drm()
+/* the buffers only need a card to allocate from, not its outputs */
+static void init_drm(const char *card)
 {
-	const char *card = "/dev/dri/card0";
-
 	global.drm_fd = drm_open_dev_dumb(card);
 
 	drmDropMaster(global.drm_fd);
@@ -32,22 +61,25 @@ static void init_drm()
 
 static void uninit_drm()
 {
-	close(global.drm_fd);
+	drm_close_dev(global.drm_fd);
 }
 
-static void send_fb(int cfd, int output_id, struct framebuffer *fb)
+static void send_fb(int cfd, int output_id, int buf_idx, struct framebuffer *fb)
 {
 	int prime_fd;
 	int r;
-	char buf[1];
 
 	r = drmPrimeHandleToFD(global.drm_fd, fb->planes[0].handle, DRM_CLOEXEC, &prime_fd);
 	ASSERT(r == 0);
 
-	buf[0] = output_id;
+	/* drawn by the cpu, so ready without a fence */
+	struct buf_msg msg = {
+		.output_id = output_id,
+		.buf_idx = buf_idx,
+	};
 
-	size_t size = sock_fd_write(cfd, buf, 1, prime_fd);
-	ASSERT(size == 1);
+	size_t size = sock_fds_write(cfd, &msg, sizeof(msg), &prime_fd, 1);
+	ASSERT(size == sizeof(msg));
 
 	//printf ("sent fb handle %x, output %d, prime %d\n", fb->handle, output_id, prime_fd);
 
@@ -55,6 +87,126 @@ static void send_fb(int cfd, int output_id, struct framebuffer *fb)
 	ASSERT(r == 0);
 }
 
+static void verify_fb(int output_id, struct framebuffer *fb, int bar_xpos)
+{
+	struct framebuffer ref = {
+		.fd = -1,
+		.width = fb->width,
+		.height = fb->height,
+		.format = fb->format,
+		.num_planes = 1,
+	};
+
+	ref.planes[0].stride = fb->width * 4;
+	ref.planes[0].size = ref.planes[0].stride * fb->height;
+
+	global.verify_buf = realloc(global.verify_buf, ref.planes[0].size);
+	ASSERT(global.verify_buf);
+	ref.planes[0].map = global.verify_buf;
+
+	memset(ref.planes[0].map, 0, ref.planes[0].size);
+	drm_draw_color_bar(&ref, -1, bar_xpos, bar_width, NULL);
+
+	drm_fb_begin_cpu_access(fb, DRM_FB_ACCESS_READ);
+
+	for (unsigned y = 0; y < fb->height; ++y) {
+		if (memcmp(fb->planes[0].map + fb->planes[0].stride * y,
+			ref.planes[0].map + ref.planes[0].stride * y,
+			ref.planes[0].stride) == 0)
+			continue;
+
+		fprintf(stderr, "output %d: line %u differs from a full redraw\n",
+			output_id, y);
+		exit(1);
+	}
+
+	drm_fb_end_cpu_access(fb, DRM_FB_ACCESS_READ);
+}
+
+/* repaint the damaged rects, or the whole buffer if num_rects < 0 */
+static void redraw_fb(struct framebuffer *fb, const struct drm_mode_rect *rects,
+	int num_rects, int bar_xpos)
+{
+	drm_fb_begin_cpu_access(fb, DRM_FB_ACCESS_WRITE);
+
+	if (num_rects < 0) {
+		drm_clear_fb(fb);
+		global.pixels_drawn += fb->width * fb->height;
+	}
+
+	for (int i = 0; i < num_rects; ++i) {
+		drm_clear_rect(fb, &rects[i]);
+		global.pixels_drawn += (rects[i].x2 - rects[i].x1) * (rects[i].y2 - rects[i].y1);
+	}
+
+	global.pixels_full += fb->width * fb->height;
+
+	drm_draw_color_bar(fb, -1, bar_xpos, bar_width, NULL);
+
+	drm_fb_end_cpu_access(fb, DRM_FB_ACCESS_WRITE);
+}
+
+static bool buf_is_free(int output, int n)
+{
+	int *fence = &global.release_fence[output][n];
+
+	if (!global.buf_busy[output][n])
+		return true;
+
+	if (*fence < 0 || !fence_wait(*fence, 0))
+		return false;
+
+	close(*fence);
+	*fence = -1;
+	global.buf_busy[output][n] = false;
+
+	return true;
+}
+
+/* the next free buffer in ring order, -1 if all are still in use */
+static int find_free_buf(int output)
+{
+	for (int i = 0; i < global.num_bufs; ++i) {
+		int n = (global.buf_num[output] + i) % global.num_bufs;
+
+		if (buf_is_free(output, n))
+			return n;
+	}
+
+	return -1;
+}
+
+/* returns false if the consumer went away */
+static bool receive_release(int cfd)
+{
+	volatile struct shared_data *sdata = global.sdata;
+	struct release_msg msg;
+	int fds[SOCK_MAX_FDS];
+	int num_fds;
+	int i;
+
+	ssize_t size = sock_fds_read(cfd, &msg, sizeof(msg), fds, &num_fds);
+	if (size == 0)
+		return false;
+
+	ASSERT(size == sizeof(msg));
+
+	for (i = 0; i < sdata->num_outputs; ++i) {
+		if (sdata->outputs[i].output_id == msg.output_id)
+			break;
+	}
+
+	ASSERT(i < sdata->num_outputs && msg.buf_idx < global.num_bufs);
+	ASSERT(global.buf_busy[i][msg.buf_idx]);
+
+	if (num_fds > 0)
+		global.release_fence[i][msg.buf_idx] = fds[0];
+	else
+		global.buf_busy[i][msg.buf_idx] = false;
+
+	return true;
+}
+
 static void main_loop(int cfd)
 {
 	static int bar_xpos[10];
@@ -62,18 +214,34 @@ static void main_loop(int cfd)
 
 	fd_set fds;
 
-	FD_ZERO(&fds);
-
 	while (true) {
 		int r;
 
 		struct timeval tv = { .tv_usec = 1000 };
 
+		/* select() leaves the ready fds set, and fences get closed */
+		FD_ZERO(&fds);
 		FD_SET(0, &fds);
 		FD_SET(cfd, &fds);
 
 		volatile struct shared_data *sdata = global.sdata;
 
+		int max_fd = cfd;
+
+		/* wake up when a released buffer becomes free */
+		for (int i = 0; i < sdata->num_outputs; ++i) {
+			for (int n = 0; n < global.num_bufs; ++n) {
+				int fence = global.release_fence[i][n];
+
+				if (fence < 0)
+					continue;
+
+				FD_SET(fence, &fds);
+				if (fence > max_fd)
+					max_fd = fence;
+			}
+		}
+
 		//printf("C %d, %d\n",
 		//	sdata->outputs[0].request_count,
 		//	sdata->outputs[1].request_count);
@@ -89,7 +257,7 @@ static void main_loop(int cfd)
 			}
 		}
 
-		r = select(cfd + 1, &fds, NULL, NULL, &tv);
+		r = select(max_fd + 1, &fds, NULL, NULL, &tv);
 		ASSERT(r >= 0);
 
 		if (FD_ISSET(0, &fds)) {
@@ -97,7 +265,7 @@ static void main_loop(int cfd)
 			return;
 		}
 
-		if (FD_ISSET(cfd, &fds)) {
+		if (FD_ISSET(cfd, &fds) && !receive_release(cfd)) {
 			fprintf(stderr, "exit due to lost client\n");
 			return;
 		}
@@ -110,34 +278,72 @@ static void main_loop(int cfd)
 			if (output->request_count == 0)
 				continue;
 
+			/* the consumer still has all of them */
+			int buf_idx = find_free_buf(i);
+			if (buf_idx < 0)
+				continue;
+
 			output->request_count--;
 
+			global.buf_num[i] = (buf_idx + 1) % global.num_bufs;
+
 			struct framebuffer *fb;
 
 			const int width = output->width;
 			const int height = output->height;
 
-			if (always_create_new_bufs) {
-				fb = &global.bufs[i][0];
+			/* this frame moves the bar from its last place to bar_xpos */
+			struct drm_mode_rect damage[2];
+			int num_damage = 0;
+			uint64_t frame;
 
-				drm_create_dumb_fb2(global.drm_fd, width, height,
-					DRM_FORMAT_XRGB8888, fb);
+			if (global.damage[i].frame > 0)
+				damage[num_damage++] = global.bar_rect[i];
+
+			global.bar_rect[i] = (struct drm_mode_rect) {
+				bar_xpos[i], 0, bar_xpos[i] + bar_width, height
+			};
+			damage[num_damage++] = global.bar_rect[i];
+
+			frame = damage_history_add(&global.damage[i], damage, num_damage);
+
+			if (global.use_pool) {
+				struct framebuffer **slot;
+
+				slot = &global.pool_bufs[i][buf_idx];
+
+				if (*slot)
+					drm_fb_pool_release(global.pool, *slot);
+
+				fb = drm_fb_pool_acquire(global.pool, width, height,
+					DRM_FORMAT_XRGB8888);
+				*slot = fb;
+
+				/* we don't know what a recycled buffer last held */
+				redraw_fb(fb, NULL, -1, bar_xpos[i]);
 			} else {
+				struct drm_mode_rect rects[DAMAGE_MAX_RECTS];
+				uint64_t *buf_frame;
+				int num_rects;
+
+				fb = &global.bufs[i][buf_idx];
+				buf_frame = &global.buf_frame[i][buf_idx];
 
-				fb = &global.bufs[i][global.buf_num[i]];
-				global.buf_num[i] = (global.buf_num[i] + 1) % BUF_QUEUE_SIZE;
+				num_rects = damage_history_get(&global.damage[i], *buf_frame,
+					rects, ARRAY_SIZE(rects));
 
-				drm_clear_fb(fb);
+				redraw_fb(fb, rects, num_rects, bar_xpos[i]);
+
+				*buf_frame = frame;
 			}
 
-			drm_draw_color_bar(fb, -1, bar_xpos[i], bar_width);
+			if (global.verify)
+				verify_fb(output->output_id, fb, bar_xpos[i]);
 
 			bar_xpos[i] = (bar_xpos[i] + bar_speed) % (fb->width - bar_width);
 
-			send_fb(cfd, output->output_id, fb);
-
-			if (always_create_new_bufs)
-				drm_destroy_dumb_fb(fb);
+			send_fb(cfd, output->output_id, buf_idx, fb);
+			global.buf_busy[i][buf_idx] = true;
 
 			//printf("sent fb %d, handle %x\n", count, fb.handle);
 
@@ -166,6 +372,26 @@ static void open_shared_mem()
 	global.sdata = sdata;
 }
 
+static void release_pool_bufs()
+{
+	struct drm_fb_pool_stats stats;
+
+	for (int i = 0; i < MAX_OUTPUTS; ++i) {
+		for (int n = 0; n < BUF_QUEUE_SIZE; ++n) {
+			if (global.pool_bufs[i][n])
+				drm_fb_pool_release(global.pool, global.pool_bufs[i][n]);
+		}
+	}
+
+	drm_fb_pool_get_stats(global.pool, &stats);
+
+	printf("fb pool: %llu hits, %llu misses, %llu trimmed\n",
+		(unsigned long long)stats.hits, (unsigned long long)stats.misses,
+		(unsigned long long)stats.trimmed);
+
+	drm_fb_pool_destroy(global.pool);
+}
+
 static void create_bufs()
 {
 	volatile struct shared_data *sdata = global.sdata;
@@ -177,7 +403,7 @@ static void create_bufs()
 
 		output = &sdata->outputs[i];
 
-		for (int n = 0; n < BUF_QUEUE_SIZE; ++n) {
+		for (int n = 0; n < global.num_bufs; ++n) {
 			const int width = output->width;
 			const int height = output->height;
 
@@ -200,10 +426,38 @@ int main(int argc, char **argv)
 	int r;
 	struct sockaddr_un addr = { 0 };
 	int sfd;
+	int opt;
+	const char *card = "/dev/dri/card0";
+
+	global.num_bufs = BUF_QUEUE_SIZE;
+
+	for (int i = 0; i < MAX_OUTPUTS; ++i) {
+		for (int n = 0; n < BUF_QUEUE_SIZE; ++n)
+			global.release_fence[i][n] = -1;
+	}
+
+	while ((opt = getopt(argc, argv, "b:c:pv")) != -1) {
+		switch (opt) {
+		case 'c':
+			card = optarg;
+			break;
+		case 'b':
+			global.num_bufs = atoi(optarg);
+			/* one on screen and one to flip to */
+			ASSERT(global.num_bufs >= 2 && global.num_bufs <= BUF_QUEUE_SIZE);
+			break;
+		case 'p':
+			global.use_pool = true;
+			break;
+		case 'v':
+			global.verify = true;
+			break;
+		}
+	}
 
 	open_shared_mem();
 
-	init_drm();
+	init_drm(card);
 
 	unlink(SOCKNAME);
 
@@ -225,11 +479,20 @@ int main(int argc, char **argv)
 
 	printf("accepted connection\n");
 
-	if (!always_create_new_bufs)
+	if (global.use_pool)
+		global.pool = drm_fb_pool_create(global.drm_fd, POOL_MAX_IDLE_BYTES);
+	else
 		create_bufs();
 
 	main_loop(cfd);
 
+	if (global.use_pool)
+		release_pool_bufs();
+
+	if (global.pixels_full)
+		printf("repainted %.1f%% of the pixels of full redraws\n",
+			100.0 * global.pixels_drawn / global.pixels_full);
+
 	r = close(cfd);
 	ASSERT(r == 0);
 
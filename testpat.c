@@ -5,21 +5,20 @@ static struct modeset_out *modeset_list = NULL;
 
 static void usage()
 {
-	printf("usage: testpat <pattern>\n");
+	printf("usage: testpat [-c <card>]... [pattern]\n");
 
 	exit(1);
 }
 
 int main(int argc, char **argv)
 {
-	int fd;
 	int opt;
-	const char *card = "/dev/dri/card0";
+	struct modeset_devices devs = { 0 };
 
 	while ((opt = getopt(argc, argv, "c:")) != -1) {
 		switch (opt) {
 		case 'c':
-			card = optarg;
+			modeset_add_card(&devs, optarg);
 			break;
 		default:
 			usage();
@@ -36,11 +35,8 @@ int main(int argc, char **argv)
 	else
 		usage();
 
-	// open the DRM device
-	fd = drm_open_dev_dumb(card);
-
-	// Prepare all connectors and CRTCs
-	modeset_prepare(fd, &modeset_list);
+	// open the DRM devices and prepare all connectors and CRTCs
+	modeset_open_devices(&devs, &modeset_list);
 
 	// Allocate buffers
 	modeset_alloc_fbs(modeset_list, 1);
@@ -62,7 +58,7 @@ int main(int argc, char **argv)
 	// Free modeset data
 	modeset_cleanup(modeset_list);
 
-	close(fd);
+	modeset_close_devices(&devs);
 
 	fprintf(stderr, "exiting\n");
 